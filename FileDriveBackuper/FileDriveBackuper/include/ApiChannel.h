@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+
+// Latency of the API calls made to one endpoint, in microseconds from the
+// request being queued to its last response byte
+struct ApiLatency {
+  uint64_t calls = 0;
+  uint64_t failures = 0;
+  uint64_t totalUs = 0;
+  uint64_t maxUs = 0;
+  uint64_t lastUs = 0;
+
+  double averageMs() const {
+    return calls == 0 ? 0.0 : totalUs / 1000.0 / calls;
+  }
+};
+
+struct ApiChannelStatus {
+  bool http2Available = false;
+  bool http2Active = false;
+  uint64_t http2Streams = 0;
+  uint64_t http1Requests = 0;
+  size_t inFlight = 0;
+  size_t peakInFlight = 0;
+  std::map<std::string, ApiLatency> endpoints;
+};
+
+// Shared connection for the B2 JSON API. Calls from any thread are handed to
+// one cURL multi handle driven by its own thread, so on HTTP/2 they become
+// concurrent streams on a single connection instead of queueing on one easy
+// handle. ALPN picks HTTP/1.1 when the server or libcurl lacks HTTP/2; the
+// multi handle then spreads calls over up to maxHostConnections connections.
+// A stream-level HTTP/2 failure switches the channel to HTTP/1.1 for good.
+class ApiChannel
+{
+public:
+  bool enabled = true;
+  long maxConcurrentStreams = 100;
+  long maxHostConnections = 6;
+
+  ApiChannel() = default;
+  ApiChannel(const ApiChannel&) = delete;
+  ApiChannel& operator=(const ApiChannel&) = delete;
+
+  ~ApiChannel() {
+    stop();
+  }
+
+  static bool http2Available() {
+    curl_version_info_data* info = curl_version_info(CURLVERSION_NOW);
+    return info && (info->features & CURL_VERSION_HTTP2);
+  }
+
+  // Runs an easy handle set up by the caller to completion on the shared
+  // connection, blocking the calling thread only. endpoint labels the latency.
+  CURLcode perform(CURL* easy, const std::string& endpoint) {
+    if (!start()) {
+      return CURLE_FAILED_INIT;
+    }
+
+    if (m_useHttp2 && http2Available()) {
+      curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+      // Wait for the connection in progress and multiplex on it rather than opening another
+      curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    }
+    else {
+      curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_1_1);
+    }
+
+    Request request;
+    request.easy = easy;
+    request.queuedAt = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_stopping) {
+        return CURLE_ABORTED_BY_CALLBACK;
+      }
+      m_queue.push_back(&request);
+      curl_multi_wakeup(m_multi);
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [&request] { return request.finished; });
+
+    auto elapsed = std::chrono::steady_clock::now() - request.queuedAt;
+    uint64_t us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    ApiLatency& latency = m_latency[endpoint];
+    ++latency.calls;
+    if (request.result != CURLE_OK) {
+      ++latency.failures;
+    }
+    latency.totalUs += us;
+    latency.maxUs = std::max(latency.maxUs, us);
+    latency.lastUs = us;
+
+    long version = 0;
+    curl_easy_getinfo(easy, CURLINFO_HTTP_VERSION, &version);
+    if (version == CURL_HTTP_VERSION_2_0) {
+      ++m_http2Streams;
+    }
+    else if (request.result == CURLE_OK) {
+      ++m_http1Requests;
+    }
+
+    if (request.result == CURLE_HTTP2 || request.result == CURLE_HTTP2_STREAM) {
+      m_useHttp2 = false;
+    }
+    return request.result;
+  }
+
+  ApiChannelStatus status() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ApiChannelStatus status;
+    status.http2Available = http2Available();
+    status.http2Active = m_useHttp2 && status.http2Available;
+    status.http2Streams = m_http2Streams;
+    status.http1Requests = m_http1Requests;
+    status.inFlight = m_running.size() + m_queue.size();
+    status.peakInFlight = m_peakInFlight;
+    status.endpoints = m_latency;
+    return status;
+  }
+
+  // Cancels calls still in flight with CURLE_ABORTED_BY_CALLBACK. Must run before curl_global_cleanup.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_multi) {
+        return;
+      }
+      m_stopping = true;
+    }
+    curl_multi_wakeup(m_multi);
+    if (m_driver.joinable()) {
+      m_driver.join();
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    curl_multi_cleanup(m_multi);
+    m_multi = nullptr;
+    m_stopping = false;
+  }
+
+private:
+  struct Request {
+    CURL* easy = nullptr;
+    CURLcode result = CURLE_OK;
+    bool finished = false;
+    std::chrono::steady_clock::time_point queuedAt;
+  };
+
+  bool start() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_multi) {
+      return !m_stopping;
+    }
+    m_multi = curl_multi_init();
+    if (!m_multi) {
+      return false;
+    }
+    curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(m_multi, CURLMOPT_MAX_CONCURRENT_STREAMS, maxConcurrentStreams);
+    curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, maxHostConnections);
+    m_driver = std::thread(&ApiChannel::drive, this);
+    return true;
+  }
+
+  void drive() {
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stopping) {
+          break;
+        }
+        while (!m_queue.empty()) {
+          Request* request = m_queue.front();
+          m_queue.pop_front();
+          m_running[request->easy] = request;
+          curl_multi_add_handle(m_multi, request->easy);
+        }
+        m_peakInFlight = std::max(m_peakInFlight, m_running.size());
+      }
+
+      int stillRunning = 0;
+      curl_multi_perform(m_multi, &stillRunning);
+
+      int messages = 0;
+      while (CURLMsg* message = curl_multi_info_read(m_multi, &messages)) {
+        if (message->msg == CURLMSG_DONE) {
+          finish(message->easy_handle, message->data.result);
+        }
+      }
+
+      curl_multi_poll(m_multi, nullptr, 0, 1000, nullptr);
+    }
+
+    std::vector<CURL*> abandoned;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (Request* request : m_queue) {
+        request->result = CURLE_ABORTED_BY_CALLBACK;
+        request->finished = true;
+      }
+      m_queue.clear();
+      for (const auto& item : m_running) {
+        abandoned.push_back(item.first);
+      }
+    }
+    for (CURL* easy : abandoned) {
+      finish(easy, CURLE_ABORTED_BY_CALLBACK);
+    }
+    m_done.notify_all();
+  }
+
+  void finish(CURL* easy, CURLcode result) {
+    curl_multi_remove_handle(m_multi, easy);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_running.find(easy);
+      if (it == m_running.end()) {
+        return;
+      }
+      it->second->result = result;
+      it->second->finished = true;
+      m_running.erase(it);
+    }
+    m_done.notify_all();
+  }
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_done;
+  CURLM* m_multi = nullptr;
+  std::thread m_driver;
+  bool m_stopping = false;
+  std::atomic<bool> m_useHttp2{ true };
+  std::deque<Request*> m_queue;
+  std::map<CURL*, Request*> m_running;
+  size_t m_peakInFlight = 0;
+  uint64_t m_http2Streams = 0;
+  uint64_t m_http1Requests = 0;
+  std::map<std::string, ApiLatency> m_latency;
+};
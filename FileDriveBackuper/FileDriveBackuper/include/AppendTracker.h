@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <openssl/sha.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "ChunkStore.h"
+
+// One object holding bytes [offset, offset + size) of a growing file
+struct AppendSegment {
+  std::string object;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  std::string sha1;
+};
+
+// What was backed up of a growing file: its size, a SHA1 per fixed-size leaf
+// (the last one may be partial) and the objects that together hold its bytes.
+struct AppendState {
+  std::string sourcePath;
+  uint64_t size = 0;
+  std::vector<std::string> leaves;
+  std::vector<AppendSegment> segments;
+};
+
+inline std::string tailObjectName(const std::string& baseObject, uint64_t offset) {
+  return "tails/" + baseObject + "/" + std::to_string(offset);
+}
+
+// Detects files that only grew since their last backup, so just the new tail
+// has to be copied and uploaded. The prefix is checked against the stored leaf
+// hashes: the first leaf (headers get rewritten), the old last leaf (where
+// appends land) and a few random ones, or all of them with verifyWholePrefix.
+class AppendTracker
+{
+public:
+  static constexpr uint64_t kLeafSize = 4 * 1024 * 1024;
+
+  int spotChecks = 4;
+  bool verifyWholePrefix = false;
+
+  void open(const std::filesystem::path& directory) {
+    m_directory = directory;
+  }
+
+  bool load(const std::string& sourcePath, AppendState& state) const {
+    std::ifstream in(statePath(sourcePath));
+    if (!in) {
+      return false;
+    }
+
+    state = AppendState();
+    std::string line;
+    while (std::getline(in, line)) {
+      std::vector<std::string> fields;
+      std::stringstream stream(line);
+      std::string field;
+      while (std::getline(stream, field, '\t')) {
+        fields.push_back(field);
+      }
+
+      if (fields.size() == 2 && fields[0] == "source") {
+        state.sourcePath = fields[1];
+      }
+      else if (fields.size() == 2 && fields[0] == "size") {
+        if (!parseNumber(fields[1], state.size)) {
+          return false;
+        }
+      }
+      else if (fields.size() == 2 && fields[0] == "leaf") {
+        state.leaves.push_back(fields[1]);
+      }
+      else if (fields.size() == 5 && fields[0] == "segment") {
+        AppendSegment segment;
+        segment.object = fields[1];
+        segment.sha1 = fields[4];
+        // A damaged state file means a whole copy, not an exception every cycle
+        if (!parseNumber(fields[2], segment.offset) || !parseNumber(fields[3], segment.size)) {
+          return false;
+        }
+        state.segments.push_back(segment);
+      }
+    }
+    return state.sourcePath == sourcePath && !state.segments.empty() &&
+      state.leaves.size() == (state.size + kLeafSize - 1) / kLeafSize;
+  }
+
+  bool save(const AppendState& state) const {
+    std::error_code error;
+    std::filesystem::create_directories(m_directory, error);
+
+    std::filesystem::path path = statePath(state.sourcePath);
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+      std::ofstream out(temporary, std::ios::trunc);
+      out << "source\t" << state.sourcePath << '\n';
+      out << "size\t" << state.size << '\n';
+      for (const auto& leaf : state.leaves) {
+        out << "leaf\t" << leaf << '\n';
+      }
+      for (const auto& segment : state.segments) {
+        out << "segment\t" << segment.object << '\t' << segment.offset << '\t'
+          << segment.size << '\t' << segment.sha1 << '\n';
+      }
+      if (!out) {
+        return false;
+      }
+    }
+    std::filesystem::rename(temporary, path, error);
+    return !error;
+  }
+
+  void forget(const std::string& sourcePath) const {
+    std::error_code error;
+    std::filesystem::remove(statePath(sourcePath), error);
+  }
+
+  // Forgets the state of sourcePath if its tails build on baseObject, which was
+  // never uploaded. Returns true if it did.
+  bool forgetBase(const std::string& sourcePath, const std::string& baseObject) const {
+    AppendState state;
+    if (!load(sourcePath, state) || state.segments.front().object != baseObject) {
+      return false;
+    }
+    forget(sourcePath);
+    return true;
+  }
+
+  // True if the first state.size bytes of the file still match the stored leaves
+  bool prefixUnchanged(const std::filesystem::path& path, const AppendState& state) const {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      return false;
+    }
+
+    std::vector<size_t> checks;
+    size_t leafCount = state.leaves.size();
+    if (verifyWholePrefix) {
+      for (size_t i = 0; i < leafCount; ++i) {
+        checks.push_back(i);
+      }
+    }
+    else if (leafCount > 0) {
+      checks.push_back(0);
+      checks.push_back(leafCount - 1);
+      thread_local std::mt19937 rng(std::random_device{}());
+      for (int i = 0; i < spotChecks && leafCount > 2; ++i) {
+        checks.push_back(std::uniform_int_distribution<size_t>(1, leafCount - 2)(rng));
+      }
+    }
+
+    std::vector<char> buffer(kLeafSize);
+    for (size_t leaf : checks) {
+      uint64_t offset = leaf * kLeafSize;
+      size_t length = static_cast<size_t>(std::min<uint64_t>(kLeafSize, state.size - offset));
+      file.seekg(static_cast<std::streamoff>(offset));
+      file.read(buffer.data(), length);
+      if (static_cast<size_t>(file.gcount()) != length ||
+          sha1Hex(buffer.data(), length) != state.leaves[leaf]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Fresh state for a file backed up whole as baseObject. The local copy is
+  // hashed rather than the source so the leaves match what was uploaded.
+  static bool startFromBase(const std::filesystem::path& localCopy,
+                            const std::string& sourcePath,
+                            const std::string& baseObject,
+                            AppendState& state) {
+    std::ifstream file(localCopy, std::ios::binary);
+    if (!file) {
+      return false;
+    }
+
+    state = AppendState();
+    state.sourcePath = sourcePath;
+
+    SHA_CTX context;
+    SHA1_Init(&context);
+    std::vector<char> buffer(kLeafSize);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+      size_t length = static_cast<size_t>(file.gcount());
+      SHA1_Update(&context, buffer.data(), length);
+      state.leaves.push_back(sha1Hex(buffer.data(), length));
+      state.size += length;
+    }
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1_Final(hash, &context);
+    std::stringstream ss;
+    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+      ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    }
+
+    AppendSegment base;
+    base.object = baseObject;
+    base.size = state.size;
+    base.sha1 = ss.str();
+    state.segments.push_back(base);
+    return true;
+  }
+
+  // Rehashes from the start of the old partial leaf up to newSize. Reads at most
+  // one leaf more than the new bytes.
+  static bool extendLeaves(const std::filesystem::path& path, AppendState& state, uint64_t newSize) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      return false;
+    }
+
+    size_t firstLeaf = static_cast<size_t>(state.size / kLeafSize);
+    state.leaves.resize(firstLeaf);
+    file.seekg(static_cast<std::streamoff>(firstLeaf * kLeafSize));
+
+    std::vector<char> buffer(kLeafSize);
+    for (uint64_t offset = firstLeaf * kLeafSize; offset < newSize; offset += kLeafSize) {
+      size_t length = static_cast<size_t>(std::min<uint64_t>(kLeafSize, newSize - offset));
+      file.read(buffer.data(), length);
+      if (static_cast<size_t>(file.gcount()) != length) {
+        return false;
+      }
+      state.leaves.push_back(sha1Hex(buffer.data(), length));
+    }
+    state.size = newSize;
+    return true;
+  }
+
+  // Copies bytes [offset, offset + size) of source into destination and returns their SHA1
+  static bool copyRange(const std::filesystem::path& source, uint64_t offset, uint64_t size,
+                        const std::filesystem::path& destination, std::string& sha1) {
+    std::ifstream in(source, std::ios::binary);
+    std::ofstream out(destination, std::ios::binary | std::ios::trunc);
+    if (!in || !out) {
+      return false;
+    }
+    in.seekg(static_cast<std::streamoff>(offset));
+
+    SHA_CTX context;
+    SHA1_Init(&context);
+    std::vector<char> buffer(1024 * 1024);
+    for (uint64_t left = size; left > 0; ) {
+      size_t length = static_cast<size_t>(std::min<uint64_t>(buffer.size(), left));
+      in.read(buffer.data(), length);
+      if (static_cast<size_t>(in.gcount()) != length) {
+        return false;
+      }
+      SHA1_Update(&context, buffer.data(), length);
+      out.write(buffer.data(), length);
+      left -= length;
+    }
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1_Final(hash, &context);
+    std::stringstream ss;
+    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+      ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    }
+    sha1 = ss.str();
+    return static_cast<bool>(out);
+  }
+
+  // Restoring a version concatenates its segments in order
+  static std::string manifestJson(const std::string& fileName, const AppendState& state) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("fileName");
+    writer.String(fileName.c_str());
+    writer.Key("size");
+    writer.Uint64(state.size);
+    writer.Key("segments");
+    writer.StartArray();
+    for (const auto& segment : state.segments) {
+      writer.StartObject();
+      writer.Key("object");
+      writer.String(segment.object.c_str());
+      writer.Key("offset");
+      writer.Uint64(segment.offset);
+      writer.Key("size");
+      writer.Uint64(segment.size);
+      writer.Key("sha1");
+      writer.String(segment.sha1.c_str());
+      writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return std::string(buffer.GetString(), buffer.GetSize());
+  }
+
+private:
+  static bool parseNumber(const std::string& text, uint64_t& value) {
+    if (text.empty() || text[0] < '0' || text[0] > '9') {
+      return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtoull(text.c_str(), &end, 10);
+    return errno == 0 && *end == '\0';
+  }
+
+  std::filesystem::path statePath(const std::string& sourcePath) const {
+    return m_directory / ("append_" + sha1Hex(sourcePath.data(), sourcePath.size()).substr(0, 16) + ".state");
+  }
+
+  std::filesystem::path m_directory;
+};
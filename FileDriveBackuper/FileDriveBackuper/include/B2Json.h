@@ -0,0 +1,399 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <rapidjson/allocators.h>
+#include <rapidjson/reader.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+// Per-thread scratch for B2 API JSON. Request bodies are written into one
+// reusable buffer, and the writer and reader stacks come from a pool that
+// starts in a fixed arena, so a warmed-up thread builds and parses API calls
+// without touching the heap.
+class JsonScratch
+{
+public:
+  typedef rapidjson::MemoryPoolAllocator<> Pool;
+
+  static JsonScratch& local() {
+    thread_local JsonScratch scratch;
+    return scratch;
+  }
+
+  // Borrows the pool; it is cleared when the outermost lease ends
+  class Lease
+  {
+  public:
+    Lease() : m_scratch(local()) {
+      ++m_scratch.m_leases;
+    }
+
+    ~Lease() {
+      if (--m_scratch.m_leases == 0) {
+        m_scratch.m_pool.Clear();
+      }
+    }
+
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+
+    Pool& pool() {
+      return m_scratch.m_pool;
+    }
+
+  private:
+    JsonScratch& m_scratch;
+  };
+
+  rapidjson::StringBuffer request;
+  // Response of the last paged call on this thread, keeps its capacity between pages
+  std::string response;
+
+private:
+  JsonScratch() : m_pool(m_arena, sizeof(m_arena)) {}
+
+  char m_arena[16 * 1024];
+  Pool m_pool;
+  int m_leases = 0;
+};
+
+typedef rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::UTF8<>, JsonScratch::Pool> JsonRequestWriter;
+
+// Builds a request body with build(JsonRequestWriter&) into this thread's
+// buffer. The view stays valid until the next body is built on the thread.
+template <typename Build>
+std::string_view buildJson(Build&& build) {
+  JsonScratch::Lease lease;
+  rapidjson::StringBuffer& buffer = JsonScratch::local().request;
+  buffer.Clear();
+  JsonRequestWriter writer(buffer, &lease.pool());
+  build(writer);
+  return std::string_view(buffer.GetString(), buffer.GetSize());
+}
+
+// SAX parse of text in place: strings are unescaped into text itself and
+// handed to the handler without copies. text is modified.
+template <typename Handler>
+bool parseJsonInsitu(std::string& text, Handler& handler) {
+  if (text.empty()) {
+    return false;
+  }
+  JsonScratch::Lease lease;
+  rapidjson::GenericReader<rapidjson::UTF8<>, rapidjson::UTF8<>, JsonScratch::Pool> reader(&lease.pool());
+  rapidjson::InsituStringStream stream(&text[0]);
+  return !reader.Parse<rapidjson::kParseInsituFlag | rapidjson::kParseStopWhenDoneFlag>(stream, handler).IsError();
+}
+
+// Picks a few scalar fields out of a response. Fields are named by their path
+// of object keys from the top, "allowed.bucketId"; arrays are skipped whole.
+class JsonFields : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, JsonFields>
+{
+public:
+  static constexpr int kMaxFields = 8;
+  static constexpr int kMaxDepth = 8;
+
+  void text(const char* path, std::string& out) {
+    add(path, &out, nullptr);
+  }
+
+  void number(const char* path, uint64_t& out) {
+    add(path, nullptr, &out);
+  }
+
+  // True if the field was present in the parsed response
+  bool has(const char* path) const {
+    for (int i = 0; i < m_count; ++i) {
+      if (strcmp(m_fields[i].path, path) == 0) {
+        return m_fields[i].seen;
+      }
+    }
+    return false;
+  }
+
+  bool parse(std::string& response) {
+    m_depth = 0;
+    m_arrays = 0;
+    m_pathLength = 0;
+    for (int i = 0; i < m_count; ++i) {
+      m_fields[i].seen = false;
+    }
+    return parseJsonInsitu(response, *this);
+  }
+
+  bool StartObject() {
+    if (m_arrays == 0) {
+      if (m_depth >= kMaxDepth) {
+        return false;
+      }
+      m_marks[m_depth++] = m_pathLength;
+    }
+    return true;
+  }
+
+  bool EndObject(rapidjson::SizeType) {
+    if (m_arrays == 0 && m_depth > 0) {
+      m_pathLength = m_marks[--m_depth];
+    }
+    return true;
+  }
+
+  bool StartArray() {
+    ++m_arrays;
+    return true;
+  }
+
+  bool EndArray(rapidjson::SizeType) {
+    --m_arrays;
+    return true;
+  }
+
+  bool Key(const char* key, rapidjson::SizeType length, bool) {
+    if (m_arrays > 0) {
+      return true;
+    }
+    size_t at = m_marks[m_depth - 1];
+    size_t needed = at + (at > 0 ? 1 : 0) + length;
+    if (needed >= sizeof(m_path)) {
+      m_pathLength = at;
+      return true;
+    }
+    if (at > 0) {
+      m_path[at++] = '.';
+    }
+    memcpy(m_path + at, key, length);
+    m_pathLength = at + length;
+    m_path[m_pathLength] = '\0';
+    return true;
+  }
+
+  bool String(const char* value, rapidjson::SizeType length, bool) {
+    if (Field* field = current()) {
+      if (field->text) {
+        field->text->assign(value, length);
+      }
+      field->seen = true;
+    }
+    return true;
+  }
+
+  bool Uint64(uint64_t value) {
+    if (Field* field = current()) {
+      if (field->number) {
+        *field->number = value;
+      }
+      else if (field->text) {
+        field->text->assign(std::to_string(value));
+      }
+      field->seen = true;
+    }
+    return true;
+  }
+
+  bool Uint(unsigned value) {
+    return Uint64(value);
+  }
+
+  bool Int(int value) {
+    return value < 0 ? Default() : Uint64(static_cast<uint64_t>(value));
+  }
+
+  bool Int64(int64_t value) {
+    return value < 0 ? Default() : Uint64(static_cast<uint64_t>(value));
+  }
+
+private:
+  struct Field {
+    const char* path = nullptr;
+    std::string* text = nullptr;
+    uint64_t* number = nullptr;
+    bool seen = false;
+  };
+
+  void add(const char* path, std::string* text, uint64_t* number) {
+    if (m_count < kMaxFields) {
+      m_fields[m_count++] = { path, text, number, false };
+    }
+  }
+
+  Field* current() {
+    if (m_arrays > 0 || m_depth == 0) {
+      return nullptr;
+    }
+    for (int i = 0; i < m_count; ++i) {
+      if (strlen(m_fields[i].path) == m_pathLength && memcmp(m_fields[i].path, m_path, m_pathLength) == 0) {
+        return &m_fields[i];
+      }
+    }
+    return nullptr;
+  }
+
+  Field m_fields[kMaxFields];
+  int m_count = 0;
+  int m_depth = 0;
+  int m_arrays = 0;
+  size_t m_marks[kMaxDepth] = {};
+  char m_path[128] = {};
+  size_t m_pathLength = 0;
+};
+
+// One entry of a b2_list_file_names page
+struct B2FileEntry {
+  std::string fileName;
+  std::string fileId;
+  std::string action;
+  std::string contentSha1;
+  std::string largeFileSha1; // fileInfo.large_file_sha1
+  uint64_t contentLength = 0;
+  uint64_t uploadTimestamp = 0;
+};
+
+// Streams the "files" array of a b2_list_file_names page into onFile, one
+// entry at a time. Depth counts objects and arrays: a file is at 3, its
+// fileInfo at 4. The entry is reused, so a page costs no allocations once
+// its strings have grown to their usual length.
+class B2ListingHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, B2ListingHandler>
+{
+public:
+  explicit B2ListingHandler(const std::function<void(const B2FileEntry&)>& onFile) : m_onFile(onFile) {}
+
+  std::string nextFileName;
+  bool sawFiles = false;
+
+  bool parse(std::string& response) {
+    m_depth = 0;
+    m_inFiles = false;
+    m_key = Slot::Other;
+    nextFileName.clear();
+    sawFiles = false;
+    return parseJsonInsitu(response, *this);
+  }
+
+  bool StartObject() {
+    ++m_depth;
+    if (m_inFiles && m_depth == 3) {
+      m_entry.fileName.clear();
+      m_entry.fileId.clear();
+      m_entry.action.clear();
+      m_entry.contentSha1.clear();
+      m_entry.largeFileSha1.clear();
+      m_entry.contentLength = 0;
+      m_entry.uploadTimestamp = 0;
+    }
+    return true;
+  }
+
+  bool EndObject(rapidjson::SizeType) {
+    if (m_inFiles && m_depth == 3) {
+      m_onFile(m_entry);
+    }
+    --m_depth;
+    m_key = Slot::Other;
+    return true;
+  }
+
+  bool StartArray() {
+    if (m_depth == 1 && m_key == Slot::Files) {
+      m_inFiles = true;
+      sawFiles = true;
+    }
+    ++m_depth;
+    return true;
+  }
+
+  bool EndArray(rapidjson::SizeType) {
+    --m_depth;
+    if (m_depth == 1) {
+      m_inFiles = false;
+    }
+    m_key = Slot::Other;
+    return true;
+  }
+
+  bool Key(const char* key, rapidjson::SizeType length, bool) {
+    std::string_view name(key, length);
+    m_key = Slot::Other;
+    if (m_depth == 1) {
+      if (name == "files") m_key = Slot::Files;
+      else if (name == "nextFileName") m_key = Slot::NextFileName;
+    }
+    else if (m_inFiles && m_depth == 3) {
+      if (name == "fileName") m_key = Slot::FileName;
+      else if (name == "fileId") m_key = Slot::FileId;
+      else if (name == "action") m_key = Slot::Action;
+      else if (name == "contentSha1") m_key = Slot::ContentSha1;
+      else if (name == "contentLength") m_key = Slot::ContentLength;
+      else if (name == "uploadTimestamp") m_key = Slot::UploadTimestamp;
+    }
+    else if (m_inFiles && m_depth == 4 && name == "large_file_sha1") {
+      m_key = Slot::LargeFileSha1;
+    }
+    return true;
+  }
+
+  bool String(const char* value, rapidjson::SizeType length, bool) {
+    switch (m_key) {
+    case Slot::NextFileName: nextFileName.assign(value, length); break;
+    case Slot::FileName: m_entry.fileName.assign(value, length); break;
+    case Slot::FileId: m_entry.fileId.assign(value, length); break;
+    case Slot::Action: m_entry.action.assign(value, length); break;
+    case Slot::ContentSha1: m_entry.contentSha1.assign(value, length); break;
+    case Slot::LargeFileSha1: m_entry.largeFileSha1.assign(value, length); break;
+    default: break;
+    }
+    m_key = Slot::Other;
+    return true;
+  }
+
+  bool Uint64(uint64_t value) {
+    if (m_key == Slot::ContentLength) {
+      m_entry.contentLength = value;
+    }
+    else if (m_key == Slot::UploadTimestamp) {
+      m_entry.uploadTimestamp = value;
+    }
+    m_key = Slot::Other;
+    return true;
+  }
+
+  bool Uint(unsigned value) {
+    return Uint64(value);
+  }
+
+  bool Int(int value) {
+    return value < 0 ? Default() : Uint64(static_cast<uint64_t>(value));
+  }
+
+  bool Int64(int64_t value) {
+    return value < 0 ? Default() : Uint64(static_cast<uint64_t>(value));
+  }
+
+  bool Default() {
+    m_key = Slot::Other;
+    return true;
+  }
+
+private:
+  enum class Slot {
+    Other,
+    Files,
+    NextFileName,
+    FileName,
+    FileId,
+    Action,
+    ContentSha1,
+    LargeFileSha1,
+    ContentLength,
+    UploadTimestamp
+  };
+
+  const std::function<void(const B2FileEntry&)>& m_onFile;
+  B2FileEntry m_entry;
+  int m_depth = 0;
+  bool m_inFiles = false;
+  Slot m_key = Slot::Other;
+};
@@ -0,0 +1,957 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <functional>
+#include <string_view>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <mutex>
+#include <vector>
+#include <curl/curl.h>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+#include <openssl/buffer.h>
+#include <openssl/evp.h>
+
+#include "TransferWatchdog.h"
+#include "RateLimiter.h"
+#include "ApiChannel.h"
+#include "B2Json.h"
+#include "StageMetrics.h"
+
+struct UploadAuthorization {
+  std::string uploadUrl = "";
+  std::string authorizationToken = "";
+};
+
+struct BackblazeCredentials
+{
+  std::string accountId = "";
+  std::string applicationKey = "";
+  // Replaced by authenticate() while uploads run: set before any thread
+  // starts, then go through getBucketId(), getBucketName() and setBucketName()
+  std::string bucketId = "";
+  std::string bucketName = "";
+
+  std::string authToken;
+  std::string apiUrl;
+  std::string downloadUrl;
+
+  std::atomic<bool> isAuthenticated{ false };
+  // authToken, apiUrl, downloadUrl and the bucket change when an expired token
+  // is renewed while other threads are using them
+  mutable std::mutex tokenMutex;
+  // One renewal at a time, the others then retry with its token
+  std::mutex renewMutex;
+  CURL* curl = nullptr;
+  // Idle handles for uploadBuffer, so concurrent uploads each get their own and keep their connection
+  std::vector<CURL*> uploadCurls;
+  std::mutex uploadCurlMutex;
+  std::mutex apiMutex;
+  // JSON API calls share one multiplexed connection when enabled, else the locked curl handle
+  ApiChannel apiChannel;
+
+  // Applied to every request made with these credentials
+  TransferTimeouts timeouts;
+  TransferTimeouts apiTimeouts = [] {
+    TransferTimeouts t;
+    t.totalTimeoutMs = 120000;
+    return t;
+  }();
+  RetryPolicy retryPolicy;
+  TransferStats* stats = nullptr;
+  PipelineMetrics* metrics = nullptr;
+  const std::atomic<bool>* cancel = nullptr;
+  RateLimiter* rateLimiter = nullptr;
+
+  BackblazeCredentials() {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    curl = curl_easy_init();
+  }
+
+  ~BackblazeCredentials() {
+    apiChannel.stop();
+    if (curl) {
+      curl_easy_cleanup(curl);
+    }
+    for (CURL* uploadCurl : uploadCurls) {
+      curl_easy_cleanup(uploadCurl);
+    }
+    curl_global_cleanup();
+  }
+
+  static size_t writeCallback(char* ptr, size_t size, size_t nmemb, std::string* response) {
+    size_t totalSize = size * nmemb;
+    response->append(ptr, totalSize);
+    return totalSize;
+  }
+
+  std::string b2ApiCall(const std::string& endpoint,
+    std::string_view postData = {},
+    const std::string& customAuthToken = "") {
+    std::string response;
+    if (!b2ApiRequest(endpoint, postData, response, customAuthToken)) {
+      return "";
+    }
+    return response;
+  }
+
+  // b2ApiCall into a caller-owned buffer, so paged calls can reuse its capacity
+  bool b2ApiRequest(const std::string& endpoint,
+    std::string_view postData,
+    std::string& response,
+    const std::string& customAuthToken = "") {
+    if (!curl) {
+      std::cerr << "cURL not initialized" << std::endl;
+      return false;
+    }
+
+    bool renewed = false;
+    for (int attempt = 0; ; ++attempt) {
+      std::string url;
+      std::string token;
+      {
+        std::lock_guard<std::mutex> lock(tokenMutex);
+        token = customAuthToken.empty() ? authToken : customAuthToken;
+        // Special handling for authorization call
+        if (endpoint == "b2_authorize_account") {
+          url = "https://api.backblazeb2.com/b2api/v2/" + endpoint;
+        }
+        else if (apiUrl.empty()) {
+          // Fallback if apiUrl is not set
+          url = "https://api.backblazeb2.com/b2api/v2/" + endpoint;
+          std::cout << "WARNING: Using fallback API URL: " << url << std::endl;
+        }
+        else {
+          url = apiUrl + "/b2api/v2/" + endpoint;
+        }
+      }
+
+      response.clear();
+      TransferError error = TransferError::None;
+      long http_code = 0;
+      CURLcode res = CURLE_OK;
+      auto setup = [&](CURL* handle, struct curl_slist*& headers) {
+        std::string authHeader = "Authorization: " + token;
+        headers = curl_slist_append(headers, authHeader.c_str());
+
+        if (!postData.empty()) {
+          headers = curl_slist_append(headers, "Content-Type: application/json");
+          curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)postData.size());
+          curl_easy_setopt(handle, CURLOPT_POSTFIELDS, postData.data());
+          curl_easy_setopt(handle, CURLOPT_POST, 1L);
+        }
+        else {
+          curl_easy_setopt(handle, CURLOPT_HTTPGET, 1L);
+        }
+
+        curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCallback);
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, &response);
+      };
+
+      CURL* streamCurl = apiChannel.enabled ? curl_easy_init() : nullptr;
+      if (streamCurl) {
+        // One handle per call, the connection lives in the channel
+        struct curl_slist* headers = nullptr;
+        setup(streamCurl, headers);
+
+        TransferGuard guard(apiTimeouts, cancel);
+        guard.attach(streamCurl);
+
+        res = apiChannel.perform(streamCurl, endpoint);
+        curl_easy_getinfo(streamCurl, CURLINFO_RESPONSE_CODE, &http_code);
+        curl_slist_free_all(headers);
+        curl_easy_cleanup(streamCurl);
+        error = guard.classify(res, http_code);
+        TransferGuard::count(error, stats);
+      }
+      else {
+        // The API handle is shared by every upload thread
+        std::lock_guard<std::mutex> lock(apiMutex);
+
+        struct curl_slist* headers = nullptr;
+        setup(curl, headers);
+
+        TransferGuard guard(apiTimeouts, cancel);
+        guard.attach(curl);
+
+        res = curl_easy_perform(curl);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        curl_slist_free_all(headers);
+        error = guard.classify(res, http_code);
+        TransferGuard::count(error, stats);
+      }
+
+      // Account tokens live 24 hours; a 401 gets one renewal and the call again.
+      // A second 401 means the key itself is wrong, retrying would not help.
+      if (error == TransferError::AuthExpired && customAuthToken.empty() &&
+          endpoint != "b2_authorize_account" && !renewed) {
+        renewed = true;
+        std::cerr << "B2 API call " << endpoint << " got 401, renewing the account token" << std::endl;
+        if (renewAuthorization(token)) {
+          continue;
+        }
+      }
+
+      if (error != TransferError::None && error != TransferError::AuthExpired &&
+          isRetryable(error) && attempt + 1 < retryPolicy.maxAttempts) {
+        std::cerr << "B2 API call " << endpoint << " " << transferErrorName(error) << ", retrying" << std::endl;
+        if (stats) {
+          stats->retries++;
+        }
+        if (retryPolicy.backoff(attempt, cancel)) {
+          continue;
+        }
+      }
+
+      if (res != CURLE_OK) {
+        std::cerr << "B2 API call failed: " << curl_easy_strerror(res) << std::endl;
+        std::cerr << "URL: " << url << std::endl;
+        return false;
+      }
+
+      if (http_code != 200) {
+        std::cerr << "HTTP Error: " << http_code << std::endl;
+        std::cerr << "Response: " << response << std::endl;
+        return false;
+      }
+
+      return true;
+    }
+  }
+
+  bool authenticate() {
+    StageTimer timer(metrics, Stage::Authenticate);
+
+    // Never print the key, the Basic header or the response: they hold secrets
+    std::cout << "Authenticating account " << accountId << std::endl;
+
+    std::string authHeader = "Basic " + base64Encode(accountId + ":" + applicationKey);
+    std::string response = b2ApiCall("b2_authorize_account", "", authHeader);
+
+    if (response.empty()) {
+      return false;
+    }
+
+    std::string errorCode, errorMessage, token, newApiUrl, newDownloadUrl, allowedBucketId, allowedBucketName;
+    std::string b2AccountId;
+    JsonFields fields;
+    fields.text("accountId", b2AccountId);
+    fields.text("code", errorCode);
+    fields.text("message", errorMessage);
+    fields.text("authorizationToken", token);
+    fields.text("apiUrl", newApiUrl);
+    fields.text("downloadUrl", newDownloadUrl);
+    fields.text("allowed.bucketId", allowedBucketId);
+    fields.text("allowed.bucketName", allowedBucketName);
+    bool parsed = fields.parse(response);
+
+    // Check for authentication error first
+    if (fields.has("code") && fields.has("message")) {
+      std::cerr << "Authentication failed: " << errorCode << " - " << errorMessage << std::endl;
+
+      if (errorCode == "bad_auth_token") {
+        std::cerr << "This usually means your accountId or applicationKey is incorrect." << std::endl;
+        std::cerr << "Account ID: " << accountId << std::endl;
+        std::cerr << "Application Key: " << (applicationKey.empty() ? "EMPTY" : "SET") << std::endl;
+      }
+      return false;
+    }
+
+    if (!parsed) {
+      std::cerr << "Failed to parse authentication response" << std::endl;
+      return false;
+    }
+
+    // Extract fields from successful response
+    {
+      std::lock_guard<std::mutex> lock(tokenMutex);
+      if (fields.has("authorizationToken")) {
+        authToken = token;
+      }
+      if (fields.has("apiUrl")) {
+        apiUrl = newApiUrl;
+        std::cout << "Got apiUrl: " << apiUrl << std::endl;
+      }
+      if (fields.has("downloadUrl")) {
+        downloadUrl = newDownloadUrl;
+        std::cout << "Got downloadUrl: " << downloadUrl << std::endl;
+      }
+    }
+
+    // The "allowed" section names the key's bucket, null when the key is not
+    // bucket restricted. A configured bucket name must match it, or is looked
+    // up by name when the key may use every bucket of the account.
+    std::string name = getBucketName();
+    std::string id = getBucketId();
+    if (name.empty()) {
+      id = allowedBucketId;
+      name = allowedBucketName;
+    }
+    else if (!allowedBucketId.empty()) {
+      if (allowedBucketName != name) {
+        std::cerr << "The application key is restricted to bucket " << allowedBucketName
+                  << ", not the configured bucket " << name << std::endl;
+        return false;
+      }
+      id = allowedBucketId;
+    }
+    else if (id.empty()) {
+      id = findBucketId(b2AccountId, name, token);
+      if (id.empty()) {
+        std::cerr << "Bucket " << name << " not found in the account" << std::endl;
+        return false;
+      }
+    }
+    if (!id.empty()) {
+      std::cout << "Using bucket " << name << " (ID: " << id << ")" << std::endl;
+    }
+    {
+      std::lock_guard<std::mutex> lock(tokenMutex);
+      bucketId = id;
+      bucketName = name;
+    }
+
+    isAuthenticated = true;
+    std::cout << "Backblaze B2 authentication successful!" << std::endl;
+    return true;
+  }
+
+  std::string getBucketId() const {
+    std::lock_guard<std::mutex> lock(tokenMutex);
+    return bucketId;
+  }
+
+  std::string getBucketName() const {
+    std::lock_guard<std::mutex> lock(tokenMutex);
+    return bucketName;
+  }
+
+  // A different bucket is looked up again by the next authenticate()
+  void setBucketName(const std::string& name) {
+    std::lock_guard<std::mutex> lock(tokenMutex);
+    if (name == bucketName) {
+      return;
+    }
+    bucketName = name;
+    bucketId.clear();
+    isAuthenticated = false;
+  }
+
+  // Replaces an account token B2 rejected. Threads that hit the same 401 wait
+  // here and reuse the first thread's new token instead of authorizing again.
+  bool renewAuthorization(const std::string& rejectedToken) {
+    std::lock_guard<std::mutex> renewal(renewMutex);
+    {
+      std::lock_guard<std::mutex> lock(tokenMutex);
+      if (authToken != rejectedToken && isAuthenticated) {
+        return true;
+      }
+    }
+    // Other threads keep going on the old token meanwhile; only a failed
+    // renewal marks the credentials unauthenticated, so the next
+    // ensureAuthenticated() tries again
+    if (!authenticate()) {
+      isAuthenticated = false;
+      return false;
+    }
+    return true;
+  }
+
+  // Id of the bucket called name, empty if the account has none. Sent with the
+  // new token directly, a 401 here must not start another renewal.
+  std::string findBucketId(const std::string& b2AccountId, const std::string& name, const std::string& token) {
+    std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+      writer.StartObject();
+      writer.Key("accountId");
+      writer.String(b2AccountId.c_str());
+      writer.Key("bucketName");
+      writer.String(name.c_str());
+      writer.EndObject();
+    });
+
+    std::string response = b2ApiCall("b2_list_buckets", body, token);
+    rapidjson::Document doc;
+    doc.Parse(response.c_str());
+    if (response.empty() || doc.HasParseError() || !doc.IsObject() ||
+        !doc.HasMember("buckets") || !doc["buckets"].IsArray()) {
+      return "";
+    }
+    for (const auto& bucket : doc["buckets"].GetArray()) {
+      if (bucket.HasMember("bucketName") && bucket.HasMember("bucketId") &&
+          name == bucket["bucketName"].GetString()) {
+        return bucket["bucketId"].GetString();
+      }
+    }
+    return "";
+  }
+
+  static std::string base64Encode(const std::string& input) {
+    BIO* b64 = BIO_new(BIO_f_base64());
+    BIO* bio = BIO_new(BIO_s_mem());
+    bio = BIO_push(b64, bio);
+
+    // Don't add newlines
+    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+
+    BIO_write(bio, input.c_str(), static_cast<int>(input.length()));
+    BIO_flush(bio);
+
+    BUF_MEM* bufferPtr;
+    BIO_get_mem_ptr(bio, &bufferPtr);
+
+    std::string result(bufferPtr->data, bufferPtr->length);
+    BIO_free_all(bio);
+    return result;
+  }
+
+  bool createBucket(const std::string& newBucketName) {
+    if (!isAuthenticated) {
+      std::cerr << "Not authenticated. Call authenticate() first." << std::endl;
+      return false;
+    }
+
+    // Check if we already have a bucket from the authentication response
+    std::string existingId = getBucketId();
+    if (!existingId.empty()) {
+      std::cout << "Bucket already available: " << newBucketName << " (ID: " << existingId << ")" << std::endl;
+      std::lock_guard<std::mutex> lock(tokenMutex);
+      this->bucketName = newBucketName;
+      return true;
+    }
+
+    std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+      writer.StartObject();
+      writer.Key("bucketName");
+      writer.String(newBucketName.c_str());
+      writer.Key("bucketType");
+      writer.String("allPrivate");
+      writer.EndObject();
+    });
+
+    std::string response = b2ApiCall("b2_create_bucket", body);
+
+    if (response.empty()) {
+      return false;
+    }
+
+    std::string newBucketId, apiError;
+    JsonFields fields;
+    fields.text("bucketId", newBucketId);
+    fields.text("error", apiError);
+    std::string raw = response;
+    if (!fields.parse(response) || fields.has("error")) {
+      std::cerr << "Failed to create bucket: " << raw << std::endl;
+      return false;
+    }
+
+    if (fields.has("bucketId")) {
+      {
+        std::lock_guard<std::mutex> lock(tokenMutex);
+        bucketId = newBucketId;
+        this->bucketName = newBucketName;
+      }
+      std::cout << "Bucket created successfully: " << newBucketId << std::endl;
+      return true;
+    }
+
+    std::cerr << "Failed to create bucket. Response: " << raw << std::endl;
+    return false;
+  }
+
+  UploadAuthorization getUploadUrl() {
+    StageTimer timer(metrics, Stage::UploadUrl);
+    // Check if authenticated first
+
+    UploadAuthorization result;
+
+    if (!isAuthenticated) {
+      std::cerr << "Not authenticated. Call authenticate() first." << std::endl;
+      return {};
+    }
+
+    // Check if bucketId is set
+    std::string id = getBucketId();
+    if (id.empty()) {
+      std::cerr << "Bucket ID is not set. Call createBucket() or set bucketId first." << std::endl;
+      return {};
+    }
+
+    std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+      writer.StartObject();
+      writer.Key("bucketId");
+      writer.String(id.c_str());
+      writer.EndObject();
+    });
+
+    std::string response = b2ApiCall("b2_get_upload_url", body);
+
+    if (response.empty()) {
+      std::cerr << "Empty response from b2_get_upload_url API call" << std::endl;
+      return {};
+    }
+
+    std::string errorCode, errorMessage;
+    JsonFields fields;
+    fields.text("code", errorCode);
+    fields.text("message", errorMessage);
+    fields.text("uploadUrl", result.uploadUrl);
+    fields.text("authorizationToken", result.authorizationToken);
+
+    if (!fields.parse(response)) {
+      std::cerr << "Failed to parse JSON response from b2_get_upload_url" << std::endl;
+      return {};
+    }
+
+    // Check for error first
+    if (fields.has("code") && fields.has("message")) {
+      std::cerr << "B2 API Error: " << errorCode << " - " << errorMessage << std::endl;
+      return {};
+    }
+
+    if (fields.has("uploadUrl") && fields.has("authorizationToken")) {
+      std::cout << "Successfully obtained upload URL and token" << std::endl;
+      return result;
+    }
+
+    std::cerr << "Response missing required fields (uploadUrl, authorizationToken)" << std::endl;
+    return result;
+  }
+
+  // Large file API, used by the transfer engine for multi-part uploads
+  // largeFileSha1 is stored as the large_file_sha1 file info B2 recommends, large
+  // files have no contentSha1 of their own
+  std::string startLargeFile(const std::string& fileName,
+                             const std::string& contentType = "application/octet-stream",
+                             const std::string& largeFileSha1 = "") {
+    std::string id = getBucketId();
+    std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+      writer.StartObject();
+      writer.Key("bucketId");
+      writer.String(id.c_str());
+      writer.Key("fileName");
+      writer.String(fileName.c_str());
+      writer.Key("contentType");
+      writer.String(contentType.c_str());
+      if (!largeFileSha1.empty()) {
+        writer.Key("fileInfo");
+        writer.StartObject();
+        writer.Key("large_file_sha1");
+        writer.String(largeFileSha1.c_str());
+        writer.EndObject();
+      }
+      writer.EndObject();
+    });
+
+    std::string response = b2ApiCall("b2_start_large_file", body);
+    if (response.empty()) {
+      return "";
+    }
+
+    std::string fileId;
+    if (!parseFileId(response, fileId)) {
+      std::cerr << "Failed to start large file " << fileName << std::endl;
+      return "";
+    }
+    return fileId;
+  }
+
+  UploadAuthorization getUploadPartUrl(const std::string& fileId) {
+    StageTimer timer(metrics, Stage::UploadUrl);
+    std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+      writer.StartObject();
+      writer.Key("fileId");
+      writer.String(fileId.c_str());
+      writer.EndObject();
+    });
+
+    std::string response = b2ApiCall("b2_get_upload_part_url", body);
+    if (response.empty()) {
+      return {};
+    }
+
+    UploadAuthorization result;
+    JsonFields fields;
+    fields.text("uploadUrl", result.uploadUrl);
+    fields.text("authorizationToken", result.authorizationToken);
+    if (!fields.parse(response) || !fields.has("uploadUrl") || !fields.has("authorizationToken")) {
+      std::cerr << "Failed to get upload part URL for " << fileId << std::endl;
+      return {};
+    }
+    return result;
+  }
+
+  bool finishLargeFile(const std::string& fileId, const std::vector<std::string>& partSha1Array) {
+    std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+      writer.StartObject();
+      writer.Key("fileId");
+      writer.String(fileId.c_str());
+      writer.Key("partSha1Array");
+      writer.StartArray();
+      for (const auto& sha1 : partSha1Array) {
+        writer.String(sha1.c_str(), static_cast<rapidjson::SizeType>(sha1.size()));
+      }
+      writer.EndArray();
+      writer.EndObject();
+    });
+
+    std::string response = b2ApiCall("b2_finish_large_file", body);
+    if (response.empty()) {
+      return false;
+    }
+
+    std::string finishedId;
+    return parseFileId(response, finishedId);
+  }
+
+  // Server-side copy of an existing file to a new name, nothing is uploaded.
+  // Returns the new fileId, empty on failure.
+  std::string copyFile(const std::string& sourceFileId, const std::string& fileName) {
+    std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+      writer.StartObject();
+      writer.Key("sourceFileId");
+      writer.String(sourceFileId.c_str());
+      writer.Key("fileName");
+      writer.String(fileName.c_str());
+      writer.Key("metadataDirective");
+      writer.String("COPY");
+      writer.EndObject();
+    });
+
+    std::string response = b2ApiCall("b2_copy_file", body);
+    if (response.empty()) {
+      return "";
+    }
+
+    std::string fileId;
+    if (!parseFileId(response, fileId)) {
+      std::cerr << "Failed to copy file to " << fileName << std::endl;
+      return "";
+    }
+    return fileId;
+  }
+
+  // Server-side copy of a file too big for b2_copy_file, as a large file built
+  // from b2_copy_part ranges. Returns the new fileId, empty on failure.
+  std::string copyLargeFile(const std::string& sourceFileId,
+                            const std::string& fileName,
+                            uint64_t size,
+                            const std::string& largeFileSha1) {
+    const uint64_t maxPartSize = 5ULL * 1000 * 1000 * 1000;
+    std::string fileId = startLargeFile(fileName, "application/octet-stream", largeFileSha1);
+    if (fileId.empty()) {
+      return "";
+    }
+
+    uint64_t partCount = (size + maxPartSize - 1) / maxPartSize;
+    uint64_t partSize = (size + partCount - 1) / partCount;
+    std::vector<std::string> partSha1Array;
+    for (uint64_t offset = 0; offset < size; offset += partSize) {
+      uint64_t last = std::min(size, offset + partSize) - 1;
+      std::string range = "bytes=" + std::to_string(offset) + "-" + std::to_string(last);
+      std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+        writer.StartObject();
+        writer.Key("sourceFileId");
+        writer.String(sourceFileId.c_str());
+        writer.Key("largeFileId");
+        writer.String(fileId.c_str());
+        writer.Key("partNumber");
+        writer.Int(static_cast<int>(partSha1Array.size() + 1));
+        writer.Key("range");
+        writer.String(range.c_str());
+        writer.EndObject();
+      });
+
+      std::string response = b2ApiCall("b2_copy_part", body);
+      std::string partSha1;
+      JsonFields fields;
+      fields.text("contentSha1", partSha1);
+      if (response.empty() || !fields.parse(response) || !fields.has("contentSha1")) {
+        std::cerr << "Failed to copy part " << partSha1Array.size() + 1 << " of " << fileName << std::endl;
+        cancelLargeFile(fileId);
+        return "";
+      }
+      partSha1Array.push_back(partSha1);
+    }
+
+    if (!finishLargeFile(fileId, partSha1Array)) {
+      cancelLargeFile(fileId);
+      return "";
+    }
+    return fileId;
+  }
+
+  bool cancelLargeFile(const std::string& fileId) {
+    std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+      writer.StartObject();
+      writer.Key("fileId");
+      writer.String(fileId.c_str());
+      writer.EndObject();
+    });
+
+    return !b2ApiCall("b2_cancel_large_file", body).empty();
+  }
+
+  // Reads the fileId of an upload, copy or finish response. response is parsed in place.
+  static bool parseFileId(std::string& response, std::string& fileId) {
+    JsonFields fields;
+    fields.text("fileId", fileId);
+    return fields.parse(response) && fields.has("fileId");
+  }
+
+  // B2 wants file names percent-encoded in headers, '/' is kept as the folder separator
+  static std::string encodeFileName(const std::string& name) {
+    std::stringstream ss;
+    for (unsigned char c : name) {
+      if (isalnum(c) || c == '/' || c == '-' || c == '_' || c == '.' || c == '~') {
+        ss << c;
+      }
+      else {
+        ss << '%' << std::uppercase << std::hex << std::setw(2) << std::setfill('0') << (int)c;
+      }
+    }
+    return ss.str();
+  }
+
+  struct BufferSource {
+    const char* data = nullptr;
+    size_t remaining = 0;
+    RateLimiter* limiter = nullptr;
+    const std::atomic<bool>* cancel = nullptr;
+  };
+
+  static size_t bufferReadCallback(char* ptr, size_t size, size_t nmemb, BufferSource* source) {
+    size_t toCopy = std::min(size * nmemb, source->remaining);
+    if (source->limiter) {
+      toCopy = source->limiter->acquireUpload(toCopy, source->cancel);
+    }
+    memcpy(ptr, source->data, toCopy);
+    source->data += toCopy;
+    source->remaining -= toCopy;
+    return toCopy;
+  }
+
+  struct DownloadSink {
+    std::string* out = nullptr;
+    RateLimiter* limiter = nullptr;
+    const std::atomic<bool>* cancel = nullptr;
+  };
+
+  static size_t downloadWriteCallback(char* ptr, size_t size, size_t nmemb, DownloadSink* sink) {
+    size_t totalSize = size * nmemb;
+    // cURL wants every byte accepted, so wait for the whole amount
+    for (size_t granted = 0; sink->limiter && granted < totalSize; ) {
+      granted += sink->limiter->acquireDownload(totalSize - granted, sink->cancel);
+    }
+    sink->out->append(ptr, totalSize);
+    return totalSize;
+  }
+
+  // Uploads an in-memory object. The upload handle is kept so consecutive
+  // small uploads reuse the same connection.
+  bool uploadBuffer(const UploadAuthorization& uploadAuth,
+                    const std::string& remoteFileName,
+                    const void* data,
+                    size_t size,
+                    const std::string& sha1,
+                    const std::string& contentType = "application/octet-stream",
+                    TransferJob* job = nullptr) {
+    StageTimer timer(metrics, Stage::Transfer);
+    timer.setBytes(size);
+    CURL* uploadCurl = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(uploadCurlMutex);
+      if (!uploadCurls.empty()) {
+        uploadCurl = uploadCurls.back();
+        uploadCurls.pop_back();
+      }
+    }
+    if (!uploadCurl) {
+      uploadCurl = curl_easy_init();
+      if (!uploadCurl) {
+        std::cerr << "Failed to initialize cURL" << std::endl;
+        return false;
+      }
+    }
+    curl_easy_reset(uploadCurl);
+
+    struct curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, ("Authorization: " + uploadAuth.authorizationToken).c_str());
+    headers = curl_slist_append(headers, ("X-Bz-File-Name: " + encodeFileName(remoteFileName)).c_str());
+    headers = curl_slist_append(headers, ("X-Bz-Content-Sha1: " + sha1).c_str());
+    headers = curl_slist_append(headers, ("Content-Type: " + contentType).c_str());
+
+    BufferSource source;
+    source.data = static_cast<const char*>(data);
+    source.remaining = size;
+    source.limiter = rateLimiter;
+    source.cancel = cancel;
+    std::string response;
+
+    curl_easy_setopt(uploadCurl, CURLOPT_URL, uploadAuth.uploadUrl.c_str());
+    curl_easy_setopt(uploadCurl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(uploadCurl, CURLOPT_POST, 1L);
+    curl_easy_setopt(uploadCurl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)size);
+    curl_easy_setopt(uploadCurl, CURLOPT_READDATA, &source);
+    curl_easy_setopt(uploadCurl, CURLOPT_READFUNCTION, bufferReadCallback);
+    curl_easy_setopt(uploadCurl, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(uploadCurl, CURLOPT_WRITEDATA, &response);
+
+    TransferGuard guard(timeouts, cancel, nullptr, job);
+    guard.attach(uploadCurl);
+
+    CURLcode res = curl_easy_perform(uploadCurl);
+    long http_code = 0;
+    curl_easy_getinfo(uploadCurl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_slist_free_all(headers);
+    {
+      std::lock_guard<std::mutex> lock(uploadCurlMutex);
+      uploadCurls.push_back(uploadCurl);
+    }
+    TransferGuard::count(guard.classify(res, http_code), stats);
+
+    if (res != CURLE_OK) {
+      std::cerr << "Upload of " << remoteFileName << " failed: " << curl_easy_strerror(res) << std::endl;
+      return false;
+    }
+
+    std::string fileId;
+    if (!parseFileId(response, fileId)) {
+      std::cerr << "Upload of " << remoteFileName << " failed, no fileId in the response" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Downloads a whole object, or length bytes at offset when length is not 0
+  bool downloadFileByName(const std::string& fileName, std::string& out, uint64_t offset = 0, uint64_t length = 0,
+                          bool renew = true) {
+    if (!isAuthenticated || downloadUrl.empty()) {
+      std::cerr << "Not authenticated. Call authenticate() first." << std::endl;
+      return false;
+    }
+
+    CURL* downloadCurl = curl_easy_init();
+    if (!downloadCurl) {
+      std::cerr << "Failed to initialize cURL" << std::endl;
+      return false;
+    }
+
+    std::string url;
+    std::string token;
+    {
+      std::lock_guard<std::mutex> lock(tokenMutex);
+      url = downloadUrl + "/file/" + bucketName + "/" + encodeFileName(fileName);
+      token = authToken;
+    }
+    struct curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, ("Authorization: " + token).c_str());
+    if (length != 0) {
+      headers = curl_slist_append(headers, ("Range: bytes=" + std::to_string(offset) + "-" +
+                                            std::to_string(offset + length - 1)).c_str());
+    }
+
+    out.clear();
+    DownloadSink sink;
+    sink.out = &out;
+    sink.limiter = rateLimiter;
+    sink.cancel = cancel;
+    curl_easy_setopt(downloadCurl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(downloadCurl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(downloadCurl, CURLOPT_WRITEFUNCTION, downloadWriteCallback);
+    curl_easy_setopt(downloadCurl, CURLOPT_WRITEDATA, &sink);
+
+    TransferGuard guard(timeouts, cancel);
+    guard.attach(downloadCurl);
+
+    CURLcode res = curl_easy_perform(downloadCurl);
+    long http_code = 0;
+    curl_easy_getinfo(downloadCurl, CURLINFO_RESPONSE_CODE, &http_code);
+    TransferGuard::count(guard.classify(res, http_code), stats);
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(downloadCurl);
+
+    if (res != CURLE_OK) {
+      std::cerr << "Download of " << fileName << " failed: " << curl_easy_strerror(res) << std::endl;
+      return false;
+    }
+
+    // Same token as the API: renewed once when B2 says it expired
+    if (http_code == 401 && renew && renewAuthorization(token)) {
+      return downloadFileByName(fileName, out, offset, length, false);
+    }
+
+    if (http_code != 200 && http_code != 206) {
+      std::cerr << "HTTP Error: " << http_code << " downloading " << fileName << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Walks every page of b2_list_file_names under prefix
+  // With delimiter "/" only the names directly under prefix are listed, deeper
+  // names come back once per folder with action "folder"
+  // Each page is parsed in place as a stream from a buffer reused across pages,
+  // so memory stays at one page however many files the bucket holds.
+  // Starts at startAt when set, and calls onPage with the next page's
+  // startFileName after each page, empty after the last, so a caller can
+  // persist the cursor and resume an interrupted listing.
+  bool listFileNames(const std::string& prefix,
+                     const std::function<void(const B2FileEntry&)>& onFile,
+                     const std::string& delimiter = "",
+                     const std::string& startAt = "",
+                     const std::function<void(const std::string&)>& onPage = nullptr) {
+    std::string id = getBucketId();
+    if (!isAuthenticated || id.empty()) {
+      std::cerr << "Not authenticated. Call authenticate() first." << std::endl;
+      return false;
+    }
+
+    B2ListingHandler handler(onFile);
+    std::string startFileName = startAt;
+    do {
+      std::string_view body = buildJson([&](JsonRequestWriter& writer) {
+        writer.StartObject();
+        writer.Key("bucketId");
+        writer.String(id.c_str());
+        writer.Key("prefix");
+        writer.String(prefix.c_str());
+        writer.Key("maxFileCount");
+        writer.Int(1000);
+        if (!delimiter.empty()) {
+          writer.Key("delimiter");
+          writer.String(delimiter.c_str());
+        }
+        if (!startFileName.empty()) {
+          writer.Key("startFileName");
+          writer.String(startFileName.c_str());
+        }
+        writer.EndObject();
+      });
+
+      std::string& response = JsonScratch::local().response;
+      response.clear();
+      if (!b2ApiRequest("b2_list_file_names", body, response)) {
+        return false;
+      }
+
+      if (!handler.parse(response) || !handler.sawFiles) {
+        std::cerr << "Failed to parse b2_list_file_names response" << std::endl;
+        return false;
+      }
+      startFileName.swap(handler.nextFileName);
+      if (onPage) {
+        onPage(startFileName);
+      }
+    } while (!startFileName.empty());
+
+    return true;
+  }
+};
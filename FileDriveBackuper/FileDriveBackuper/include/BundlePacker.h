@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <openssl/evp.h>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "ChunkStore.h"
+
+// Where a backed up file of a directory version lives. Exactly one of
+// inlineData, bundle or object is used.
+struct BundleMember {
+  std::string path;
+  std::string sha1;
+  uint64_t size = 0;
+
+  std::string inlineData; // base64, tiny files only
+  std::string bundle;
+  uint64_t offset = 0;
+  std::string object;
+};
+
+inline std::string base64EncodeBlock(const std::string& input) {
+  std::string result(4 * ((input.size() + 2) / 3), '\0');
+  int written = EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&result[0]),
+                                reinterpret_cast<const unsigned char*>(input.data()),
+                                static_cast<int>(input.size()));
+  result.resize(written < 0 ? 0 : written);
+  return result;
+}
+
+inline std::string base64DecodeBlock(const std::string& input) {
+  std::string result(3 * input.size() / 4, '\0');
+  int written = EVP_DecodeBlock(reinterpret_cast<unsigned char*>(&result[0]),
+                                reinterpret_cast<const unsigned char*>(input.data()),
+                                static_cast<int>(input.size()));
+  if (written < 0) {
+    return "";
+  }
+  // EVP_DecodeBlock keeps the bytes produced by '=' padding
+  size_t padding = 0;
+  for (size_t i = input.size(); i > 0 && input[i - 1] == '='; --i) {
+    ++padding;
+  }
+  result.resize(written - padding);
+  return result;
+}
+
+// Packs small files of a directory tree into bundle objects so thousands of
+// files cost a handful of uploads. Each bundle ends with its own JSON index
+// followed by the index length as 8 little-endian bytes; the version manifest
+// repeats offsets so restores can fetch one member with a ranged download.
+class BundlePacker
+{
+public:
+  size_t targetBundleSize = 32 * 1024 * 1024;
+  size_t smallFileLimit = 4 * 1024 * 1024;
+  size_t inlineLimit = 2 * 1024;
+
+  bool isSmall(uint64_t size) const {
+    return size <= smallFileLimit;
+  }
+
+  // Returns true once the open bundle reached its target size and should be flushed
+  bool add(const std::string& path, const std::string& content) {
+    BundleMember member;
+    member.path = path;
+    member.size = content.size();
+    member.sha1 = sha1Hex(content.data(), content.size());
+
+    if (content.size() <= inlineLimit) {
+      member.inlineData = base64EncodeBlock(content);
+      m_members.push_back(std::move(member));
+      return false;
+    }
+
+    member.offset = m_bundle.size();
+    m_bundle += content;
+    m_pending.push_back(m_members.size());
+    m_members.push_back(std::move(member));
+    return m_bundle.size() >= targetBundleSize;
+  }
+
+  void addObject(const std::string& path, uint64_t size, const std::string& sha1, const std::string& objectName) {
+    BundleMember member;
+    member.path = path;
+    member.size = size;
+    member.sha1 = sha1;
+    member.object = objectName;
+    m_members.push_back(std::move(member));
+  }
+
+  bool hasOpenBundle() const {
+    return !m_pending.empty();
+  }
+
+  // Seals the open bundle by appending its index. The returned buffer is what gets uploaded.
+  const std::string& sealBundle() {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartArray();
+    for (size_t index : m_pending) {
+      const BundleMember& member = m_members[index];
+      writer.StartObject();
+      writer.Key("path");
+      writer.String(member.path.c_str());
+      writer.Key("offset");
+      writer.Uint64(member.offset);
+      writer.Key("size");
+      writer.Uint64(member.size);
+      writer.Key("sha1");
+      writer.String(member.sha1.c_str());
+      writer.EndObject();
+    }
+    writer.EndArray();
+
+    uint64_t indexSize = buffer.GetSize();
+    m_bundle.append(buffer.GetString(), buffer.GetSize());
+    for (int i = 0; i < 8; ++i) {
+      m_bundle.push_back(static_cast<char>((indexSize >> (8 * i)) & 0xFF));
+    }
+    return m_bundle;
+  }
+
+  // Called after the sealed bundle was uploaded under objectName
+  void commitBundle(const std::string& objectName) {
+    for (size_t index : m_pending) {
+      m_members[index].bundle = objectName;
+    }
+    m_pending.clear();
+    m_bundle.clear();
+  }
+
+  size_t memberCount() const {
+    return m_members.size();
+  }
+
+  std::string manifestJson(const std::string& rootName) const {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("directory");
+    writer.String(rootName.c_str());
+    writer.Key("members");
+    writer.StartArray();
+    for (const auto& member : m_members) {
+      writer.StartObject();
+      writer.Key("path");
+      writer.String(member.path.c_str());
+      writer.Key("size");
+      writer.Uint64(member.size);
+      writer.Key("sha1");
+      writer.String(member.sha1.c_str());
+      if (!member.bundle.empty()) {
+        writer.Key("bundle");
+        writer.String(member.bundle.c_str());
+        writer.Key("offset");
+        writer.Uint64(member.offset);
+      }
+      else if (!member.object.empty()) {
+        writer.Key("object");
+        writer.String(member.object.c_str());
+      }
+      else {
+        writer.Key("inline");
+        writer.String(member.inlineData.c_str());
+      }
+      writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return std::string(buffer.GetString(), buffer.GetSize());
+  }
+
+  static bool findMember(const std::string& manifest, const std::string& path, BundleMember& out) {
+    rapidjson::Document doc;
+    doc.Parse(manifest.c_str());
+    if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("members") || !doc["members"].IsArray()) {
+      return false;
+    }
+
+    for (const auto& entry : doc["members"].GetArray()) {
+      if (path != entry["path"].GetString()) {
+        continue;
+      }
+      out.path = path;
+      out.size = entry["size"].GetUint64();
+      out.sha1 = entry["sha1"].GetString();
+      if (entry.HasMember("bundle")) {
+        out.bundle = entry["bundle"].GetString();
+        out.offset = entry["offset"].GetUint64();
+      }
+      else if (entry.HasMember("object")) {
+        out.object = entry["object"].GetString();
+      }
+      else if (entry.HasMember("inline")) {
+        out.inlineData = entry["inline"].GetString();
+      }
+      return true;
+    }
+    return false;
+  }
+
+private:
+  std::vector<BundleMember> m_members;
+  std::vector<size_t> m_pending;
+  std::string m_bundle;
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <openssl/sha.h>
+
+// Content-defined chunking so that an edit only changes the chunks around it.
+// Cut points come from a gear rolling hash (FastCDC style, normalized chunking).
+struct ContentChunker
+{
+  size_t minSize = 256 * 1024;
+  size_t avgSize = 1024 * 1024;
+  size_t maxSize = 8 * 1024 * 1024;
+
+  static const std::array<uint64_t, 256>& gearTable() {
+    static const std::array<uint64_t, 256> table = [] {
+      std::array<uint64_t, 256> t{};
+      // splitmix64 with a fixed seed, the table must never change between versions
+      uint64_t x = 0x9E3779B97F4A7C15ULL;
+      for (auto& v : t) {
+        x += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        v = z ^ (z >> 31);
+      }
+      return t;
+    }();
+    return table;
+  }
+
+  static uint64_t topMask(int bits) {
+    return bits <= 0 ? 0 : (~0ULL << (64 - bits));
+  }
+
+  // Returns the length of the next chunk starting at data (data may hold less than maxSize)
+  size_t findCut(const uint8_t* data, size_t size, bool isLast) const {
+    if (size <= minSize) {
+      return isLast ? size : 0;
+    }
+
+    int bits = 0;
+    while ((size_t(1) << (bits + 1)) <= avgSize) {
+      ++bits;
+    }
+    const uint64_t maskSmall = topMask(bits + 2);
+    const uint64_t maskLarge = topMask(bits - 2);
+    const auto& gear = gearTable();
+
+    size_t limit = size < maxSize ? size : maxSize;
+    size_t normal = avgSize < limit ? avgSize : limit;
+    uint64_t hash = 0;
+    size_t i = minSize;
+    for (; i < normal; ++i) {
+      hash = (hash << 1) + gear[data[i]];
+      if ((hash & maskSmall) == 0) {
+        return i + 1;
+      }
+    }
+    for (; i < limit; ++i) {
+      hash = (hash << 1) + gear[data[i]];
+      if ((hash & maskLarge) == 0) {
+        return i + 1;
+      }
+    }
+
+    if (limit == maxSize || isLast) {
+      return limit;
+    }
+    // Need more data before a cut can be decided
+    return 0;
+  }
+
+  // Streams the file through the chunker, buffering at most 2 * maxSize bytes
+  bool forEachChunk(const std::filesystem::path& path,
+                    const std::function<bool(const uint8_t*, size_t)>& onChunk) const {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      return false;
+    }
+
+    std::vector<uint8_t> buffer(maxSize * 2);
+    size_t begin = 0;
+    size_t end = 0;
+    bool eof = false;
+
+    while (true) {
+      if (!eof && end - begin < maxSize) {
+        // Compact and refill
+        std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+        file.read(reinterpret_cast<char*>(buffer.data() + end), buffer.size() - end);
+        end += static_cast<size_t>(file.gcount());
+        eof = !file;
+      }
+
+      if (begin == end) {
+        return true;
+      }
+
+      size_t cut = findCut(buffer.data() + begin, end - begin, eof);
+      if (cut == 0) {
+        continue;
+      }
+      if (!onChunk(buffer.data() + begin, cut)) {
+        return false;
+      }
+      begin += cut;
+    }
+  }
+};
+
+// Probabilistic front of the chunk index, keyed by the hex SHA1 chunk id
+struct BloomFilter
+{
+  std::vector<uint64_t> bits;
+  size_t bitCount = 0;
+  int hashCount = 7;
+
+  void reset(size_t expectedItems) {
+    // ~10 bits per item keeps the false positive rate around 1% with 7 hashes
+    bitCount = (expectedItems < 1024 ? 1024 : expectedItems) * 10;
+    bits.assign((bitCount + 63) / 64, 0);
+  }
+
+  static void hashPair(const std::string& id, uint64_t& h1, uint64_t& h2) {
+    // The id is already a uniformly distributed hex digest
+    h1 = std::strtoull(id.substr(0, 16).c_str(), nullptr, 16);
+    h2 = std::strtoull(id.substr(16, 16).c_str(), nullptr, 16) | 1;
+  }
+
+  void add(const std::string& id) {
+    uint64_t h1, h2;
+    hashPair(id, h1, h2);
+    for (int i = 0; i < hashCount; ++i) {
+      size_t bit = (h1 + i * h2) % bitCount;
+      bits[bit / 64] |= (1ULL << (bit % 64));
+    }
+  }
+
+  bool mayContain(const std::string& id) const {
+    if (bitCount == 0) {
+      return false;
+    }
+    uint64_t h1, h2;
+    hashPair(id, h1, h2);
+    for (int i = 0; i < hashCount; ++i) {
+      size_t bit = (h1 + i * h2) % bitCount;
+      if (!(bits[bit / 64] & (1ULL << (bit % 64)))) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+struct ChunkRef {
+  std::string id;
+  size_t size = 0;
+};
+
+// Chunks already present in the bucket. Persisted as an append-only list of ids
+// so a restart does not need to re-list the bucket.
+class RemoteChunkIndex
+{
+public:
+  void open(const std::filesystem::path& indexPath) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_indexPath = indexPath;
+    m_ids.clear();
+
+    std::vector<std::string> loaded;
+    std::ifstream file(m_indexPath);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.size() == SHA_DIGEST_LENGTH * 2) {
+        loaded.push_back(line);
+      }
+    }
+
+    m_bloom.reset(loaded.size() * 2);
+    for (auto& id : loaded) {
+      m_bloom.add(id);
+      m_ids.insert(std::move(id));
+    }
+    m_isOpen = true;
+  }
+
+  bool isOpen() const {
+    return m_isOpen;
+  }
+
+  bool contains(const std::string& id) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // The bloom filter answers the common "new chunk" case without touching the set
+    if (!m_bloom.mayContain(id)) {
+      return false;
+    }
+    return m_ids.count(id) != 0;
+  }
+
+  void add(const std::string& id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_ids.insert(id).second) {
+      return;
+    }
+    if (m_ids.size() * 10 > m_bloom.bitCount) {
+      m_bloom.reset(m_ids.size() * 2);
+      for (const auto& existing : m_ids) {
+        m_bloom.add(existing);
+      }
+    }
+    else {
+      m_bloom.add(id);
+    }
+
+    if (!m_indexPath.empty()) {
+      std::ofstream file(m_indexPath, std::ios::app);
+      file << id << "\n";
+    }
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_ids.size();
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  std::filesystem::path m_indexPath;
+  std::unordered_set<std::string> m_ids;
+  BloomFilter m_bloom;
+  bool m_isOpen = false;
+};
+
+inline std::string sha1Hex(const void* data, size_t size) {
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  SHA1(static_cast<const unsigned char*>(data), size, hash);
+
+  std::stringstream ss;
+  for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+    ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+  }
+  return ss.str();
+}
+
+// Object layout in the bucket for chunked uploads
+inline std::string chunkObjectName(const std::string& id) {
+  return "chunks/" + id.substr(0, 2) + "/" + id;
+}
+
+inline std::string manifestObjectName(const std::string& versionName) {
+  return "manifests/" + versionName + ".json";
+}
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "FileSaver.h"
+
+// One source backed up on its own schedule
+struct DaemonJob {
+  std::string name;
+  std::filesystem::path path;
+  float interval = 300.0f; // seconds
+  bool localOnly = false;
+  bool chunked = false;
+  bool append = false;
+  bool skipIdentical = true;
+  bool coalesce = true;
+  bool kernelTls = false;
+  int concurrency = 2;
+  KeyLayoutKind layout = KeyLayoutKind::Hierarchical;
+  std::string set = "default";
+  std::string bandwidth; // RateLimiter schedule, empty is unlimited
+};
+
+// Configuration of the headless daemon, an INI file:
+//   [b2]
+//   keyId = ...
+//   applicationKeyFile = /etc/filesaverd/b2.key   (or applicationKey = ..., or $B2_APPLICATION_KEY)
+//   bucket = my-backups   (looked up by name; a bucket-restricted key must be restricted to it)
+//   [daemon]
+//   stateDirectory = /var/lib/filesaverd
+//   metricsFile = /var/lib/node_exporter/filesaverd.prom   (optional)
+//   metricsPort = 9464                                     (optional, 127.0.0.1 only)
+//   trace = on                                             (optional)
+//   traceSampleEvery = 20
+//   [job documents]
+//   path = /srv/documents
+//   interval = 600
+// Every job gets its own state directory under stateDirectory, named after it.
+struct DaemonConfig {
+  std::string keyId;
+  std::string applicationKey;
+  std::string bucket;
+  std::filesystem::path stateDirectory = "filesaver_state";
+  // Prometheus text file rewritten every few seconds, empty for none
+  std::filesystem::path metricsFile;
+  // Port of the localhost /metrics endpoint, 0 for none
+  int metricsPort = 0;
+  // Chrome trace files of 1 in traceSampleEvery cycles, in each job's traces/ directory
+  bool trace = false;
+  int traceSampleEvery = 1;
+  std::vector<DaemonJob> jobs;
+
+  bool load(const std::filesystem::path& file, std::string& error) {
+    std::ifstream in(file);
+    if (!in) {
+      error = "Cannot read " + file.string();
+      return false;
+    }
+
+    std::string section;
+    std::string line;
+    int number = 0;
+    while (std::getline(in, line)) {
+      ++number;
+      std::string text = trim(line);
+      if (text.empty() || text[0] == '#' || text[0] == ';') {
+        continue;
+      }
+      std::string where = file.string() + ":" + std::to_string(number) + ": ";
+
+      if (text.front() == '[') {
+        if (text.back() != ']') {
+          error = where + "unterminated section";
+          return false;
+        }
+        section = trim(text.substr(1, text.size() - 2));
+        if (section.compare(0, 4, "job ") == 0) {
+          DaemonJob job;
+          job.name = trim(section.substr(4));
+          if (job.name.empty() || job.name.find_first_of("/\\.") != std::string::npos) {
+            error = where + "job names may not be empty or contain '/', '\\' or '.'";
+            return false;
+          }
+          jobs.push_back(job);
+          section = "job";
+        }
+        else if (section != "b2" && section != "daemon") {
+          error = where + "unknown section [" + section + "]";
+          return false;
+        }
+        continue;
+      }
+
+      size_t equals = text.find('=');
+      if (equals == std::string::npos) {
+        error = where + "expected key = value";
+        return false;
+      }
+      std::string key = trim(text.substr(0, equals));
+      std::string value = trim(text.substr(equals + 1));
+      if (!set(section, key, value, error)) {
+        error = where + error;
+        return false;
+      }
+    }
+
+    if (applicationKey.empty()) {
+      if (const char* fromEnvironment = std::getenv("B2_APPLICATION_KEY")) {
+        applicationKey = fromEnvironment;
+      }
+    }
+    std::set<std::string> names;
+    for (const auto& job : jobs) {
+      if (!names.insert(job.name).second) {
+        error = "Job " + job.name + " is defined twice";
+        return false;
+      }
+      if (job.path.empty()) {
+        error = "Job " + job.name + " has no path";
+        return false;
+      }
+      if (!job.localOnly && (keyId.empty() || applicationKey.empty() || bucket.empty())) {
+        error = "Job " + job.name + " uploads but [b2] keyId, application key or bucket is missing";
+        return false;
+      }
+    }
+    if (jobs.empty()) {
+      error = "No [job <name>] sections";
+      return false;
+    }
+    return true;
+  }
+
+  // Applies a job's settings to the saver that runs it
+  void apply(const DaemonJob& job, FileSaver& saver) const {
+    saver.m_b2Credentials.accountId = keyId;
+    saver.m_b2Credentials.applicationKey = applicationKey;
+    saver.m_b2Credentials.setBucketName(bucket);
+    saver.setFilePath(job.path);
+    saver.m_saveInterval = job.interval;
+    saver.m_useChunkedUpload = job.chunked;
+    saver.m_useAppendMode = job.append;
+    saver.m_skipIdenticalUploads = job.skipIdentical;
+    saver.m_useKernelTls = job.kernelTls;
+    saver.m_spoolConcurrency = job.concurrency;
+    saver.m_spool.policy = job.coalesce ? SpoolDrainPolicy::LatestOnly : SpoolDrainPolicy::OldestFirst;
+    KeyLayout layout;
+    layout.kind = job.layout;
+    layout.set = job.set;
+    saver.setKeyLayout(layout);
+    saver.m_tracer.sampleEvery = static_cast<uint32_t>(traceSampleEvery);
+    saver.m_tracer.label = "filesaverd " + job.name;
+    if (!job.bandwidth.empty()) {
+      std::string error; // checked when the file was loaded
+      saver.m_rateLimiter.setSchedule(job.bandwidth, error);
+    }
+  }
+
+private:
+  static std::string trim(const std::string& text) {
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) {
+      return "";
+    }
+    size_t last = text.find_last_not_of(" \t\r\n");
+    return text.substr(first, last - first + 1);
+  }
+
+  static bool parseBool(const std::string& value, bool& out) {
+    if (value == "true" || value == "yes" || value == "on" || value == "1") {
+      out = true;
+      return true;
+    }
+    if (value == "false" || value == "no" || value == "off" || value == "0") {
+      out = false;
+      return true;
+    }
+    return false;
+  }
+
+  bool set(const std::string& section, const std::string& key, const std::string& value, std::string& error) {
+    if (section == "b2") {
+      if (key == "keyId") {
+        keyId = value;
+      }
+      else if (key == "applicationKey") {
+        applicationKey = value;
+      }
+      else if (key == "applicationKeyFile") {
+        std::ifstream in(value);
+        std::stringstream content;
+        content << in.rdbuf();
+        applicationKey = trim(content.str());
+        if (!in || applicationKey.empty()) {
+          error = "cannot read application key from " + value;
+          return false;
+        }
+      }
+      else if (key == "bucket") {
+        bucket = value;
+      }
+      else {
+        error = "unknown key " + key + " in [b2]";
+        return false;
+      }
+      return true;
+    }
+
+    if (section == "daemon") {
+      if (key == "stateDirectory") {
+        stateDirectory = value;
+      }
+      else if (key == "metricsFile") {
+        metricsFile = value;
+      }
+      else if (key == "metricsPort") {
+        metricsPort = std::atoi(value.c_str());
+        if (metricsPort < 1 || metricsPort > 65535) {
+          error = "bad value for metricsPort: " + value;
+          return false;
+        }
+      }
+      else if (key == "trace") {
+        if (!parseBool(value, trace)) {
+          error = "bad value for trace: " + value;
+          return false;
+        }
+      }
+      else if (key == "traceSampleEvery") {
+        traceSampleEvery = std::atoi(value.c_str());
+        if (traceSampleEvery < 1) {
+          error = "bad value for traceSampleEvery: " + value;
+          return false;
+        }
+      }
+      else {
+        error = "unknown key " + key + " in [daemon]";
+        return false;
+      }
+      return true;
+    }
+
+    if (section != "job") {
+      error = key + " outside of a section";
+      return false;
+    }
+
+    DaemonJob& job = jobs.back();
+    bool ok = true;
+    if (key == "path") {
+      job.path = value;
+    }
+    else if (key == "interval") {
+      char* end = nullptr;
+      job.interval = std::strtof(value.c_str(), &end);
+      ok = end != value.c_str() && *end == '\0' && job.interval >= 1.0f;
+    }
+    else if (key == "mode") {
+      ok = value == "b2" || value == "local";
+      job.localOnly = value == "local";
+    }
+    else if (key == "chunked") {
+      ok = parseBool(value, job.chunked);
+    }
+    else if (key == "append") {
+      ok = parseBool(value, job.append);
+    }
+    else if (key == "skipIdentical") {
+      ok = parseBool(value, job.skipIdentical);
+    }
+    else if (key == "coalesce") {
+      ok = parseBool(value, job.coalesce);
+    }
+    else if (key == "kernelTls") {
+      ok = parseBool(value, job.kernelTls);
+    }
+    else if (key == "concurrency") {
+      job.concurrency = std::atoi(value.c_str());
+      ok = job.concurrency >= 1 && job.concurrency <= 64;
+    }
+    else if (key == "layout") {
+      ok = value == "hierarchical" || value == "flat";
+      job.layout = value == "flat" ? KeyLayoutKind::Flat : KeyLayoutKind::Hierarchical;
+    }
+    else if (key == "set") {
+      job.set = value;
+    }
+    else if (key == "bandwidth") {
+      std::vector<RateWindow> windows;
+      std::string scheduleError;
+      if (!parseSchedule(value, windows, scheduleError)) {
+        error = scheduleError;
+        return false;
+      }
+      job.bandwidth = value;
+    }
+    else {
+      error = "unknown key " + key + " in [job " + job.name + "]";
+      return false;
+    }
+    if (!ok) {
+      error = "bad value for " + key + ": " + value;
+    }
+    return ok;
+  }
+};
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <string>
 #include <memory>
 #include <filesystem>
@@ -18,542 +21,1259 @@
 #include <openssl/buffer.h>
 #include <iomanip>
 #include <sstream>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include "BackblazeCredentials.h"
+#include "ChunkStore.h"
+#include "BundlePacker.h"
+#include "TransferEngine.h"
+#include "TransferWatchdog.h"
+#include "RateLimiter.h"
+#include "UploadSpool.h"
+#include "AppendTracker.h"
+#include "RemoteIndex.h"
+#include "MappedFile.h"
+#include "KtlsUploader.h"
+#include "KeyLayout.h"
+#include "LogRing.h"
+#include "UiWake.h"
+#include "StatusBoard.h"
+#include "ProgressMeter.h"
+#include "StageMetrics.h"
 
-struct UploadAuthorization {
-  std::string uploadUrl = "";
-  std::string authorizationToken = "";
-};
-
-struct BackblazeCredentials
+class FileSaver
 {
-  std::string accountId = "";
-  std::string applicationKey = "";
-  std::string bucketId = "";
-  std::string bucketName = "";
-
-  std::string authToken;
-  std::string apiUrl;
-  std::string downloadUrl;
-
-  bool isAuthenticated = false;
-  CURL* curl = nullptr;
+public:
+  FileSaver() : FileSaver("filesaver_state") {}
 
-  BackblazeCredentials() {
+  // Everything kept between runs (spool, indexes, the log) lives in stateDirectory,
+  // so several savers in one process each need their own
+  explicit FileSaver(const std::filesystem::path& stateDirectory) : m_stateDirectory(stateDirectory) {
     curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
+    m_b2Credentials.stats = &m_transferStats;
+    m_b2Credentials.cancel = &m_cancelTransfers;
+    m_b2Credentials.rateLimiter = &m_rateLimiter;
+    m_b2Credentials.metrics = &m_metrics;
+    m_metrics.tracer = &m_tracer;
+    std::error_code error;
+    std::filesystem::create_directories(m_stateDirectory, error);
+    m_log.startSpill(m_stateDirectory / "filesaver.log");
+    // Versions spooled by an earlier run are uploaded on the next start
+    openSpool();
+    m_appendTracker.open(m_stateDirectory);
+    m_remoteIndex.open(m_stateDirectory);
   }
 
-  ~BackblazeCredentials() {
-    if (curl) {
-      curl_easy_cleanup(curl);
+  ~FileSaver() {
+    setSaveFileThread(false);
+    setSaveOnlyLocalFileThread(false);
+    m_stopMigration = true;
+    if (m_migration && m_migration->joinable()) {
+      m_migration->join();
     }
     curl_global_cleanup();
   }
 
-  static size_t writeCallback(char* ptr, size_t size, size_t nmemb, std::string* response) {
-    size_t totalSize = size * nmemb;
-    response->append(ptr, totalSize);
-    return totalSize;
+  // Safe from any thread and never blocks the caller
+  void log(const std::string& message, LogLevel level = LogLevel::Info) {
+    m_log.write(level, message);
+    m_uiWake.notify();
   }
 
-  std::string b2ApiCall(const std::string& endpoint,
-    const std::string& postData = "",
-    const std::string& customAuthToken = "") {
-    if (!curl) {
-      std::cerr << "cURL not initialized" << std::endl;
-      return "";
-    }
+  // Coherent copy of what this saver is doing, from any thread without locks
+  BackupStatus status() const {
+    return m_status.load();
+  }
 
-    std::string response;
-    std::string url;
+  void setFilePath(const std::filesystem::path& path) {
+    m_filePath = path;
+    m_isFilePathSet = true;
+    publishStatus([](BackupStatus& status) { status.filePathSet = true; });
+  }
 
-    // Special handling for authorization call
-    if (endpoint == "b2_authorize_account") {
-      url = "https://api.backblazeb2.com/b2api/v2/" + endpoint;
-    }
-    else if (apiUrl.empty()) {
-      // Fallback if apiUrl is not set
-      url = "https://api.backblazeb2.com/b2api/v2/" + endpoint;
-      std::cout << "WARNING: Using fallback API URL: " << url << std::endl;
-    }
-    else {
-      url = apiUrl + "/b2api/v2/" + endpoint;
-    }
+  // The naming in effect, copied so the capture thread never sees a half-typed set name
+  KeyLayout keyLayout() const {
+    std::lock_guard<std::mutex> lock(m_keyLayoutMutex);
+    return m_keyLayout;
+  }
 
-    struct curl_slist* headers = nullptr;
-    std::string authHeader = "Authorization: " + (customAuthToken.empty() ? authToken : customAuthToken);
-    headers = curl_slist_append(headers, authHeader.c_str());
+  void setKeyLayout(const KeyLayout& layout) {
+    std::lock_guard<std::mutex> lock(m_keyLayoutMutex);
+    m_keyLayout = layout;
+  }
+
+  // Authenticates unless that was done already, and publishes the outcome
+  bool ensureAuthenticated() {
+    bool authenticated = m_b2Credentials.isAuthenticated || m_b2Credentials.authenticate();
+    publishStatus([authenticated](BackupStatus& status) { status.authenticated = authenticated; });
+    return authenticated;
+  }
 
-    if (!postData.empty()) {
-      headers = curl_slist_append(headers, "Content-Type: application/json");
-      curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.c_str());
-      curl_easy_setopt(curl, CURLOPT_POST, 1L);
+  static size_t writeCallback(void* contents, size_t size, size_t nmemb, std::string* response) {
+    size_t totalSize = size * nmemb;
+    response->append(static_cast<char*>(contents), totalSize);
+    return totalSize;
+  }
+
+  struct FileSource {
+    MappedFile* file = nullptr;
+    uint64_t offset = 0;
+    RateLimiter* limiter = nullptr;
+    const std::atomic<bool>* cancel = nullptr;
+  };
+
+  // Copies the next slice of the mapped file straight into cURL's buffer
+  static size_t readCallback(void* ptr, size_t size, size_t nmemb, FileSource* source) {
+    size_t wanted = size * nmemb;
+    if (source->limiter) {
+      wanted = source->limiter->acquireUpload(wanted, source->cancel);
     }
-    else {
-      curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    size_t copied = source->file->read(source->offset, static_cast<char*>(ptr), wanted);
+    source->offset += copied;
+    return copied;
+  }
+
+  std::filesystem::path makeLocalCopy() {
+    if (!std::filesystem::exists(m_filePath)) {
+      throw std::runtime_error("File does not exist: " + m_filePath.string());
     }
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    auto now = std::chrono::system_clock::now();
+    auto time = std::chrono::system_clock::to_time_t(now);
+    std::tm tm = {};
+#ifdef _WIN32
+    localtime_s(&tm, &time);
+#else
+    localtime_r(&time, &tm);
+#endif
 
-    CURLcode res = curl_easy_perform(curl);
-    long http_code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    std::stringstream ss;
+    ss << std::put_time(&tm, "%Y%m%d_%H%M%S");
+    std::string timestamp = ss.str();
 
-    if (res != CURLE_OK) {
-      std::cerr << "B2 API call failed: " << curl_easy_strerror(res) << std::endl;
-      std::cerr << "URL: " << url << std::endl;
-      return "";
+    std::filesystem::path localCopyPath = m_filePath.parent_path() /
+      (m_filePath.stem().string() + "_backup_" + timestamp + m_filePath.extension().string());
+
+    {
+      StageTimer timer(&m_metrics, Stage::LocalCopy);
+      copyWithProgress(m_filePath, localCopyPath);
+      timer.setBytes(m_copyProgress.total.load(std::memory_order_relaxed));
     }
+    log("Local copy created: " + localCopyPath.string() + "\n");
+    return localCopyPath;
+  }
 
-    if (http_code != 200) {
-      std::cerr << "HTTP Error: " << http_code << std::endl;
-      std::cerr << "Response: " << response << std::endl;
-      return "";
+  // Copies a file or a directory tree, counting bytes in m_copyProgress so a
+  // long copy shows up while it runs
+  void copyWithProgress(const std::filesystem::path& source, const std::filesystem::path& destination) {
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>> files;
+    uint64_t total = 0;
+    if (std::filesystem::is_directory(source)) {
+      std::filesystem::create_directories(destination);
+      for (const auto& entry : std::filesystem::recursive_directory_iterator(source)) {
+        std::filesystem::path target = destination / std::filesystem::relative(entry.path(), source);
+        if (entry.is_directory()) {
+          std::filesystem::create_directories(target);
+        }
+        else if (entry.is_regular_file()) {
+          files.emplace_back(entry.path(), target);
+          total += entry.file_size();
+        }
+      }
+    }
+    else {
+      files.emplace_back(source, destination);
+      total = std::filesystem::file_size(source);
     }
 
-    return response;
+    m_copyProgress.start(total);
+    // Sources are live files that may be truncated while they are read, so they
+    // are read with plain reads that come back short, never mapped: touching a
+    // mapped page past the new end would raise SIGBUS. Only the copies this
+    // saver owns are mapped later for hashing and upload.
+    std::vector<char> buffer(8 * 1024 * 1024);
+    for (const auto& file : files) {
+      std::ifstream in(file.first, std::ios::binary);
+      if (!in) {
+        throw std::runtime_error("Cannot open file: " + file.first.string());
+      }
+      std::ofstream out(file.second, std::ios::binary | std::ios::trunc);
+      // Written in 8 MB steps so progress moves on slow disks too
+      while (in && out) {
+        in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        size_t length = static_cast<size_t>(in.gcount());
+        if (length == 0) {
+          break;
+        }
+        out.write(buffer.data(), static_cast<std::streamsize>(length));
+        m_copyProgress.add(length);
+        m_metrics.bytesCopied.fetch_add(length, std::memory_order_relaxed);
+        m_uiWake.notifyProgress();
+      }
+      out.close();
+      if (in.bad() || !out) {
+        throw std::runtime_error("Cannot copy " + file.first.string() + " to " + file.second.string());
+      }
+      std::error_code error;
+      std::filesystem::permissions(file.second, std::filesystem::status(file.first).permissions(), error);
+    }
   }
 
-  bool authenticate() {
-
-    std::cout << "Attempting authentication with:" << std::endl;
-    std::cout << "Account ID: " << accountId << std::endl;
-    std::cout << "Application Key: " << applicationKey << std::endl;
+  bool uploadFile() {
+    // Uploads a snapshot, the source may change or shrink while it is read
+    return uploadFile(makeLocalCopy(), keyLayout().versionName(m_filePath, currentTimestamp()));
+  }
 
-    std::string credentials = accountId + ":" + applicationKey;
-    std::cout << "Raw credentials: " << credentials << std::endl;
+  // uploadedSha1, when given, receives the SHA1 of what was uploaded
+  bool uploadFile(const std::filesystem::path& localPath,
+                  const std::string& remoteFileName,
+                  TransferJob* job = nullptr,
+                  std::string* uploadedSha1 = nullptr) {
+    if (!ensureAuthenticated()) {
+      log("Authentication failed\n", LogLevel::Error);
+      return false;
+    }
 
-    std::string authHeader = "Basic " + base64Encode(credentials);
-    std::cout << "Auth header: " << authHeader << std::endl;
+    if (m_b2Credentials.getBucketId().empty()) {
+      log("No bucket available\n", LogLevel::Error);
+      return false;
+    }
 
-    std::string response = b2ApiCall("b2_authorize_account", "", authHeader);
+    std::error_code sizeError;
+    uint64_t fileSize = std::filesystem::file_size(localPath, sizeError);
 
-    if (response.empty()) {
-      return false;
+    // Get file SHA1
+    std::string fileSha1;
+    {
+      StageTimer timer(&m_metrics, Stage::Sha1);
+      timer.setBytes(sizeError ? 0 : fileSize);
+      fileSha1 = calculateFileSha1(localPath.string(), job ? &job->hashedBytes : nullptr);
+    }
+    m_metrics.bytesHashed.fetch_add(sizeError ? 0 : fileSize, std::memory_order_relaxed);
+    if (uploadedSha1) {
+      *uploadedSha1 = fileSha1;
     }
 
-    // Debug: print the raw authentication response
-    std::cout << "=== AUTHENTICATION RESPONSE ===" << std::endl;
-    std::cout << response << std::endl;
-    std::cout << "===============================" << std::endl;
+    if (m_skipIdenticalUploads && !sizeError && copyIfPresent(remoteFileName, fileSha1, fileSize)) {
+      m_metrics.skippedIdentical.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
 
-    rapidjson::Document doc;
-    doc.Parse(response.c_str());
+    // Big files go through the multi-part engine, parts are uploaded in parallel
+    if (fileSize >= m_largeFileThreshold && !sizeError) {
+      LargeFileUploader uploader(m_b2Credentials, m_transferController);
+      uploader.hedgePolicy = &m_hedgePolicy;
+      uploader.job = job;
+      uploader.fileSha1 = fileSha1;
+      std::string error;
+      if (!uploader.upload(localPath, remoteFileName, error)) {
+        log("Upload failed: " + error + "\n", LogLevel::Error);
+        return false;
+      }
+      m_remoteIndex.record({ remoteFileName, uploader.uploadedFileId, fileSha1, fileSize });
+      log("File uploaded successfully: " + remoteFileName + "\n");
+      return true;
+    }
 
-    // Check for authentication error first
-    if (doc.HasMember("code") && doc.HasMember("message")) {
-      std::string errorCode = doc["code"].GetString();
-      std::string errorMessage = doc["message"].GetString();
-      std::cerr << "Authentication failed: " << errorCode << " - " << errorMessage << std::endl;
+    for (int attempt = 0; ; ++attempt) {
+      TransferError error = TransferError::None;
+      if (uploadFileOnce(localPath, remoteFileName, fileSha1, error, job)) {
+        return true;
+      }
+      if (!isRetryable(error) || attempt + 1 >= m_b2Credentials.retryPolicy.maxAttempts) {
+        return false;
+      }
 
-      if (errorCode == "bad_auth_token") {
-        std::cerr << "This usually means your accountId or applicationKey is incorrect." << std::endl;
-        std::cerr << "Account ID: " << accountId << std::endl;
-        std::cerr << "Application Key: " << (applicationKey.empty() ? "EMPTY" : "SET") << std::endl;
+      log("Upload " + std::string(transferErrorName(error)) + ", retrying\n", LogLevel::Warning);
+      m_transferStats.retries++;
+      if (!m_b2Credentials.retryPolicy.backoff(attempt, &m_cancelTransfers)) {
+        return false;
       }
-      return false;
     }
+  }
 
-    if (doc.HasParseError() || !doc.IsObject()) {
-      std::cerr << "Failed to parse authentication response" << std::endl;
+  // One upload attempt, with a fresh upload URL as B2 asks for after failures
+  bool uploadFileOnce(const std::filesystem::path& localPath,
+                      const std::string& remoteFileName,
+                      const std::string& fileSha1,
+                      TransferError& error,
+                      TransferJob* job = nullptr) {
+    // Get upload authorization (both URL and token)
+    UploadAuthorization uploadAuth = m_b2Credentials.getUploadUrl();
+    if (uploadAuth.uploadUrl.empty() || uploadAuth.authorizationToken.empty()) {
+      log("Failed to get upload authorization\n", LogLevel::Error);
+      error = TransferError::Network;
       return false;
     }
 
-    // Extract fields from successful response
-    if (doc.HasMember("authorizationToken")) {
-      authToken = doc["authorizationToken"].GetString();
-      std::cout << "Got authorizationToken" << std::endl;
+    MappedFile file;
+    if (!file.open(localPath)) {
+      log("Cannot open file: " + localPath.string() + "\n", LogLevel::Error);
+      error = TransferError::ClientError;
+      return false;
     }
-    if (doc.HasMember("apiUrl")) {
-      apiUrl = doc["apiUrl"].GetString();
-      std::cout << "Got apiUrl: " << apiUrl << std::endl;
+    uint64_t fileSize = file.size();
+
+    std::vector<std::string> headerLines;
+    // Use the UPLOAD-SPECIFIC authorization token, not the general one
+    headerLines.push_back("Authorization: " + uploadAuth.authorizationToken);
+    headerLines.push_back("X-Bz-File-Name: " + BackblazeCredentials::encodeFileName(remoteFileName));
+    headerLines.push_back("X-Bz-Content-Sha1: " + fileSha1);
+    headerLines.push_back("Content-Type: application/octet-stream");
+
+    std::string response;
+    StageTimer timer(&m_metrics, Stage::Transfer);
+    timer.setBytes(fileSize);
+    uint64_t cpuStart = threadCpuNs();
+
+#ifdef KTLS_UPLOAD_SUPPORTED
+    if (m_useKernelTls && KtlsUploader::kernelSupported()) {
+      KtlsUploader ktls(m_b2Credentials.timeouts);
+      ktls.limiter = &m_rateLimiter;
+      ktls.cancel = &m_cancelTransfers;
+      ktls.job = job;
+      long httpCode = 0;
+      KtlsResult result = ktls.post(uploadAuth.uploadUrl, headerLines, localPath, fileSize, httpCode, response, error);
+      if (result != KtlsResult::Unsupported) {
+        TransferGuard::count(error, &m_transferStats);
+        if (result == KtlsResult::Failed) {
+          log("Upload failed: " + std::string(transferErrorName(error)) + "\n", LogLevel::Error);
+          return false;
+        }
+        m_ktlsCpu.add(fileSize, threadCpuNs() - cpuStart);
+        return finishUpload(remoteFileName, fileSha1, fileSize, response, error);
+      }
     }
-    if (doc.HasMember("downloadUrl")) {
-      downloadUrl = doc["downloadUrl"].GetString();
-      std::cout << "Got downloadUrl: " << downloadUrl << std::endl;
+#endif
+
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+      log("Failed to initialize cURL\n", LogLevel::Error);
+      error = TransferError::ClientError;
+      return false;
     }
 
-    // Extract bucket information from the "allowed" section
-    if (doc.HasMember("allowed") && doc["allowed"].IsObject()) {
-      const rapidjson::Value& allowed = doc["allowed"];
-      if (allowed.HasMember("bucketId") && allowed["bucketId"].IsString()) {
-        bucketId = allowed["bucketId"].GetString();
-        std::cout << "Got bucketId from auth response: " << bucketId << std::endl;
-      }
-      if (allowed.HasMember("bucketName") && allowed["bucketName"].IsString()) {
-        bucketName = allowed["bucketName"].GetString();
-        std::cout << "Got bucketName from auth response: " << bucketName << std::endl;
-      }
+    struct curl_slist* headers = nullptr;
+    for (const auto& line : headerLines) {
+      headers = curl_slist_append(headers, line.c_str());
     }
 
-    isAuthenticated = true;
-    std::cout << "Backblaze B2 authentication successful!" << std::endl;
-    return true;
-  }
+    // Add Content-Length header to avoid chunked transfer encoding
+    headers = curl_slist_append(headers, ("Content-Length: " + std::to_string(fileSize)).c_str());
 
-  static std::string base64Encode(const std::string& input) {
-    BIO* b64 = BIO_new(BIO_f_base64());
-    BIO* bio = BIO_new(BIO_s_mem());
-    bio = BIO_push(b64, bio);
+    curl_easy_setopt(curl, CURLOPT_URL, uploadAuth.uploadUrl.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 
-    // Don't add newlines
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+    // Use POST with explicit size to avoid chunked encoding
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)fileSize);
+    FileSource source;
+    source.file = &file;
+    source.limiter = &m_rateLimiter;
+    source.cancel = &m_cancelTransfers;
+    curl_easy_setopt(curl, CURLOPT_READDATA, &source);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, readCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
 
-    BIO_write(bio, input.c_str(), static_cast<int>(input.length()));
-    BIO_flush(bio);
+    // Disable chunked transfer encoding
+    curl_easy_setopt(curl, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
 
-    BUF_MEM* bufferPtr;
-    BIO_get_mem_ptr(bio, &bufferPtr);
+    TransferGuard guard(m_b2Credentials.timeouts, &m_cancelTransfers, nullptr, job);
+    guard.attach(curl);
 
-    std::string result(bufferPtr->data, bufferPtr->length);
-    BIO_free_all(bio);
+    CURLcode res = curl_easy_perform(curl);
+    long httpCode = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+    error = guard.classify(res, httpCode);
+    TransferGuard::count(error, &m_transferStats);
 
-    std::cout << "Base64 encoded: " << result << std::endl;
-    return result;
-  }
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
 
-  bool createBucket(const std::string& newBucketName) {
-    if (!isAuthenticated) {
-      std::cerr << "Not authenticated. Call authenticate() first." << std::endl;
+    if (res != CURLE_OK) {
+      log("Upload failed: " + std::string(curl_easy_strerror(res)) + "\n", LogLevel::Error);
       return false;
     }
+    m_curlCpu.add(fileSize, threadCpuNs() - cpuStart);
+    return finishUpload(remoteFileName, fileSha1, fileSize, response, error);
+  }
 
-    // Check if we already have a bucket from the authentication response
-    if (!bucketId.empty()) {
-      std::cout << "Bucket already available: " << newBucketName << " (ID: " << bucketId << ")" << std::endl;
-      this->bucketName = newBucketName;
+  bool finishUpload(const std::string& remoteFileName,
+                    const std::string& fileSha1,
+                    uint64_t fileSize,
+                    std::string& response,
+                    TransferError& error) {
+    // Parse response
+    std::string fileId, code, message;
+    JsonFields fields;
+    fields.text("fileId", fileId);
+    fields.text("code", code);
+    fields.text("message", message);
+
+    if (fields.parse(response) && fields.has("fileId")) {
+      m_remoteIndex.record({ remoteFileName, fileId, fileSha1, fileSize });
+      log("File uploaded successfully: " + remoteFileName + "\n");
       return true;
     }
 
-    rapidjson::Document doc;
-    doc.SetObject();
-    rapidjson::Document::AllocatorType& allocator = doc.GetAllocator();
-
-    doc.AddMember("bucketName", rapidjson::Value(newBucketName.c_str(), allocator), allocator);
-    doc.AddMember("bucketType", "allPrivate", allocator);
-
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-    doc.Accept(writer);
-
-    std::string response = b2ApiCall("b2_create_bucket", buffer.GetString());
+    if (error == TransferError::None) {
+      error = TransferError::ServerError;
+    }
+    log("Upload failed: " + (code.empty() ? std::string("no fileId in the response") : code + " - " + message) + "\n", LogLevel::Error);
+    return false;
+  }
 
-    if (response.empty()) {
+  // Creates remoteFileName with a server-side copy when the bucket already holds
+  // the same content under another name. Returns false if it has to be uploaded.
+  bool copyIfPresent(const std::string& remoteFileName, const std::string& fileSha1, uint64_t fileSize) {
+    if (fileSha1.empty()) {
       return false;
     }
-
-    rapidjson::Document responseDoc;
-    responseDoc.Parse(response.c_str());
-
-    if (responseDoc.HasParseError() || !responseDoc.IsObject() || responseDoc.HasMember("error")) {
-      std::cerr << "Failed to create bucket: " << response << std::endl;
+    // A listing that failed part way still leaves the pages it got usable
+    if (!m_remoteIndex.ensureLoaded(m_b2Credentials)) {
+      log("Bucket listing incomplete, will resume on the next upload\n", LogLevel::Warning);
+    }
+    RemoteFile existing;
+    if (!m_remoteIndex.findContent(fileSha1, fileSize, existing)) {
       return false;
     }
-
-    if (responseDoc.HasMember("bucketId")) {
-      bucketId = responseDoc["bucketId"].GetString();
-      this->bucketName = newBucketName;
-      std::cout << "Bucket created successfully: " << bucketId << std::endl;
+    if (existing.name == remoteFileName) {
+      log("Already in bucket: " + remoteFileName + "\n");
       return true;
     }
 
-    std::cerr << "Failed to create bucket. Response: " << response << std::endl;
-    return false;
-  }
+    std::string fileId = fileSize <= RemoteFileIndex::kMaxCopySize ?
+      m_b2Credentials.copyFile(existing.fileId, remoteFileName) :
+      m_b2Credentials.copyLargeFile(existing.fileId, remoteFileName, fileSize, fileSha1);
+    if (fileId.empty()) {
+      // Most likely deleted from elsewhere since it was listed
+      m_remoteIndex.forget(existing.name);
+      log("Server-side copy of " + existing.name + " failed, uploading instead\n", LogLevel::Warning);
+      return false;
+    }
 
-  UploadAuthorization getUploadUrl() {
-    // Check if authenticated first
+    m_remoteIndex.record({ remoteFileName, fileId, fileSha1, fileSize });
+    m_skippedUploadBytes += fileSize;
+    log("Unchanged since " + existing.name + ", copied server-side to " + remoteFileName + "\n");
+    return true;
+  }
 
-    UploadAuthorization result;
+  // Versions of the selected file in the bucket, oldest first. With the
+  // hierarchical layout this is two prefix listings, of the version objects and
+  // of their manifests (chunked, appended and directory versions).
+  std::vector<std::string> listVersions() {
+    return listVersions(m_filePath, keyLayout());
+  }
 
-    if (!isAuthenticated) {
-      std::cerr << "Not authenticated. Call authenticate() first." << std::endl;
-      return {};
+  // Same for any source and layout, for callers on another thread that took copies
+  std::vector<std::string> listVersions(const std::filesystem::path& source, const KeyLayout& layout) {
+    std::set<std::string> versions;
+    const std::string manifests = "manifests/";
+    const std::string json = ".json";
+    auto fromManifest = [&](const std::string& name) {
+      if (name.size() > manifests.size() + json.size() &&
+          name.compare(name.size() - json.size(), json.size(), json) == 0) {
+        return name.substr(manifests.size(), name.size() - manifests.size() - json.size());
+      }
+      return std::string();
+    };
+
+    if (layout.kind == KeyLayoutKind::Flat) {
+      std::string fileName = source.filename().string();
+      auto matches = [&fileName](const std::string& name) {
+        std::string timestamp, flatName;
+        return KeyLayout::parseFlat(name, timestamp, flatName) && flatName == fileName;
+      };
+      m_b2Credentials.listFileNames("", [&](const B2FileEntry& file) {
+        if (matches(file.fileName)) {
+          versions.insert(file.fileName);
+        }
+      }, "/");
+      m_b2Credentials.listFileNames(manifests, [&](const B2FileEntry& file) {
+        std::string version = fromManifest(file.fileName);
+        if (matches(version)) {
+          versions.insert(version);
+        }
+      }, "/");
     }
-
-    // Check if bucketId is set
-    if (bucketId.empty()) {
-      std::cerr << "Bucket ID is not set. Call createBucket() or set bucketId first." << std::endl;
-      return {};
+    else {
+      std::string prefix = layout.historyPrefix(source);
+      m_b2Credentials.listFileNames(prefix, [&](const B2FileEntry& file) {
+        if (file.action == "upload") {
+          versions.insert(file.fileName);
+        }
+      }, "/");
+      m_b2Credentials.listFileNames(manifests + prefix, [&](const B2FileEntry& file) {
+        std::string version = fromManifest(file.fileName);
+        if (!version.empty()) {
+          versions.insert(version);
+        }
+      }, "/");
     }
+    return std::vector<std::string>(versions.begin(), versions.end());
+  }
 
-    rapidjson::Document doc;
-    doc.SetObject();
-    rapidjson::Document::AllocatorType& allocator = doc.GetAllocator();
-
-    doc.AddMember("bucketId", rapidjson::Value(bucketId.c_str(), allocator), allocator);
+  // Copies versions stored under the flat layout to their hierarchical names,
+  // server-side, in the background. A version of the selected file goes under
+  // its full path, any other under its bare file name. Old names are kept:
+  // tail manifests refer to their base object by name.
+  void startMigration() {
+    if (m_migrating.exchange(true)) {
+      return;
+    }
+    if (m_migration && m_migration->joinable()) {
+      m_migration->join();
+    }
+    m_migratedObjects = 0;
+    m_stopMigration = false;
+    m_migration = std::make_unique<std::thread>(&FileSaver::migrateFlatVersions, this, m_filePath, keyLayout());
+  }
 
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-    doc.Accept(writer);
+  void migrateFlatVersions(std::filesystem::path selected, KeyLayout layout) {
+    layout.kind = KeyLayoutKind::Hierarchical;
+    std::vector<B2FileEntry> objects;
+    auto collect = [&objects](const B2FileEntry& file) {
+      if (file.action == "upload") {
+        objects.push_back(file);
+      }
+    };
+    if (!m_b2Credentials.listFileNames("", collect, "/") ||
+        !m_b2Credentials.listFileNames("manifests/", collect, "/")) {
+      log("Migration: listing the bucket failed\n", LogLevel::Error);
+      m_migrating = false;
+      return;
+    }
 
-    std::string response = b2ApiCall("b2_get_upload_url", buffer.GetString());
+    // Versions a previous, interrupted migration already copied are skipped
+    m_remoteIndex.ensureLoaded(m_b2Credentials);
+    size_t copied = 0;
+    size_t failed = 0;
+    for (const auto& object : objects) {
+      if (m_stopMigration) {
+        break;
+      }
+      // manifests/<version>.json moves with its version
+      std::string flat = object.fileName;
+      bool manifest = flat.compare(0, 10, "manifests/") == 0;
+      if (manifest) {
+        if (flat.size() <= 15 || flat.compare(flat.size() - 5, 5, ".json") != 0) {
+          continue;
+        }
+        flat = flat.substr(10, flat.size() - 15);
+      }
+      std::string timestamp, fileName;
+      if (!KeyLayout::parseFlat(flat, timestamp, fileName)) {
+        continue;
+      }
+      std::filesystem::path source = fileName == selected.filename().string() ? selected : std::filesystem::path(fileName);
+      std::string target = layout.versionName(source, timestamp);
+      if (manifest) {
+        target = manifestObjectName(target);
+      }
 
-    if (response.empty()) {
-      std::cerr << "Empty response from b2_get_upload_url API call" << std::endl;
-      return {};
+      RemoteFile existing;
+      if (m_remoteIndex.find(target, existing)) {
+        continue;
+      }
+      std::string sha1 = RemoteFileIndex::contentSha1(object);
+      std::string fileId = object.contentLength <= RemoteFileIndex::kMaxCopySize ?
+        m_b2Credentials.copyFile(object.fileId, target) :
+        m_b2Credentials.copyLargeFile(object.fileId, target, object.contentLength, sha1);
+      if (fileId.empty()) {
+        ++failed;
+        continue;
+      }
+      m_remoteIndex.record({ target, fileId, sha1, object.contentLength });
+      ++m_migratedObjects;
+      m_uiWake.notifyProgress();
+      ++copied;
     }
 
-    // Debug: print the raw response
-    std::cout << "Upload URL response: " << response << std::endl;
+    log("Migration to the hierarchical layout: " + std::to_string(copied) + " objects copied, " +
+        std::to_string(failed) + " failed\n");
+    m_migrating = false;
+    m_uiWake.notify();
+  }
+
+  static std::string currentTimestamp() {
+    auto now = std::chrono::system_clock::now();
+    auto time = std::chrono::system_clock::to_time_t(now);
+    std::tm tm = {};
+#ifdef _WIN32
+    localtime_s(&tm, &time);
+#else
+    localtime_r(&time, &tm);
+#endif
 
-    rapidjson::Document responseDoc;
-    responseDoc.Parse(response.c_str());
+    std::stringstream ss;
+    ss << std::put_time(&tm, "%Y%m%d_%H%M%S");
+    return ss.str();
+  }
 
-    if (responseDoc.HasParseError()) {
-      std::cerr << "Failed to parse JSON response: " << rapidjson::GetParseErrorFunc(responseDoc.GetParseError()) << std::endl;
-      return {};
+  // Uploads only the content-defined chunks the bucket does not have yet, then a
+  // manifest object listing every chunk of this version.
+  bool uploadFileChunked(const std::filesystem::path& localPath,
+                         const std::string& fileName,
+                         const std::string& versionName,
+                         TransferJob* job = nullptr) {
+    if (!ensureAuthenticated()) {
+      log("Authentication failed\n", LogLevel::Error);
+      return false;
     }
 
-    if (!responseDoc.IsObject()) {
-      std::cerr << "Response is not a JSON object" << std::endl;
-      return {};
+    if (m_b2Credentials.getBucketId().empty()) {
+      log("No bucket available\n", LogLevel::Error);
+      return false;
     }
 
-    // Check for error first
-    if (responseDoc.HasMember("code") && responseDoc.HasMember("message")) {
-      std::string errorCode = responseDoc["code"].GetString();
-      std::string errorMessage = responseDoc["message"].GetString();
-      std::cerr << "B2 API Error: " << errorCode << " - " << errorMessage << std::endl;
-      return {};
+    std::unique_lock<std::mutex> indexLock(m_chunkIndexMutex);
+    if (!m_chunkIndex.isOpen()) {
+      std::filesystem::create_directories(m_stateDirectory);
+      m_chunkIndex.open(m_stateDirectory / ("chunks_" + m_b2Credentials.getBucketId() + ".idx"));
+
+      // A fresh index is seeded once from the bucket so chunks uploaded by another
+      // machine are not sent again. After that the local index is authoritative.
+      if (m_chunkIndex.size() == 0) {
+        m_b2Credentials.listFileNames("chunks/", [this](const B2FileEntry& file) {
+          const std::string& name = file.fileName;
+          std::string id = name.substr(name.find_last_of('/') + 1);
+          if (id.size() == SHA_DIGEST_LENGTH * 2) {
+            m_chunkIndex.add(id);
+          }
+        });
+        log("Chunk index seeded with " + std::to_string(m_chunkIndex.size()) + " remote chunks\n");
+      }
     }
+    indexLock.unlock();
 
-    if (responseDoc.HasMember("uploadUrl") && responseDoc.HasMember("authorizationToken")) {
-      result.uploadUrl = responseDoc["uploadUrl"].GetString();
-      result.authorizationToken = responseDoc["authorizationToken"].GetString();
-      std::cout << "Successfully obtained upload URL and token" << std::endl;
-      return result;
+    UploadAuthorization uploadAuth = m_b2Credentials.getUploadUrl();
+    if (uploadAuth.uploadUrl.empty() || uploadAuth.authorizationToken.empty()) {
+      log("Failed to get upload authorization\n", LogLevel::Error);
+      return false;
     }
 
-    std::cerr << "Response missing required fields (uploadUrl, authorizationToken)" << std::endl;
-    return result;
-  }
-};
+    SHA_CTX fileContext;
+    SHA1_Init(&fileContext);
+
+    std::vector<ChunkRef> chunks;
+    size_t totalBytes = 0;
+    size_t sentBytes = 0;
+    size_t sentChunks = 0;
+
+    ContentChunker chunker;
+    bool chunked = chunker.forEachChunk(localPath, [&](const uint8_t* data, size_t size) {
+      SHA1_Update(&fileContext, data, size);
+      std::string id = sha1Hex(data, size);
+      totalBytes += size;
+      if (job) {
+        job->hashedBytes.fetch_add(size, std::memory_order_relaxed);
+      }
+      chunks.push_back({ id, size });
 
-class FileSaver
-{
-public:
-  FileSaver() {
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-  }
+      if (m_chunkIndex.contains(id)) {
+        return true;
+      }
 
-  ~FileSaver() {
-    setSaveFileThread(false);
-    curl_global_cleanup();
-  }
+      if (!m_b2Credentials.uploadBuffer(uploadAuth, chunkObjectName(id), data, size, id,
+                                        "application/octet-stream", job)) {
+        if (job && job->cancel) {
+          return false;
+        }
+        // Upload URLs can go stale, B2 asks clients to fetch a new one and retry
+        uploadAuth = m_b2Credentials.getUploadUrl();
+        if (uploadAuth.uploadUrl.empty() ||
+            !m_b2Credentials.uploadBuffer(uploadAuth, chunkObjectName(id), data, size, id,
+                                          "application/octet-stream", job)) {
+          return false;
+        }
+      }
 
-  static size_t writeCallback(void* contents, size_t size, size_t nmemb, std::string* response) {
-    size_t totalSize = size * nmemb;
-    response->append(static_cast<char*>(contents), totalSize);
-    return totalSize;
-  }
+      m_chunkIndex.add(id);
+      sentBytes += size;
+      ++sentChunks;
+      return true;
+    });
 
-  static size_t readCallback(void* ptr, size_t size, size_t nmemb, FILE* stream) {
-    return fread(ptr, size, nmemb, stream);
-  }
+    if (!chunked) {
+      log("Chunked upload failed: " + localPath.string() + "\n", LogLevel::Error);
+      return false;
+    }
+    m_metrics.chunksSeen.fetch_add(chunks.size(), std::memory_order_relaxed);
+    m_metrics.chunksSent.fetch_add(sentChunks, std::memory_order_relaxed);
+    m_metrics.chunkBytesSeen.fetch_add(totalBytes, std::memory_order_relaxed);
+    m_metrics.chunkBytesSent.fetch_add(sentBytes, std::memory_order_relaxed);
 
-  void readFile() {
-    if (!std::filesystem::exists(m_filePath)) {
-      throw std::runtime_error("File does not exist: " + m_filePath.string());
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1_Final(hash, &fileContext);
+    std::stringstream fileSha1;
+    for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+      fileSha1 << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
     }
 
-    std::ifstream file(m_filePath, std::ios::binary);
-    if (!file) {
-      throw std::runtime_error("Cannot open file: " + m_filePath.string());
+    rapidjson::StringBuffer manifest;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(manifest);
+    writer.StartObject();
+    writer.Key("fileName");
+    writer.String(fileName.c_str());
+    writer.Key("size");
+    writer.Uint64(totalBytes);
+    writer.Key("sha1");
+    writer.String(fileSha1.str().c_str());
+    writer.Key("chunks");
+    writer.StartArray();
+    for (const auto& chunk : chunks) {
+      writer.StartObject();
+      writer.Key("id");
+      writer.String(chunk.id.c_str());
+      writer.Key("size");
+      writer.Uint64(chunk.size);
+      writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+
+    std::string manifestSha1 = sha1Hex(manifest.GetString(), manifest.GetSize());
+    if (!m_b2Credentials.uploadBuffer(uploadAuth,
+                                      manifestObjectName(versionName),
+                                      manifest.GetString(),
+                                      manifest.GetSize(),
+                                      manifestSha1,
+                                      "application/json",
+                                      job)) {
+      log("Failed to upload manifest for " + versionName + "\n", LogLevel::Error);
+      return false;
     }
 
-    std::string content((std::istreambuf_iterator<char>(file)),
-      std::istreambuf_iterator<char>());
-    m_fileContent = content;
+    log("Chunked upload of " + versionName + ": sent " +
+      std::to_string(sentChunks) + "/" + std::to_string(chunks.size()) + " chunks (" +
+      std::to_string(sentBytes) + "/" + std::to_string(totalBytes) + " bytes)\n");
+    return true;
   }
 
-  void makeLocalCopy() {
-    if (!std::filesystem::exists(m_filePath)) {
-      throw std::runtime_error("File does not exist: " + m_filePath.string());
+  // Backs up a directory tree. Small files are packed into bundle objects and tiny
+  // ones are inlined in the manifest, large files are uploaded as their own objects.
+  bool uploadDirectory(const std::filesystem::path& localPath,
+                       const std::string& rootName,
+                       const std::string& versionName,
+                       TransferJob* job = nullptr) {
+    if (!ensureAuthenticated()) {
+      log("Authentication failed\n", LogLevel::Error);
+      return false;
     }
 
-    auto now = std::chrono::system_clock::now();
-    auto time = std::chrono::system_clock::to_time_t(now);
-    std::tm* tm = std::localtime(&time);
+    if (m_b2Credentials.getBucketId().empty()) {
+      log("No bucket available\n", LogLevel::Error);
+      return false;
+    }
 
-    std::stringstream ss;
-    ss << std::put_time(tm, "%Y%m%d_%H%M%S");
-    std::string timestamp = ss.str();
+    UploadAuthorization uploadAuth = m_b2Credentials.getUploadUrl();
+    if (uploadAuth.uploadUrl.empty() || uploadAuth.authorizationToken.empty()) {
+      log("Failed to get upload authorization\n", LogLevel::Error);
+      return false;
+    }
 
-    std::filesystem::path localCopyPath = m_filePath.parent_path() /
-      (m_filePath.stem().string() + "_backup_" + timestamp + m_filePath.extension().string());
+    BundlePacker packer;
+    size_t bundleCount = 0;
+    size_t objectCount = 0;
 
-    std::filesystem::copy(m_filePath, localCopyPath, std::filesystem::copy_options::overwrite_existing);
-    m_logger += "Local copy created: " + localCopyPath.string() + "\n";
-  }
+    // Upload URLs go stale, a failed upload gets one more try on a fresh one
+    auto uploadObject = [&](const std::string& objectName, const std::string& data, const std::string& sha1,
+                            const std::string& contentType) {
+      if (m_b2Credentials.uploadBuffer(uploadAuth, objectName, data.data(), data.size(), sha1, contentType, job)) {
+        return true;
+      }
+      if (job && job->cancel) {
+        return false;
+      }
+      uploadAuth = m_b2Credentials.getUploadUrl();
+      return !uploadAuth.uploadUrl.empty() &&
+        m_b2Credentials.uploadBuffer(uploadAuth, objectName, data.data(), data.size(), sha1, contentType, job);
+    };
+
+    auto flushBundle = [&]() {
+      const std::string& bundle = packer.sealBundle();
+      std::string bundleSha1 = sha1Hex(bundle.data(), bundle.size());
+      std::string objectName = "bundles/" + bundleSha1;
+      if (!uploadObject(objectName, bundle, bundleSha1, "application/octet-stream")) {
+        return false;
+      }
+      packer.commitBundle(objectName);
+      ++bundleCount;
+      return true;
+    };
 
-  bool uploadFile() {
-    if (!m_b2Credentials.isAuthenticated && !m_b2Credentials.authenticate()) {
-      m_logger += "Authentication failed\n";
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(localPath)) {
+      if (!entry.is_regular_file()) {
+        continue;
+      }
+      if (job && job->cancel) {
+        return false;
+      }
+
+      std::string relativePath = std::filesystem::relative(entry.path(), localPath).generic_string();
+      uint64_t size = entry.file_size();
+
+      if (!packer.isSmall(size)) {
+        std::string objectName = "files/" + versionName + "/" + relativePath;
+        std::string objectSha1;
+        if (!uploadFile(entry.path(), objectName, job, &objectSha1)) {
+          return false;
+        }
+        packer.addObject(relativePath, size, objectSha1, objectName);
+        ++objectCount;
+        continue;
+      }
+
+      std::ifstream file(entry.path(), std::ios::binary);
+      if (!file) {
+        log("Cannot open file: " + entry.path().string() + "\n", LogLevel::Error);
+        return false;
+      }
+      std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+      if (packer.add(relativePath, content) && !flushBundle()) {
+        log("Failed to upload bundle for " + versionName + "\n", LogLevel::Error);
+        return false;
+      }
+    }
+
+    if (packer.hasOpenBundle() && !flushBundle()) {
+      log("Failed to upload bundle for " + versionName + "\n", LogLevel::Error);
       return false;
     }
 
-    if (m_b2Credentials.bucketId.empty()) {
-      m_logger += "No bucket available\n";
+    std::string manifest = packer.manifestJson(rootName);
+    if (!uploadObject(manifestObjectName(versionName), manifest, sha1Hex(manifest.data(), manifest.size()),
+                      "application/json")) {
+      log("Failed to upload manifest for " + versionName + "\n", LogLevel::Error);
       return false;
     }
 
-    // Get upload authorization (both URL and token)
-    UploadAuthorization uploadAuth = m_b2Credentials.getUploadUrl();
-    if (uploadAuth.uploadUrl.empty() || uploadAuth.authorizationToken.empty()) {
-      m_logger += "Failed to get upload authorization\n";
+    log("Directory upload of " + versionName + ": " + std::to_string(packer.memberCount()) +
+      " files in " + std::to_string(bundleCount) + " bundles and " + std::to_string(objectCount) + " objects\n");
+    return true;
+  }
+
+  // Restores a single file of a directory version without downloading whole bundles
+  bool restoreDirectoryMember(const std::string& versionName,
+                              const std::string& memberPath,
+                              const std::filesystem::path& destination) {
+    std::string manifest;
+    if (!m_b2Credentials.downloadFileByName(manifestObjectName(versionName), manifest)) {
+      log("Failed to download manifest for " + versionName + "\n", LogLevel::Error);
       return false;
     }
 
-    // Get file SHA1
-    std::string fileSha1 = calculateFileSha1(m_filePath.string());
+    BundleMember member;
+    if (!BundlePacker::findMember(manifest, memberPath, member)) {
+      log(memberPath + " is not part of " + versionName + "\n");
+      return false;
+    }
 
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-      m_logger += "Failed to initialize cURL\n";
+    std::string content;
+    if (!member.bundle.empty()) {
+      if (member.size != 0 &&
+          !m_b2Credentials.downloadFileByName(member.bundle, content, member.offset, member.size)) {
+        log("Failed to download " + memberPath + " from " + member.bundle + "\n", LogLevel::Error);
+        return false;
+      }
+    }
+    else if (!member.object.empty()) {
+      if (!m_b2Credentials.downloadFileByName(member.object, content)) {
+        log("Failed to download " + member.object + "\n", LogLevel::Error);
+        return false;
+      }
+    }
+    else {
+      content = base64DecodeBlock(member.inlineData);
+    }
+
+    if (sha1Hex(content.data(), content.size()) != member.sha1) {
+      log("Checksum mismatch restoring " + memberPath + "\n", LogLevel::Error);
       return false;
     }
 
-    FILE* file = fopen(m_filePath.string().c_str(), "rb");
+    std::error_code error;
+    if (destination.has_parent_path()) {
+      std::filesystem::create_directories(destination.parent_path(), error);
+    }
+    std::ofstream file(destination, std::ios::binary | std::ios::trunc);
+    file.write(content.data(), content.size());
+    file.close();
     if (!file) {
-      m_logger += "Cannot open file: " + m_filePath.string() + "\n";
-      curl_easy_cleanup(curl);
+      log("Cannot write " + destination.string() + "\n", LogLevel::Error);
       return false;
     }
+    log("Restored " + memberPath + " to " + destination.string() + "\n");
+    return true;
+  }
 
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+  void saveFileOnlyLocal() {
+    for (uint64_t cycleId = 0; m_isSavingOnlyLocal; ++cycleId) {
+      try {
+        Tracer::Cycle cycle(&m_tracer, "local capture", cycleId);
+        // Without a path there is nothing to copy, the cycle still waits out the interval
+        if (!m_isFilePathSet) {
+          log("File path not set\n", LogLevel::Error);
+        }
+        else {
+          // Make local copy
+          publishStatus([](BackupStatus& status) { status.phase = BackupPhase::Capturing; });
+          makeLocalCopy();
+          publishStatus([](BackupStatus& status) { ++status.captures; });
+          publishResult(true);
+        }
+      }
+      catch (const std::exception& e) {
+        log(std::string("Error: ") + e.what() + "\n", LogLevel::Error);
+        publishResult(false);
+      }
 
-    // Create filename with timestamp
-    auto now = std::chrono::system_clock::now();
-    auto time = std::chrono::system_clock::to_time_t(now);
-    std::tm* tm = std::localtime(&time);
+      // Sleep for the specified interval
+      publishNextCapture();
+      auto nextCopy = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(static_cast<int>(m_saveInterval * 1000));
+      while (m_isSavingOnlyLocal && std::chrono::steady_clock::now() < nextCopy) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      }
+    }
+  }
 
-    std::stringstream ss;
-    ss << std::put_time(tm, "%Y%m%d_%H%M%S_") << m_filePath.filename().string();
-    std::string remoteFileName = ss.str();
+  // Captures a local copy and queues it for upload. The version name is fixed
+  // at capture time so a late upload still carries the time it was taken.
+  void captureVersion() {
+    bool appendMode = m_useAppendMode && std::filesystem::is_regular_file(m_filePath);
+    if (appendMode && captureAppendedTail()) {
+      return;
+    }
 
-    struct curl_slist* headers = nullptr;
-    // Use the UPLOAD-SPECIFIC authorization token, not the general one
-    headers = curl_slist_append(headers, ("Authorization: " + uploadAuth.authorizationToken).c_str());
-    headers = curl_slist_append(headers, ("X-Bz-File-Name: " + remoteFileName).c_str());
-    headers = curl_slist_append(headers, ("X-Bz-Content-Sha1: " + fileSha1).c_str());
-    headers = curl_slist_append(headers, "Content-Type: application/octet-stream");
+    std::filesystem::path localCopy = makeLocalCopy();
+
+    SpoolEntry entry;
+    entry.localPath = localCopy.string();
+    entry.sourcePath = m_filePath.string();
+    entry.remoteName = keyLayout().versionName(m_filePath, currentTimestamp());
+    if (std::filesystem::is_directory(localCopy)) {
+      entry.kind = SpoolKind::Directory;
+      for (const auto& file : std::filesystem::recursive_directory_iterator(localCopy)) {
+        if (file.is_regular_file()) {
+          entry.bytes += file.file_size();
+        }
+      }
+    }
+    else if (appendMode) {
+      // A whole upload that later tails build on
+      entry.kind = SpoolKind::File;
+      entry.bytes = std::filesystem::file_size(localCopy);
+      AppendState state;
+      if (AppendTracker::startFromBase(localCopy, entry.sourcePath, entry.remoteName, state)) {
+        m_appendTracker.save(state);
+      }
+      else {
+        m_appendTracker.forget(entry.sourcePath);
+      }
+    }
+    else {
+      entry.kind = m_useChunkedUpload ? SpoolKind::Chunked : SpoolKind::File;
+      entry.bytes = std::filesystem::file_size(localCopy);
+    }
+    m_spool.enqueue(entry);
+  }
 
-    // Add Content-Length header to avoid chunked transfer encoding
-    headers = curl_slist_append(headers, ("Content-Length: " + std::to_string(fileSize)).c_str());
+  // Append mode: if the file only grew since the last capture, copies and spools
+  // just the new bytes. Returns false when a whole copy is needed instead.
+  bool captureAppendedTail() {
+    std::string sourcePath = m_filePath.string();
+    AppendState state;
+    if (!m_appendTracker.load(sourcePath, state)) {
+      return false;
+    }
 
-    std::string response;
+    uint64_t size = std::filesystem::file_size(m_filePath);
+    if (size < state.size || !m_appendTracker.prefixUnchanged(m_filePath, state)) {
+      log("File was rewritten, not appended to, taking a whole copy\n", LogLevel::Warning);
+      return false;
+    }
+    if (size == state.size) {
+      log("No new data in " + m_filePath.filename().string() + "\n");
+      return true;
+    }
 
-    curl_easy_setopt(curl, CURLOPT_URL, uploadAuth.uploadUrl.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    std::filesystem::path localTail = m_filePath.parent_path() /
+      (m_filePath.stem().string() + "_backup_" + currentTimestamp() + "_tail" + m_filePath.extension().string());
+
+    AppendSegment segment;
+    segment.offset = state.size;
+    segment.size = size - state.size;
+    segment.object = tailObjectName(state.segments.front().object, segment.offset);
+    if (!AppendTracker::copyRange(m_filePath, segment.offset, segment.size, localTail, segment.sha1) ||
+        !AppendTracker::extendLeaves(m_filePath, state, size)) {
+      std::error_code error;
+      std::filesystem::remove(localTail, error);
+      return false;
+    }
+    state.segments.push_back(segment);
+
+    SpoolEntry entry;
+    entry.kind = SpoolKind::Tail;
+    entry.localPath = localTail.string();
+    entry.sourcePath = sourcePath;
+    entry.remoteName = keyLayout().versionName(m_filePath, currentTimestamp());
+    entry.bytes = segment.size;
+
+    // The manifest of this version goes next to the tail so the upload needs nothing else
+    std::ofstream manifest(localTail.string() + ".manifest.json", std::ios::trunc);
+    manifest << AppendTracker::manifestJson(m_filePath.filename().string(), state);
+    manifest.close();
+    if (!manifest || !m_appendTracker.save(state)) {
+      std::error_code error;
+      std::filesystem::remove(localTail, error);
+      std::filesystem::remove(localTail.string() + ".manifest.json", error);
+      return false;
+    }
 
-    // Use POST with explicit size to avoid chunked encoding
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)fileSize);
-    curl_easy_setopt(curl, CURLOPT_READDATA, file);
-    curl_easy_setopt(curl, CURLOPT_READFUNCTION, readCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    m_spool.enqueue(entry);
+    log("Local tail copy created: " + localTail.string() + " (" + std::to_string(segment.size) +
+        " new bytes at offset " + std::to_string(segment.offset) + ")\n");
+    return true;
+  }
 
-    // Disable chunked transfer encoding
-    curl_easy_setopt(curl, CURLOPT_HTTP_TRANSFER_DECODING, 0L);
+  // Uploads the tail object, then the manifest listing every segment of the version
+  bool uploadTail(const SpoolEntry& entry, TransferJob& job) {
+    std::ifstream file(entry.localPath + ".manifest.json", std::ios::binary);
+    std::string manifest((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
 
-    CURLcode res = curl_easy_perform(curl);
+    rapidjson::Document doc;
+    doc.Parse(manifest.c_str());
+    if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("segments") ||
+        !doc["segments"].IsArray() || doc["segments"].Size() < 2) {
+      log("Bad tail manifest for " + entry.remoteName + "\n", LogLevel::Error);
+      return false;
+    }
+    const rapidjson::Value& segments = doc["segments"];
+    std::string tailObject = segments[segments.Size() - 1]["object"].GetString();
 
-    fclose(file);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    if (!uploadFile(entry.localPath, tailObject, &job)) {
+      return false;
+    }
 
-    if (res != CURLE_OK) {
-      m_logger += "Upload failed: " + std::string(curl_easy_strerror(res)) + "\n";
+    UploadAuthorization uploadAuth = m_b2Credentials.getUploadUrl();
+    if (uploadAuth.uploadUrl.empty() ||
+        !m_b2Credentials.uploadBuffer(uploadAuth,
+                                      manifestObjectName(entry.remoteName),
+                                      manifest.data(),
+                                      manifest.size(),
+                                      sha1Hex(manifest.data(), manifest.size()),
+                                      "application/json",
+                                      &job)) {
+      log("Failed to upload manifest for " + entry.remoteName + "\n", LogLevel::Error);
       return false;
     }
+    return true;
+  }
 
-    // Parse response
-    rapidjson::Document doc;
-    doc.Parse(response.c_str());
+  bool uploadSpoolEntry(const SpoolEntry& entry, TransferJob& job) {
+    LogRing::ScopedJob logJob(entry.id);
+    job.onProgress = [this](uint64_t sent) { addSentBytes(sent); };
+    std::string sourceName = std::filesystem::path(entry.sourcePath).filename().string();
+    switch (entry.kind) {
+    case SpoolKind::Directory:
+      return uploadDirectory(entry.localPath, sourceName, entry.remoteName, &job);
+    case SpoolKind::Chunked:
+      return uploadFileChunked(entry.localPath, sourceName, entry.remoteName, &job);
+    case SpoolKind::Tail:
+      return uploadTail(entry, job);
+    case SpoolKind::File:
+      break;
+    }
+    return uploadFile(entry.localPath, entry.remoteName, &job);
+  }
 
-    if (!doc.HasParseError() && doc.IsObject() && doc.HasMember("fileId")) {
-      m_logger += "File uploaded successfully: " + remoteFileName + "\n";
-      return true;
+  // Uploads what the spool holds. Returns false if anything is still pending.
+  bool drainSpool() {
+    if (!ensureAuthenticated()) {
+      log("Offline, " + std::to_string(m_spool.status().pending) + " backups spooled\n", LogLevel::Warning);
+      publishStatus([](BackupStatus& status) { status.phase = BackupPhase::Offline; });
+      return false;
     }
 
-    m_logger += "Upload failed. Response: " + response + "\n";
-    return false;
+    size_t uploaded = m_spool.drain(m_spoolConcurrency,
+                                    [this](const SpoolEntry& entry, TransferJob& job) {
+                                      publishStatus([](BackupStatus& status) {
+                                        ++status.uploadsInFlight;
+                                        status.phase = BackupPhase::Uploading;
+                                      });
+                                      auto started = std::chrono::steady_clock::now();
+                                      bool ok = false;
+                                      {
+                                        Tracer::Cycle cycle(&m_tracer, "upload", entry.id, entry.bytes);
+                                        ok = uploadSpoolEntry(entry, job);
+                                      }
+                                      if (ok) {
+                                        // A failure says more about the network than about upload time
+                                        m_metrics.stage(Stage::Upload).record(std::chrono::steady_clock::now() - started);
+                                      }
+                                      publishStatus([ok](BackupStatus& status) {
+                                        --status.uploadsInFlight;
+                                        status.uploads += ok ? 1 : 0;
+                                        if (status.uploadsInFlight == 0 && status.phase == BackupPhase::Uploading) {
+                                          status.phase = BackupPhase::Waiting;
+                                        }
+                                      });
+                                      return ok;
+                                    },
+                                    &m_cancelTransfers,
+                                    [this](const SpoolEntry& entry) {
+                                      // Later tails would extend an object that was never uploaded
+                                      if (m_appendTracker.forgetBase(entry.sourcePath, entry.remoteName)) {
+                                        log("Base copy of " + entry.sourcePath +
+                                            " is gone, the next capture takes a whole copy\n", LogLevel::Warning);
+                                      }
+                                    });
+    SpoolStatus status = m_spool.status();
+    if (uploaded > 0 || status.pending > 0) {
+      log("Spool drained " + std::to_string(uploaded) + " backups, " +
+          std::to_string(status.pending) + " pending\n");
+    }
+    return status.pending == 0;
   }
 
-  void saveFileOnlyLocal() {
-    while (m_isSavingOnlyLocal) {
+  void openSpool() {
+    if (!m_spool.isOpen()) {
+      std::error_code error;
+      std::filesystem::create_directories(m_stateDirectory, error);
+      m_spool.open(m_stateDirectory / "upload_spool.journal");
+    }
+  }
+
+  // Capture loop. Uploads run on the drain thread, so a new version can be
+  // captured while an older one is still uploading and supersede it.
+  void saveFile() {
+    for (uint64_t cycleId = 0; m_isSaving; ++cycleId) {
       try {
+        Tracer::Cycle cycle(&m_tracer, "capture", cycleId);
+        // Without a path there is nothing to capture, the cycle still waits out the interval
         if (!m_isFilePathSet) {
-          m_logger += "File path not set\n";
-          continue;
+          log("File path not set\n", LogLevel::Error);
+        }
+        else {
+          // The version is spooled first, a failed upload leaves it queued
+          publishStatus([](BackupStatus& status) { status.phase = BackupPhase::Capturing; });
+          captureVersion();
+          uint64_t pending = m_spool.status().pending;
+          publishStatus([pending](BackupStatus& status) {
+            ++status.captures;
+            status.spoolPending = pending;
+          });
+          requestDrain();
         }
-        // Make local copy
-        makeLocalCopy();
       }
       catch (const std::exception& e) {
-        m_logger += std::string("Error: ") + e.what() + "\n";
+        log(std::string("Error: ") + e.what() + "\n", LogLevel::Error);
+        publishResult(false);
       }
 
       // Sleep for the specified interval
-      std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(m_saveInterval * 1000)));
+      publishNextCapture();
+      auto nextCapture = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(static_cast<int>(m_saveInterval * 1000));
+      while (m_isSaving && std::chrono::steady_clock::now() < nextCapture) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      }
     }
   }
 
-  void saveFile() {
-    while (m_isSaving) {
-      try {
-        if (!m_isFilePathSet) {
-          m_logger += "File path not set\n";
-          continue;
-        }
+  void requestDrain() {
+    std::lock_guard<std::mutex> lock(m_drainMutex);
+    m_drainRequested = true;
+    m_drainWake.notify_one();
+  }
 
-        // Make local copy
-        makeLocalCopy();
+  // Drains after every capture, and retries on its own while a backlog is left
+  void drainLoop() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_drainMutex);
+        m_drainWake.wait_for(lock,
+                             std::chrono::milliseconds(static_cast<int>(m_spoolRetryInterval * 1000)),
+                             [this] { return m_drainRequested || !m_isSaving; });
+        m_drainRequested = false;
+      }
+      if (!m_isSaving) {
+        return;
+      }
+      if (m_spool.status().pending == 0) {
+        continue;
+      }
 
-        // Upload to Backblaze B2
-        if (uploadFile()) {
-          m_logger += "Backup completed successfully\n";
+      try {
+        bool drained = drainSpool();
+        bool captured = false;
+        {
+          // A version captured meanwhile is picked up right away, that is not a failure
+          std::lock_guard<std::mutex> lock(m_drainMutex);
+          captured = m_drainRequested;
         }
-        else {
-          m_logger += "Backup failed\n";
+        if (drained) {
+          log("Backup completed successfully\n");
+          publishResult(true);
+        }
+        else if (!captured) {
+          log("Backup failed, kept in spool for retry\n", LogLevel::Error);
+          publishResult(false);
         }
       }
       catch (const std::exception& e) {
-        m_logger += std::string("Error: ") + e.what() + "\n";
+        log(std::string("Error: ") + e.what() + "\n", LogLevel::Error);
+        publishResult(false);
       }
-
-      // Sleep for the specified interval
-      std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(m_saveInterval * 1000)));
     }
   }
 
   void setSaveFileThread(bool set) {
     if (set && !m_isSaving) {
       m_isSaving = true;
+      m_cancelTransfers = false;
+      publishStatus([](BackupStatus& status) {
+        status.saving = true;
+        status.phase = BackupPhase::Waiting;
+      });
       m_fileSaver = std::make_unique<std::thread>(&FileSaver::saveFile, this);
-      m_fileSaver->detach();
+      m_spoolDrainer = std::make_unique<std::thread>(&FileSaver::drainLoop, this);
     }
     else if (!set && m_isSaving) {
       m_isSaving = false;
+      // Aborts a running upload instead of waiting for it
+      m_cancelTransfers = true;
       if (m_fileSaver && m_fileSaver->joinable()) {
         m_fileSaver->join();
       }
       m_fileSaver.reset();
+      requestDrain();
+      if (m_spoolDrainer && m_spoolDrainer->joinable()) {
+        m_spoolDrainer->join();
+      }
+      m_spoolDrainer.reset();
+      // The flag is shared with every other B2 call (listings, restores,
+      // authentication), which must work again once the backup threads are gone
+      m_cancelTransfers = false;
+      publishStopped([](BackupStatus& status) { status.saving = false; });
     }
   }
 
   void setSaveOnlyLocalFileThread(bool set) {
     if (set && !m_isSavingOnlyLocal) {
       m_isSavingOnlyLocal = true;
+      publishStatus([](BackupStatus& status) {
+        status.savingOnlyLocal = true;
+        status.phase = BackupPhase::Waiting;
+      });
       m_onlyLocalFileSaver = std::make_unique<std::thread>(&FileSaver::saveFileOnlyLocal, this);
-      m_onlyLocalFileSaver->detach();
     }
     else if (!set && m_isSavingOnlyLocal) {
       m_isSavingOnlyLocal = false;
@@ -561,21 +1281,131 @@ public:
         m_onlyLocalFileSaver->join();
       }
       m_onlyLocalFileSaver.reset();
+      publishStopped([](BackupStatus& status) { status.savingOnlyLocal = false; });
     }
   }
 
-  static std::string calculateFileSha1(const std::string& filepath) {
-    std::ifstream file(filepath, std::ios::binary);
-    if (!file) {
+  // Applies change to the published status and wakes the UI
+  template <typename Change>
+  void publishStatus(Change&& change) {
+    m_status.update(std::forward<Change>(change));
+    m_uiWake.notify();
+  }
+
+  template <typename Change>
+  void publishStopped(Change&& change) {
+    publishStatus([&change](BackupStatus& status) {
+      change(status);
+      if (!status.saving && !status.savingOnlyLocal) {
+        status.phase = BackupPhase::Stopped;
+        status.nextCaptureAt = 0;
+      }
+    });
+  }
+
+  void publishResult(bool succeeded) {
+    uint64_t pending = m_spool.status().pending;
+    int64_t now = static_cast<int64_t>(std::time(nullptr));
+    publishStatus([succeeded, pending, now](BackupStatus& status) {
+      status.lastResult = succeeded ? BackupResult::Succeeded : BackupResult::Failed;
+      status.lastResultAt = now;
+      status.failures += succeeded ? 0 : 1;
+      status.spoolPending = pending;
+    });
+  }
+
+  void publishNextCapture() {
+    int64_t next = static_cast<int64_t>(std::time(nullptr)) + static_cast<int64_t>(m_saveInterval);
+    publishStatus([next](BackupStatus& status) {
+      status.nextCaptureAt = next;
+      if (status.phase == BackupPhase::Capturing) {
+        status.phase = status.uploadsInFlight > 0 ? BackupPhase::Uploading : BackupPhase::Waiting;
+      }
+    });
+  }
+
+  // Records sampled cycles to traces/ in the state directory, or stops recording
+  bool setTracing(bool on, std::string& error) {
+    if (!on) {
+      m_tracer.stop();
+      log("Trace recording stopped\n");
+      return true;
+    }
+    if (!m_tracer.start(m_stateDirectory / "traces", error)) {
+      return false;
+    }
+    log("Recording 1 in " + std::to_string(m_tracer.sampleEvery.load()) + " cycles to " +
+        m_tracer.currentFile().string() + "\n");
+    return true;
+  }
+
+  // Adds this saver's stage timings and counters; labels such as job="documents"
+  // go on every sample so several savers can share one exposition
+  void collectMetrics(MetricsText& text, const std::string& labels = "") const {
+    for (int i = 0; i < kStageCount; ++i) {
+      Stage stage = static_cast<Stage>(i);
+      text.summary("filesaver_stage_seconds", "Time spent in each backup stage",
+                   MetricsText::join(labels, MetricsText::label("stage", stageName(stage))), m_metrics.stage(stage));
+    }
+
+    BackupStatus status = m_status.load();
+    SpoolStatus spool = m_spool.status();
+    auto count = [](const std::atomic<uint64_t>& value) {
+      return static_cast<double>(value.load(std::memory_order_relaxed));
+    };
+    text.counter("filesaver_sent_bytes_total", "Bytes sent by uploads, retries included", labels, count(m_bytesSent));
+    text.counter("filesaver_copied_bytes_total", "Bytes written to local copies", labels, count(m_metrics.bytesCopied));
+    text.counter("filesaver_hashed_bytes_total", "Bytes hashed before upload", labels, count(m_metrics.bytesHashed));
+    text.counter("filesaver_captures_total", "Versions captured", labels, static_cast<double>(status.captures));
+    text.counter("filesaver_uploads_total", "Versions uploaded", labels, static_cast<double>(status.uploads));
+    text.counter("filesaver_failures_total", "Failed captures and drains", labels, static_cast<double>(status.failures));
+    text.counter("filesaver_retries_total", "Requests retried after a retryable error", labels, count(m_transferStats.retries));
+    text.counter("filesaver_stalls_total", "Transfers aborted for not moving", labels, count(m_transferStats.stalls));
+    text.counter("filesaver_connect_timeouts_total", "Connections that timed out", labels, count(m_transferStats.connectTimeouts));
+    text.counter("filesaver_skipped_identical_total", "Uploads skipped because the bucket had the same content", labels,
+                 count(m_metrics.skippedIdentical));
+    text.counter("filesaver_skipped_identical_bytes_total", "Bytes not sent thanks to identical content", labels,
+                 count(m_skippedUploadBytes));
+    text.counter("filesaver_superseded_total", "Queued versions replaced by a newer one", labels, static_cast<double>(spool.superseded));
+    text.counter("filesaver_chunks_seen_total", "Chunks in chunked versions", labels, count(m_metrics.chunksSeen));
+    text.counter("filesaver_chunks_sent_total", "Chunks the bucket did not have yet", labels, count(m_metrics.chunksSent));
+    text.counter("filesaver_chunk_bytes_seen_total", "Bytes in chunked versions", labels, count(m_metrics.chunkBytesSeen));
+    text.counter("filesaver_chunk_bytes_sent_total", "Chunk bytes actually sent", labels, count(m_metrics.chunkBytesSent));
+    text.gauge("filesaver_dedup_ratio", "Share of chunk bytes that did not need sending", labels, m_metrics.dedupRatio());
+    text.gauge("filesaver_spool_pending", "Versions waiting for upload", labels, static_cast<double>(spool.pending));
+    text.gauge("filesaver_spool_pending_bytes", "Bytes waiting for upload", labels, static_cast<double>(spool.pendingBytes));
+    text.gauge("filesaver_uploads_in_flight", "Uploads running now", labels, static_cast<double>(status.uploadsInFlight));
+    text.gauge("filesaver_last_result_success", "1 if the last backup succeeded, 0 if it failed", labels,
+               status.lastResult == BackupResult::Succeeded ? 1.0 : 0.0);
+    text.gauge("filesaver_last_result_timestamp_seconds", "Unix time of the last backup result", labels,
+               static_cast<double>(status.lastResultAt));
+  }
+
+  // Called from cURL progress callbacks, so it only counts; readers turn the
+  // count into rates with a RateMeter
+  void addSentBytes(uint64_t sent) {
+    m_bytesSent.fetch_add(sent, std::memory_order_relaxed);
+    m_uiWake.notifyProgress();
+  }
+
+  static std::string calculateFileSha1(const std::string& filepath, std::atomic<uint64_t>* hashedBytes = nullptr) {
+    MappedFile file;
+    if (!file.open(filepath)) {
       return "";
     }
 
     SHA_CTX context;
     SHA1_Init(&context);
 
-    char buffer[4096];
-    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
-      SHA1_Update(&context, buffer, file.gcount());
+    // Hashed in place from the mapping, nothing is copied
+    uint64_t offset = 0;
+    size_t length = 0;
+    while (const char* data = file.slice(offset, MappedFile::kWindowSize, length)) {
+      SHA1_Update(&context, data, length);
+      offset += length;
+      if (hashedBytes) {
+        hashedBytes->fetch_add(length, std::memory_order_relaxed);
+      }
     }
 
     unsigned char hash[SHA_DIGEST_LENGTH];
@@ -590,15 +1420,65 @@ public:
   }
 
 public:
-  bool m_isFilePathSet = false;
+  // Written through setFilePath, read through status()
+  std::atomic<bool> m_isFilePathSet{ false };
   BackblazeCredentials m_b2Credentials;
 
   std::filesystem::path m_filePath;
-  std::string m_fileContent;
   std::unique_ptr<std::thread> m_fileSaver;
   std::unique_ptr<std::thread> m_onlyLocalFileSaver;
-  std::string m_logger;
+  // Recent records in memory, all of them in filesaver.log in the state directory
+  LogRing m_log;
+  // Wakes the UI when logs, state or upload progress change
+  UiWake m_uiWake;
+  Seqlock<BackupStatus> m_status;
+  // Sent by every upload since start, retries included
+  std::atomic<uint64_t> m_bytesSent{ 0 };
+  // The local copy being taken, if any
+  ProgressCounter m_copyProgress;
   float m_saveInterval = 300.0f; // seconds
-  bool m_isSaving = false;
-  bool m_isSavingOnlyLocal = false;
+  std::atomic<bool> m_isSaving{ false };
+  std::atomic<bool> m_isSavingOnlyLocal{ false };
+  // Settings below are toggled by the UI while the capture and spool threads read them
+  std::atomic<bool> m_useChunkedUpload{ false };
+  std::atomic<bool> m_useAppendMode{ false };
+
+  uint64_t m_largeFileThreshold = 100ULL * 1024 * 1024;
+  AimdController m_transferController;
+  HedgePolicy m_hedgePolicy;
+  TransferStats m_transferStats;
+  PipelineMetrics m_metrics;
+  // Optional timeline of sampled cycles, off until setTracing(true)
+  Tracer m_tracer;
+  std::atomic<bool> m_cancelTransfers{ false };
+  RateLimiter m_rateLimiter;
+
+  std::filesystem::path m_stateDirectory = "filesaver_state";
+  RemoteChunkIndex m_chunkIndex;
+  std::mutex m_chunkIndexMutex;
+  AppendTracker m_appendTracker;
+
+  std::atomic<bool> m_useKernelTls{ false };
+  UploadCpuStats m_curlCpu;
+  UploadCpuStats m_ktlsCpu;
+
+  // Through keyLayout() and setKeyLayout() only
+  KeyLayout m_keyLayout;
+  mutable std::mutex m_keyLayoutMutex;
+  std::atomic<bool> m_migrating{ false };
+  std::atomic<bool> m_stopMigration{ false };
+  std::atomic<size_t> m_migratedObjects{ 0 };
+  std::unique_ptr<std::thread> m_migration;
+
+  std::atomic<bool> m_skipIdenticalUploads{ true };
+  RemoteFileIndex m_remoteIndex;
+  std::atomic<uint64_t> m_skippedUploadBytes{ 0 };
+
+  UploadSpool m_spool;
+  std::atomic<int> m_spoolConcurrency{ 2 };
+  float m_spoolRetryInterval = 30.0f; // seconds
+  std::unique_ptr<std::thread> m_spoolDrainer;
+  std::mutex m_drainMutex;
+  std::condition_variable m_drainWake;
+  bool m_drainRequested = false;
 };
\ No newline at end of file
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Append-only file whose lines reach the disk before append() returns, so a
+// journal survives a power loss and not just a crash of the process. The
+// whole file is replaced with replace(), which syncs the new file before it
+// is renamed over the old one and the directory after.
+class JournalFile
+{
+public:
+  JournalFile() = default;
+  JournalFile(const JournalFile&) = delete;
+  JournalFile& operator=(const JournalFile&) = delete;
+
+  ~JournalFile() {
+    close();
+  }
+
+  bool open(const std::filesystem::path& path) {
+    close();
+#ifdef _WIN32
+    m_file = CreateFileW(path.wstring().c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                         nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+    m_file = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+#endif
+    return isOpen();
+  }
+
+  bool isOpen() const {
+#ifdef _WIN32
+    return m_file != INVALID_HANDLE_VALUE;
+#else
+    return m_file >= 0;
+#endif
+  }
+
+  void close() {
+    if (!isOpen()) {
+      return;
+    }
+#ifdef _WIN32
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    ::close(m_file);
+    m_file = -1;
+#endif
+  }
+
+  // Writes text at the end of the file and waits until it is on disk
+  bool append(const std::string& text) {
+    return isOpen() && writeAll(m_file, text) && sync(m_file);
+  }
+
+  // Atomically replaces path with content, durable once this returns true
+  static bool replace(const std::filesystem::path& path, const std::string& content) {
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+#ifdef _WIN32
+    HANDLE file = CreateFileW(temporary.wstring().c_str(), GENERIC_WRITE, 0, nullptr,
+                              CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    bool written = writeAll(file, content) && sync(file);
+    CloseHandle(file);
+    // Write-through makes the rename itself durable
+    return written && MoveFileExW(temporary.wstring().c_str(), path.wstring().c_str(),
+                                  MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    int file = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file < 0) {
+      return false;
+    }
+    bool written = writeAll(file, content) && sync(file);
+    ::close(file);
+    if (!written || ::rename(temporary.c_str(), path.c_str()) != 0) {
+      return false;
+    }
+    // The rename lives in the directory, which needs its own sync
+    std::filesystem::path parent = path.parent_path().empty() ? "." : path.parent_path();
+    int directory = ::open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory < 0) {
+      return false;
+    }
+    bool synced = sync(directory);
+    ::close(directory);
+    return synced;
+#endif
+  }
+
+private:
+#ifdef _WIN32
+  static bool writeAll(HANDLE file, const std::string& text) {
+    size_t written = 0;
+    while (written < text.size()) {
+      DWORD chunk = static_cast<DWORD>(std::min<size_t>(text.size() - written, 1 << 30));
+      DWORD done = 0;
+      if (!WriteFile(file, text.data() + written, chunk, &done, nullptr)) {
+        return false;
+      }
+      written += done;
+    }
+    return true;
+  }
+
+  static bool sync(HANDLE file) {
+    return FlushFileBuffers(file) != 0;
+  }
+
+  HANDLE m_file = INVALID_HANDLE_VALUE;
+#else
+  static bool writeAll(int file, const std::string& text) {
+    size_t written = 0;
+    while (written < text.size()) {
+      ssize_t done = ::write(file, text.data() + written, text.size() - written);
+      if (done < 0 && errno == EINTR) {
+        continue;
+      }
+      if (done <= 0) {
+        return false;
+      }
+      written += static_cast<size_t>(done);
+    }
+    return true;
+  }
+
+  static bool sync(int file) {
+    while (::fsync(file) != 0) {
+      if (errno != EINTR) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int m_file = -1;
+#endif
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cctype>
+#include <filesystem>
+#include <string>
+
+#include "ChunkStore.h"
+
+enum class KeyLayoutKind {
+  Flat,        // <timestamp>_<filename> in the bucket root, how older versions were named
+  Hierarchical // <set>/<path hash>/<path>/<timestamp>
+};
+
+// Names the object of each backed up version. The hierarchical layout puts all
+// versions of one source under one prefix, so its history is a prefix listing
+// and comes back in time order. The short path hash after the set spreads
+// sources evenly. It is taken over the unsanitized path, so two paths that
+// sanitize alike (C:/a and C/a) almost always land under different prefixes.
+struct KeyLayout {
+  KeyLayoutKind kind = KeyLayoutKind::Hierarchical;
+  std::string set = "default";
+  size_t hashPrefixLength = 2;
+
+  std::string versionName(const std::filesystem::path& source, const std::string& timestamp) const {
+    if (kind == KeyLayoutKind::Flat) {
+      return timestamp + "_" + source.filename().string();
+    }
+    return historyPrefix(source) + timestamp;
+  }
+
+  // Every version of source, and nothing else, is named under this prefix
+  std::string historyPrefix(const std::filesystem::path& source) const {
+    if (kind == KeyLayoutKind::Flat) {
+      return "";
+    }
+    // The hash is of the path as given, before keyPath() drops colons and dot segments
+    std::string original = source.generic_string();
+    return setName() + "/" + sha1Hex(original.data(), original.size()).substr(0, hashPrefixLength) + "/" +
+      keyPath(source) + "/";
+  }
+
+  // Splits a flat layout name into its timestamp and file name
+  static bool parseFlat(const std::string& name, std::string& timestamp, std::string& fileName) {
+    const size_t stampLength = 15; // YYYYMMDD_HHMMSS
+    if (name.size() <= stampLength + 1 || name.find('/') != std::string::npos ||
+        name[8] != '_' || name[stampLength] != '_') {
+      return false;
+    }
+    for (size_t i = 0; i < stampLength; ++i) {
+      if (i != 8 && !isdigit(static_cast<unsigned char>(name[i]))) {
+        return false;
+      }
+    }
+    timestamp = name.substr(0, stampLength);
+    fileName = name.substr(stampLength + 1);
+    return true;
+  }
+
+  // The source path as a key: '/' separated, no drive colon, no empty or dot segments
+  static std::string keyPath(const std::filesystem::path& source) {
+    std::string generic = source.generic_string();
+    std::string path;
+    std::string segment;
+    auto flush = [&]() {
+      if (!segment.empty() && segment != "." && segment != "..") {
+        if (!path.empty()) {
+          path += '/';
+        }
+        path += segment;
+      }
+      segment.clear();
+    };
+    for (char c : generic) {
+      if (c == '/' || c == '\\') {
+        flush();
+      }
+      else if (c != ':') {
+        segment += c;
+      }
+    }
+    flush();
+    return path;
+  }
+
+private:
+  std::string setName() const {
+    std::string name;
+    for (char c : set) {
+      name += (c == '/' || c == '\\') ? '_' : c;
+    }
+    return name.empty() ? "default" : name;
+  }
+};
@@ -0,0 +1,518 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <openssl/opensslv.h>
+
+#include "RateLimiter.h"
+#include "TransferWatchdog.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(__linux__) && OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/ssl.h>
+#if !defined(OPENSSL_NO_KTLS)
+#define KTLS_UPLOAD_SUPPORTED 1
+#endif
+#endif
+
+#ifdef KTLS_UPLOAD_SUPPORTED
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+
+// CPU time of the calling thread, user and kernel, in nanoseconds
+inline uint64_t threadCpuNs() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  auto ticks = [](const FILETIME& time) {
+    return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+  };
+  return (ticks(kernel) + ticks(user)) * 100;
+#else
+  timespec now;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) != 0) {
+    return 0;
+  }
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + static_cast<uint64_t>(now.tv_nsec);
+#endif
+}
+
+// Bytes uploaded through one path and the CPU the uploading threads spent on them
+struct UploadCpuStats {
+  std::atomic<uint64_t> bytes{ 0 };
+  std::atomic<uint64_t> cpuNs{ 0 };
+
+  void add(uint64_t uploaded, uint64_t spentNs) {
+    bytes += uploaded;
+    cpuNs += spentNs;
+  }
+
+  double cpuSecondsPerGB() const {
+    uint64_t total = bytes.load();
+    return total == 0 ? 0.0 : (cpuNs.load() / 1e9) / (total / (1024.0 * 1024.0 * 1024.0));
+  }
+};
+
+enum class KtlsResult {
+  Sent,       // a response was received, httpCode and response are set
+  Unsupported, // kernel TLS could not be enabled, nothing was sent, use cURL
+  Failed
+};
+
+#ifdef KTLS_UPLOAD_SUPPORTED
+
+// HTTP/1.1 POST of a file over a TLS session handed to the kernel. OpenSSL
+// does the handshake in user space, then with SSL_OP_ENABLE_KTLS installs the
+// session keys with TCP_ULP "tls". Headers are written with SSL_write, the
+// body goes file -> socket with SSL_sendfile and is encrypted in the kernel,
+// never entering user space.
+class KtlsUploader
+{
+public:
+  explicit KtlsUploader(const TransferTimeouts& timeouts) : m_timeouts(timeouts) {}
+
+  RateLimiter* limiter = nullptr;
+  const std::atomic<bool>* cancel = nullptr;
+  TransferJob* job = nullptr;
+
+  // PEM file of the CAs to trust, empty for the system store
+  std::string caFile;
+  // Connects here instead of to the URL's host and port; SNI and certificate
+  // checks still use the URL's host. Lets a test point a real upload URL at a
+  // local stand-in server.
+  std::string connectHost;
+  std::string connectPort;
+
+  // False once a handshake showed the kernel cannot take the session (no tls
+  // module, unsupported cipher), so later uploads go straight to cURL
+  static bool kernelSupported() {
+    return kernelState() != 0;
+  }
+
+  KtlsResult post(const std::string& url,
+                  const std::vector<std::string>& headers,
+                  const std::filesystem::path& bodyPath,
+                  uint64_t bodySize,
+                  long& httpCode,
+                  std::string& response,
+                  TransferError& error) {
+    httpCode = 0;
+    error = TransferError::Network;
+
+    std::string host, port, path;
+    if (!parseUrl(url, host, port, path)) {
+      error = TransferError::ClientError;
+      return KtlsResult::Unsupported;
+    }
+
+    SigpipeBlock sigpipe;
+    Connection connection;
+    KtlsResult result = connect(connection, host, connectHost.empty() ? host : connectHost,
+                                connectPort.empty() ? port : connectPort, error);
+    if (result != KtlsResult::Sent) {
+      return result;
+    }
+
+    std::string head = "POST " + path + " HTTP/1.1\r\nHost: " + host + "\r\n";
+    for (const auto& header : headers) {
+      head += header + "\r\n";
+    }
+    head += "Content-Length: " + std::to_string(bodySize) + "\r\nConnection: close\r\n\r\n";
+    if (!writeAll(connection.ssl, head, error)) {
+      return KtlsResult::Failed;
+    }
+
+    if (!sendBody(connection.ssl, bodyPath, bodySize, error)) {
+      return KtlsResult::Failed;
+    }
+
+    if (!readResponse(connection.ssl, httpCode, response, error)) {
+      return KtlsResult::Failed;
+    }
+    error = classifyHttpStatus(httpCode);
+    return KtlsResult::Sent;
+  }
+
+private:
+  // 1 supported, 0 not, -1 not known yet
+  static std::atomic<int>& kernelState() {
+    static std::atomic<int> state{ -1 };
+    return state;
+  }
+
+  // One context per trust store, kept for the life of the process
+  static SSL_CTX* context(const std::string& caFile) {
+    static std::mutex mutex;
+    static std::map<std::string, SSL_CTX*> contexts;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = contexts.find(caFile);
+    if (found != contexts.end()) {
+      return found->second;
+    }
+
+    SSL_CTX* c = SSL_CTX_new(TLS_client_method());
+    if (c) {
+      bool trusted = caFile.empty() ? SSL_CTX_set_default_verify_paths(c) == 1
+                                    : SSL_CTX_load_verify_locations(c, caFile.c_str(), nullptr) == 1;
+      if (!trusted) {
+        ERR_clear_error();
+        SSL_CTX_free(c);
+        c = nullptr;
+      }
+    }
+    if (c) {
+      SSL_CTX_set_verify(c, SSL_VERIFY_PEER, nullptr);
+      SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+      SSL_CTX_set_options(c, SSL_OP_ENABLE_KTLS);
+      // Only AES-GCM suites can be offloaded by the Linux kernel
+      SSL_CTX_set_cipher_list(c, "ECDHE+AESGCM");
+      SSL_CTX_set_ciphersuites(c, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384");
+    }
+    contexts[caFile] = c;
+    return c;
+  }
+
+  struct Connection {
+    int fd = -1;
+    SSL* ssl = nullptr;
+
+    ~Connection() {
+      if (ssl) {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+      }
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  };
+
+  // A peer closing the socket must fail the write, not kill the process
+  struct SigpipeBlock {
+    sigset_t old;
+    bool blocked = false;
+
+    SigpipeBlock() {
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGPIPE);
+      blocked = pthread_sigmask(SIG_BLOCK, &set, &old) == 0;
+    }
+
+    ~SigpipeBlock() {
+      if (!blocked) {
+        return;
+      }
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGPIPE);
+      timespec zero = { 0, 0 };
+      while (sigtimedwait(&set, nullptr, &zero) > 0) {
+      }
+      pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    }
+  };
+
+  static bool parseUrl(const std::string& url, std::string& host, std::string& port, std::string& path) {
+    const std::string scheme = "https://";
+    if (url.compare(0, scheme.size(), scheme) != 0) {
+      return false;
+    }
+    size_t hostStart = scheme.size();
+    size_t pathStart = url.find('/', hostStart);
+    std::string authority = url.substr(hostStart, pathStart == std::string::npos ? std::string::npos : pathStart - hostStart);
+    path = pathStart == std::string::npos ? "/" : url.substr(pathStart);
+
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos && authority.find(']') == std::string::npos) {
+      host = authority.substr(0, colon);
+      port = authority.substr(colon + 1);
+    }
+    else {
+      host = authority;
+      port = "443";
+    }
+    return !host.empty();
+  }
+
+  bool cancelled() const {
+    return (cancel && cancel->load()) || (job && job->cancel.load());
+  }
+
+  // Sent means the session is in the kernel and the request can go out
+  KtlsResult connect(Connection& connection, const std::string& host, const std::string& address,
+                     const std::string& port, TransferError& error) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(address.c_str(), port.c_str(), &hints, &addresses) != 0) {
+      return KtlsResult::Failed;
+    }
+
+    for (addrinfo* candidate = addresses; candidate && connection.fd < 0; candidate = candidate->ai_next) {
+      int fd = socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      // Non-blocking connect so the connect deadline applies
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      int rc = ::connect(fd, candidate->ai_addr, candidate->ai_addrlen);
+      if (rc != 0 && errno == EINPROGRESS) {
+        pollfd waiting = { fd, POLLOUT, 0 };
+        int timeout = m_timeouts.connectTimeoutMs > 0 ? static_cast<int>(m_timeouts.connectTimeoutMs) : -1;
+        int socketError = 0;
+        socklen_t length = sizeof(socketError);
+        if (poll(&waiting, 1, timeout) == 1 &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &socketError, &length) == 0 && socketError == 0) {
+          rc = 0;
+        }
+        else if (socketError == 0) {
+          error = TransferError::ConnectTimeout;
+        }
+      }
+      if (rc != 0) {
+        ::close(fd);
+        continue;
+      }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+      connection.fd = fd;
+    }
+    freeaddrinfo(addresses);
+    if (connection.fd < 0) {
+      return KtlsResult::Failed;
+    }
+
+    // A blocked send or receive for this long is a stall, like the cURL watchdog
+    if (m_timeouts.firstByteTimeoutMs > 0) {
+      timeval stall = { m_timeouts.firstByteTimeoutMs / 1000, (m_timeouts.firstByteTimeoutMs % 1000) * 1000 };
+      setsockopt(connection.fd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+      setsockopt(connection.fd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+    }
+
+    SSL_CTX* ctx = context(caFile);
+    connection.ssl = ctx ? SSL_new(ctx) : nullptr;
+    if (!connection.ssl) {
+      return KtlsResult::Unsupported;
+    }
+    SSL_set_tlsext_host_name(connection.ssl, host.c_str());
+    SSL_set1_host(connection.ssl, host.c_str());
+    SSL_set_fd(connection.ssl, connection.fd);
+    if (SSL_connect(connection.ssl) != 1) {
+      ERR_clear_error();
+      error = errno == EAGAIN || errno == EWOULDBLOCK ? TransferError::Stalled : TransferError::Network;
+      return KtlsResult::Failed;
+    }
+
+    if (!BIO_get_ktls_send(SSL_get_wbio(connection.ssl))) {
+      kernelState() = 0;
+      return KtlsResult::Unsupported;
+    }
+    kernelState() = 1;
+    return KtlsResult::Sent;
+  }
+
+  bool writeAll(SSL* ssl, const std::string& data, TransferError& error) {
+    size_t written = 0;
+    while (written < data.size()) {
+      size_t n = 0;
+      if (SSL_write_ex(ssl, data.data() + written, data.size() - written, &n) != 1) {
+        ERR_clear_error();
+        error = errno == EAGAIN || errno == EWOULDBLOCK ? TransferError::Stalled : TransferError::Network;
+        return false;
+      }
+      written += n;
+    }
+    return true;
+  }
+
+  // Sends the body in slices so the rate limiter, cancel flags and job progress still apply
+  bool sendBody(SSL* ssl, const std::filesystem::path& bodyPath, uint64_t bodySize, TransferError& error) {
+    int fd = ::open(bodyPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      error = TransferError::ClientError;
+      return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    const size_t sliceSize = 1024 * 1024;
+    uint64_t offset = 0;
+    bool ok = true;
+    while (offset < bodySize) {
+      if (cancelled()) {
+        error = TransferError::Cancelled;
+        ok = false;
+        break;
+      }
+      size_t wanted = static_cast<size_t>(std::min<uint64_t>(sliceSize, bodySize - offset));
+      if (limiter) {
+        wanted = limiter->acquireUpload(wanted, cancel);
+      }
+
+      ossl_ssize_t sent = SSL_sendfile(ssl, fd, static_cast<off_t>(offset), wanted, 0);
+      if (sent <= 0) {
+        ERR_clear_error();
+        error = errno == EAGAIN || errno == EWOULDBLOCK ? TransferError::Stalled : TransferError::Network;
+        ok = false;
+        break;
+      }
+      offset += static_cast<uint64_t>(sent);
+      if (job) {
+        job->sentBytes += static_cast<uint64_t>(sent);
+      }
+    }
+    ::close(fd);
+    return ok;
+  }
+
+  // Reads the reply up to the end of its body: Content-Length bytes, the last
+  // chunk of a chunked body, or the server closing the connection
+  bool readResponse(SSL* ssl, long& httpCode, std::string& response, TransferError& error) {
+    std::string raw;
+    char buffer[16 * 1024];
+    size_t headerEnd = std::string::npos;
+    uint64_t contentLength = UINT64_MAX;
+    bool chunked = false;
+    int decoded = 0; // decodeChunked() of the body so far
+
+    while (true) {
+      if (headerEnd != std::string::npos) {
+        if (chunked) {
+          decoded = decodeChunked(raw.substr(headerEnd), response);
+          if (decoded != 0) {
+            break;
+          }
+        }
+        else if (raw.size() - headerEnd >= contentLength) {
+          break;
+        }
+      }
+      size_t n = 0;
+      if (SSL_read_ex(ssl, buffer, sizeof(buffer), &n) != 1) {
+        int reason = SSL_get_error(ssl, 0);
+        ERR_clear_error();
+        if (reason == SSL_ERROR_ZERO_RETURN ||
+            (headerEnd != std::string::npos && contentLength == UINT64_MAX && !chunked)) {
+          break; // Connection: close ends the body
+        }
+        error = errno == EAGAIN || errno == EWOULDBLOCK ? TransferError::Stalled : TransferError::Network;
+        return false;
+      }
+      raw.append(buffer, n);
+
+      if (headerEnd == std::string::npos) {
+        size_t end = raw.find("\r\n\r\n");
+        if (end == std::string::npos) {
+          continue;
+        }
+        headerEnd = end + 4;
+        std::string head = raw.substr(0, end);
+        size_t space = head.find(' ');
+        httpCode = space == std::string::npos ? 0 : std::strtol(head.c_str() + space + 1, nullptr, 10);
+        std::string length = headerValue(head, "content-length");
+        contentLength = length.empty() ? UINT64_MAX : std::strtoull(length.c_str(), nullptr, 10);
+        std::string encoding = headerValue(head, "transfer-encoding");
+        for (auto& c : encoding) {
+          c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        }
+        chunked = encoding.find("chunked") != std::string::npos;
+      }
+    }
+
+    if (headerEnd == std::string::npos) {
+      return false;
+    }
+    if (chunked) {
+      // Closed before the last chunk, or framing that is not chunked at all
+      if (decoded != 1 && decodeChunked(raw.substr(headerEnd), response) != 1) {
+        error = TransferError::Network;
+        return false;
+      }
+      return true;
+    }
+    response = raw.substr(headerEnd);
+    return true;
+  }
+
+  // Decodes a chunked body into out: 1 when the last chunk was read, 0 when
+  // more bytes are needed, -1 when the framing is broken. Trailers are ignored.
+  static int decodeChunked(const std::string& body, std::string& out) {
+    out.clear();
+    size_t at = 0;
+    while (true) {
+      size_t lineEnd = body.find("\r\n", at);
+      if (lineEnd == std::string::npos) {
+        return 0;
+      }
+      char* end = nullptr;
+      uint64_t size = std::strtoull(body.c_str() + at, &end, 16);
+      if (end == body.c_str() + at || (*end != '\r' && *end != ';' && *end != ' ')) {
+        return -1;
+      }
+      at = lineEnd + 2;
+      if (size == 0) {
+        return 1;
+      }
+      if (body.size() - at < size + 2) {
+        return 0;
+      }
+      if (body.compare(at + size, 2, "\r\n") != 0) {
+        return -1;
+      }
+      out.append(body, at, size);
+      at += size + 2;
+    }
+  }
+
+  // Value of a header, empty when it is absent
+  static std::string headerValue(const std::string& head, const std::string& lowerName) {
+    std::string lower = head;
+    for (auto& c : lower) {
+      c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    size_t at = lower.find("\r\n" + lowerName + ":");
+    if (at == std::string::npos) {
+      return "";
+    }
+    size_t start = head.find_first_not_of(" \t", at + lowerName.size() + 3);
+    size_t end = head.find("\r\n", at + 2);
+    if (start == std::string::npos || (end != std::string::npos && start >= end)) {
+      return "";
+    }
+    return head.substr(start, end == std::string::npos ? std::string::npos : end - start);
+  }
+
+  const TransferTimeouts& m_timeouts;
+};
+
+#endif
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class LogLevel {
+  Debug,
+  Info,
+  Warning,
+  Error
+};
+
+inline const char* logLevelName(LogLevel level) {
+  switch (level) {
+  case LogLevel::Debug: return "DEBUG";
+  case LogLevel::Info: return "INFO";
+  case LogLevel::Warning: return "WARN";
+  case LogLevel::Error: return "ERROR";
+  }
+  return "";
+}
+
+struct LogRecord {
+  uint64_t sequence = 0;
+  int64_t timeUs = 0; // unix microseconds
+  LogLevel level = LogLevel::Info;
+  uint64_t jobId = 0; // spool entry the writing thread was working on, 0 if none
+  std::string message;
+
+  // "2026-10-18 12:00:00.123 INFO  #12 message"
+  std::string format() const {
+    std::time_t seconds = static_cast<std::time_t>(timeUs / 1000000);
+    std::tm tm = {};
+#ifdef _WIN32
+    localtime_s(&tm, &seconds);
+#else
+    localtime_r(&seconds, &tm);
+#endif
+    std::stringstream ss;
+    ss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S") << '.' << std::setw(3) << std::setfill('0')
+      << (timeUs / 1000) % 1000 << ' ' << std::left << std::setw(5) << std::setfill(' ') << logLevelName(level);
+    if (jobId != 0) {
+      ss << " #" << jobId;
+    }
+    ss << ' ' << message;
+    return ss.str();
+  }
+};
+
+// Bounded multi-producer log. Writers claim a slot and a span of the message
+// arena with one fetch_add each and never wait: the oldest records are
+// overwritten, and a writer that would collide with a stalled one drops its
+// record and counts it. Each slot is a small seqlock, so readers copy records
+// out without locks and keep only those that did not change while copied.
+// A background thread appends every record to a rotating file before the ring
+// wraps over it, which is where history beyond the ring lives.
+class LogRing
+{
+public:
+  static constexpr size_t kRecords = 4096;
+  static constexpr size_t kArenaBytes = 1024 * 1024;
+  static constexpr size_t kMaxMessage = 4096;
+
+  uint64_t maxFileBytes = 8 * 1024 * 1024;
+  int keepFiles = 3;
+
+  LogRing() : m_slots(new Slot[kRecords]), m_arena(new char[kArenaBytes]) {}
+
+  ~LogRing() {
+    stopSpill();
+  }
+
+  LogRing(const LogRing&) = delete;
+  LogRing& operator=(const LogRing&) = delete;
+
+  // Tags records written by this thread with a job id for its lifetime
+  class ScopedJob
+  {
+  public:
+    explicit ScopedJob(uint64_t jobId) : m_previous(currentJob()) {
+      currentJob() = jobId;
+    }
+
+    ~ScopedJob() {
+      currentJob() = m_previous;
+    }
+
+  private:
+    uint64_t m_previous;
+  };
+
+  void write(LogLevel level, const std::string& text) {
+    size_t length = std::min(text.size(), kMaxMessage);
+    while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) {
+      --length;
+    }
+
+    uint64_t sequence = m_head.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = m_slots[sequence % kRecords];
+    uint64_t stamp = slot.stamp.load(std::memory_order_relaxed);
+    // Odd means another writer is still in this slot, a later stamp means it lapped us
+    if ((stamp & 1) != 0 || stamp > writingStamp(sequence) ||
+        !slot.stamp.compare_exchange_strong(stamp, writingStamp(sequence), std::memory_order_acquire)) {
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    uint64_t at = m_arenaHead.fetch_add(length, std::memory_order_relaxed);
+    copyToArena(at, text.data(), length);
+
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    slot.timeUs.store(std::chrono::duration_cast<std::chrono::microseconds>(now).count(), std::memory_order_relaxed);
+    slot.level.store(static_cast<int>(level), std::memory_order_relaxed);
+    slot.jobId.store(currentJob(), std::memory_order_relaxed);
+    slot.arenaAt.store(at, std::memory_order_relaxed);
+    slot.length.store(static_cast<uint32_t>(length), std::memory_order_relaxed);
+    slot.stamp.store(writtenStamp(sequence), std::memory_order_release);
+
+    // Get the spill thread going well before the ring wraps over what it has not written yet
+    if ((sequence + 1) % (kRecords / 4) == 0) {
+      m_spillWake.notify_one();
+    }
+  }
+
+  // Records from next on, oldest first, and moves next past them. Stops at the
+  // first record whose writer has not finished, so the next call resumes
+  // there. A record counts as missed, and is skipped, only once the ring has
+  // wrapped past it; that also ends the wait for a record its writer dropped,
+  // which happens only while the ring is lapping a stalled writer.
+  std::vector<LogRecord> readFrom(uint64_t& next, uint64_t& missed) const {
+    std::vector<LogRecord> records;
+    LogRecord record;
+    while (true) {
+      uint64_t head = m_head.load(std::memory_order_acquire);
+      if (head > kRecords && next < head - kRecords) {
+        missed += head - kRecords - next;
+        next = head - kRecords;
+      }
+      if (next >= head) {
+        break;
+      }
+      if (read(next, record)) {
+        records.push_back(record);
+        ++next;
+        continue;
+      }
+      // Still being written, unless the ring lapped it while it was read
+      if (m_head.load(std::memory_order_acquire) <= next + kRecords) {
+        break;
+      }
+    }
+    return records;
+  }
+
+  // Sequence the next record will get
+  uint64_t head() const {
+    return m_head.load(std::memory_order_acquire);
+  }
+
+  uint64_t dropped() const {
+    return m_dropped.load(std::memory_order_relaxed);
+  }
+
+  // Records the spill thread found overwritten before it could write them
+  uint64_t lost() const {
+    return m_lost.load(std::memory_order_relaxed);
+  }
+
+  // Starts appending every record to path, rotated to path.1 .. path.keepFiles
+  void startSpill(const std::filesystem::path& path) {
+    std::lock_guard<std::mutex> lock(m_spillMutex);
+    if (m_spillThread) {
+      return;
+    }
+    m_spillPath = path;
+    m_spillStop = false;
+    m_spillThread = std::make_unique<std::thread>(&LogRing::spillLoop, this);
+  }
+
+  void stopSpill() {
+    {
+      std::lock_guard<std::mutex> lock(m_spillMutex);
+      if (!m_spillThread) {
+        return;
+      }
+      m_spillStop = true;
+    }
+    m_spillWake.notify_all();
+    m_spillThread->join();
+    m_spillThread.reset();
+  }
+
+  std::filesystem::path spillPath() const {
+    std::lock_guard<std::mutex> lock(m_spillMutex);
+    return m_spillPath;
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> stamp{ 0 };
+    std::atomic<int64_t> timeUs{ 0 };
+    std::atomic<int> level{ 0 };
+    std::atomic<uint64_t> jobId{ 0 };
+    std::atomic<uint64_t> arenaAt{ 0 };
+    std::atomic<uint32_t> length{ 0 };
+  };
+
+  static uint64_t writingStamp(uint64_t sequence) {
+    return 2 * sequence + 1;
+  }
+
+  static uint64_t writtenStamp(uint64_t sequence) {
+    return 2 * sequence + 2;
+  }
+
+  static uint64_t& currentJob() {
+    thread_local uint64_t jobId = 0;
+    return jobId;
+  }
+
+  void copyToArena(uint64_t at, const char* data, size_t length) {
+    size_t offset = static_cast<size_t>(at % kArenaBytes);
+    size_t first = std::min(length, kArenaBytes - offset);
+    memcpy(m_arena.get() + offset, data, first);
+    memcpy(m_arena.get(), data + first, length - first);
+  }
+
+  bool read(uint64_t sequence, LogRecord& record) const {
+    const Slot& slot = m_slots[sequence % kRecords];
+    uint64_t stamp = slot.stamp.load(std::memory_order_acquire);
+    if (stamp != writtenStamp(sequence)) {
+      return false;
+    }
+
+    record.sequence = sequence;
+    record.timeUs = slot.timeUs.load(std::memory_order_relaxed);
+    record.level = static_cast<LogLevel>(slot.level.load(std::memory_order_relaxed));
+    record.jobId = slot.jobId.load(std::memory_order_relaxed);
+    uint64_t at = slot.arenaAt.load(std::memory_order_relaxed);
+    size_t length = slot.length.load(std::memory_order_relaxed);
+    record.message.resize(length);
+    size_t offset = static_cast<size_t>(at % kArenaBytes);
+    size_t first = std::min(length, kArenaBytes - offset);
+    memcpy(&record.message[0], m_arena.get() + offset, first);
+    memcpy(&record.message[0] + first, m_arena.get(), length - first);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // The slot was rewritten, or later messages wrapped the arena over this one
+    return slot.stamp.load(std::memory_order_relaxed) == stamp &&
+      m_arenaHead.load(std::memory_order_relaxed) - at <= kArenaBytes;
+  }
+
+  void spillLoop() {
+    std::error_code error;
+    uint64_t size = std::filesystem::exists(m_spillPath, error) ? std::filesystem::file_size(m_spillPath, error) : 0;
+    std::ofstream out(m_spillPath, std::ios::app);
+    // Records written before the spill started are still in the ring
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    uint64_t next = head > kRecords ? head - kRecords : 0;
+    int stuckPasses = 0;
+    LogRecord record;
+
+    for (;;) {
+      head = m_head.load(std::memory_order_acquire);
+      if (head > next + kRecords) {
+        m_lost.fetch_add(head - kRecords - next, std::memory_order_relaxed);
+        out << "[" << head - kRecords - next << " log records lost]\n";
+        next = head - kRecords;
+      }
+
+      for (; next < head; ++next) {
+        if (!read(next, record)) {
+          // Claimed but not finished yet, picked up on a later pass. A record
+          // whose writer dropped it never finishes, so do not wait forever.
+          const Slot& slot = m_slots[next % kRecords];
+          if (slot.stamp.load(std::memory_order_acquire) < writtenStamp(next) &&
+              m_head.load(std::memory_order_relaxed) < next + kRecords && ++stuckPasses < 5) {
+            break;
+          }
+          m_lost.fetch_add(1, std::memory_order_relaxed);
+          stuckPasses = 0;
+          continue;
+        }
+        stuckPasses = 0;
+        std::string line = record.format();
+        out << line << '\n';
+        size += line.size() + 1;
+      }
+      out.flush();
+
+      if (size >= maxFileBytes) {
+        out.close();
+        rotate();
+        out.open(m_spillPath, std::ios::trunc);
+        size = 0;
+      }
+
+      std::unique_lock<std::mutex> lock(m_spillMutex);
+      if (m_spillStop && next >= m_head.load(std::memory_order_acquire)) {
+        break;
+      }
+      m_spillWake.wait_for(lock, std::chrono::milliseconds(200));
+    }
+  }
+
+  // path.N-1 -> path.N, ..., path -> path.1
+  void rotate() {
+    std::error_code error;
+    for (int i = keepFiles; i >= 1; --i) {
+      std::filesystem::path from = m_spillPath;
+      if (i > 1) {
+        from += "." + std::to_string(i - 1);
+      }
+      std::filesystem::path to = m_spillPath;
+      to += "." + std::to_string(i);
+      std::filesystem::remove(to, error);
+      std::filesystem::rename(from, to, error);
+    }
+  }
+
+  std::unique_ptr<Slot[]> m_slots;
+  std::unique_ptr<char[]> m_arena;
+  std::atomic<uint64_t> m_head{ 0 };
+  std::atomic<uint64_t> m_arenaHead{ 0 };
+  std::atomic<uint64_t> m_dropped{ 0 };
+  std::atomic<uint64_t> m_lost{ 0 };
+
+  mutable std::mutex m_spillMutex;
+  std::condition_variable m_spillWake;
+  std::unique_ptr<std::thread> m_spillThread;
+  std::filesystem::path m_spillPath;
+  bool m_spillStop = false;
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "imgui.h"
+#include "imgui_stdlib.h"
+#include "LogRing.h"
+
+// Log panel over a LogRing. New records are pulled once, formatted once and
+// kept here, up to maxRecords, so the panel can show more history than the
+// ring holds. The records that pass the filters are kept as a list of indices
+// that grows with each new record and is rebuilt only when a filter changes,
+// and only the rows on screen are drawn, so a frame costs the same however
+// long the log gets.
+class LogView
+{
+public:
+  size_t maxRecords = 100000;
+
+  // Pulls the records written since the last call
+  void update(const LogRing& ring) {
+    if (ring.head() == m_next) {
+      return;
+    }
+    std::vector<LogRecord> records = ring.readFrom(m_next, m_missed);
+    for (auto& record : records) {
+      Entry entry;
+      entry.sequence = record.sequence;
+      entry.level = record.level;
+      entry.jobId = record.jobId;
+      entry.line = record.format();
+      entry.lower = lowercase(entry.line);
+      m_entries.push_back(std::move(entry));
+      if (matches(m_entries.back())) {
+        m_visible.push_back(m_entries.back().sequence);
+      }
+    }
+
+    if (m_entries.size() > maxRecords) {
+      // Trim in chunks so the deque and the index are not shifted every frame
+      size_t trim = m_entries.size() - maxRecords + maxRecords / 10;
+      m_entries.erase(m_entries.begin(), m_entries.begin() + std::min(trim, m_entries.size()));
+      uint64_t first = m_entries.empty() ? m_next : m_entries.front().sequence;
+      auto keep = std::lower_bound(m_visible.begin(), m_visible.end(), first);
+      m_visible.erase(m_visible.begin(), keep);
+    }
+  }
+
+  // Draws the filter bar and the rows in view. Returns true if text was copied.
+  bool draw(const LogRing& ring) {
+    bool copied = false;
+    bool changed = false;
+
+    const char* levels[] = { "Debug", "Info", "Warning", "Error" };
+    int level = static_cast<int>(m_minLevel);
+    ImGui::SetNextItemWidth(100);
+    if (ImGui::Combo("Level", &level, levels, IM_ARRAYSIZE(levels))) {
+      m_minLevel = static_cast<LogLevel>(level);
+      changed = true;
+    }
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(80);
+    if (ImGui::InputScalar("Job", ImGuiDataType_U64, &m_jobId)) {
+      changed = true;
+    }
+    if (ImGui::IsItemHovered()) {
+      ImGui::SetTooltip("Only records of this upload, 0 for all");
+    }
+    ImGui::SameLine();
+    ImGui::SetNextItemWidth(200);
+    if (ImGui::InputTextWithHint("##LogSearch", "Search", &m_search)) {
+      m_searchLower = lowercase(m_search);
+      changed = true;
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Copy selection") && hasSelection()) {
+      copySelection();
+      copied = true;
+    }
+    ImGui::SameLine();
+    ImGui::Checkbox("Follow", &m_follow);
+    ImGui::SameLine();
+    ImGui::TextDisabled("%zu of %zu", m_visible.size(), m_entries.size());
+
+    if (ring.dropped() > 0 || ring.lost() > 0 || m_missed > 0) {
+      ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "%llu records dropped, %llu not written to %s, %llu missed by this view",
+                         (unsigned long long)ring.dropped(),
+                         (unsigned long long)ring.lost(),
+                         ring.spillPath().string().c_str(),
+                         (unsigned long long)m_missed);
+    }
+
+    if (changed) {
+      rebuild();
+    }
+
+    ImGui::BeginChild("ScrollingText", ImVec2(0, 0), true,
+      ImGuiWindowFlags_HorizontalScrollbar |
+      ImGuiWindowFlags_AlwaysVerticalScrollbar);
+
+    bool atBottom = ImGui::GetScrollY() >= ImGui::GetScrollMaxY() - 1.0f;
+
+    ImGuiListClipper clipper;
+    clipper.Begin(static_cast<int>(m_visible.size()));
+    while (clipper.Step()) {
+      for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; ++row) {
+        const Entry& entry = entryAt(m_visible[row]);
+        bool colored = entry.level == LogLevel::Error || entry.level == LogLevel::Warning;
+        if (entry.level == LogLevel::Error) {
+          ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.4f, 0.4f, 1.0f));
+        }
+        else if (entry.level == LogLevel::Warning) {
+          ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.8f, 0.3f, 1.0f));
+        }
+        ImGui::PushID(static_cast<int>(entry.sequence));
+        if (ImGui::Selectable(entry.line.c_str(), isSelected(entry.sequence))) {
+          select(entry.sequence, ImGui::GetIO().KeyShift);
+        }
+        ImGui::PopID();
+        if (colored) {
+          ImGui::PopStyleColor();
+        }
+      }
+    }
+    clipper.End();
+
+    if (ImGui::IsWindowFocused() && ImGui::GetIO().KeyCtrl && ImGui::IsKeyPressed(ImGuiKey_C) && hasSelection()) {
+      copySelection();
+      copied = true;
+    }
+
+    if (m_follow && atBottom) {
+      ImGui::SetScrollHereY(1.0f);
+    }
+
+    ImGui::EndChild();
+    return copied;
+  }
+
+private:
+  struct Entry {
+    uint64_t sequence = 0;
+    LogLevel level = LogLevel::Info;
+    uint64_t jobId = 0;
+    std::string line;
+    std::string lower; // for the case insensitive search
+  };
+
+  static std::string lowercase(const std::string& text) {
+    std::string lower = text;
+    for (char& c : lower) {
+      c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return lower;
+  }
+
+  // Entries are in sequence order, with gaps where the view missed records
+  const Entry& entryAt(uint64_t sequence) const {
+    auto it = std::lower_bound(m_entries.begin(), m_entries.end(), sequence,
+      [](const Entry& entry, uint64_t value) { return entry.sequence < value; });
+    return *it;
+  }
+
+  bool matches(const Entry& entry) const {
+    return entry.level >= m_minLevel &&
+      (m_jobId == 0 || entry.jobId == m_jobId) &&
+      (m_searchLower.empty() || entry.lower.find(m_searchLower) != std::string::npos);
+  }
+
+  void rebuild() {
+    m_visible.clear();
+    for (const auto& entry : m_entries) {
+      if (matches(entry)) {
+        m_visible.push_back(entry.sequence);
+      }
+    }
+  }
+
+  // Selection is a range of sequences, so it holds while filters change and records arrive
+  bool hasSelection() const {
+    return m_selectionAnchor != kNone;
+  }
+
+  bool isSelected(uint64_t sequence) const {
+    return hasSelection() &&
+      sequence >= std::min(m_selectionAnchor, m_selectionEnd) &&
+      sequence <= std::max(m_selectionAnchor, m_selectionEnd);
+  }
+
+  void select(uint64_t sequence, bool extend) {
+    if (!extend || !hasSelection()) {
+      m_selectionAnchor = sequence;
+    }
+    m_selectionEnd = sequence;
+  }
+
+  // Copies the selected rows that pass the filters
+  void copySelection() const {
+    std::string text;
+    auto first = std::lower_bound(m_visible.begin(), m_visible.end(), std::min(m_selectionAnchor, m_selectionEnd));
+    for (auto it = first; it != m_visible.end() && isSelected(*it); ++it) {
+      text += entryAt(*it).line;
+      text += '\n';
+    }
+    ImGui::SetClipboardText(text.c_str());
+  }
+
+  static constexpr uint64_t kNone = UINT64_MAX;
+
+  std::deque<Entry> m_entries;
+  std::vector<uint64_t> m_visible; // sequences of the entries that pass the filters, ascending
+  uint64_t m_next = 0;
+  uint64_t m_missed = 0;
+
+  LogLevel m_minLevel = LogLevel::Debug;
+  uint64_t m_jobId = 0;
+  std::string m_search;
+  std::string m_searchLower;
+  bool m_follow = true;
+
+  uint64_t m_selectionAnchor = kNone;
+  uint64_t m_selectionEnd = kNone;
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a file, one window at a time. Resident memory is
+// bounded by the window size whatever the file size, and data goes from the
+// page cache straight into cURL's buffer without a stdio or heap copy.
+// Only for files nobody truncates while they are mapped, such as the saver's
+// own local copies: a page past a new end of file raises SIGBUS on access.
+class MappedFile
+{
+public:
+  // A multiple of 2 MB so windows can be backed by huge pages
+  static constexpr size_t kWindowSize = 64 * 1024 * 1024;
+  static constexpr uint64_t kWindowAlign = 2 * 1024 * 1024;
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    close();
+  }
+
+  bool open(const std::filesystem::path& path) {
+    close();
+#ifdef _WIN32
+    m_file = CreateFileW(path.wstring().c_str(), GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                         nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)) {
+      close();
+      return false;
+    }
+    m_size = static_cast<uint64_t>(size.QuadPart);
+    if (m_size > 0) {
+      m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (!m_mapping) {
+        close();
+        return false;
+      }
+    }
+#else
+    m_fd = ::open(path.c_str(), O_RDONLY);
+    if (m_fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(m_fd, &info) != 0) {
+      close();
+      return false;
+    }
+    m_size = static_cast<uint64_t>(info.st_size);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+    return true;
+  }
+
+  void close() {
+    unmapWindow();
+#ifdef _WIN32
+    if (m_mapping) {
+      CloseHandle(m_mapping);
+      m_mapping = nullptr;
+    }
+    if (m_file != INVALID_HANDLE_VALUE) {
+      CloseHandle(m_file);
+      m_file = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (m_fd >= 0) {
+      ::close(m_fd);
+      m_fd = -1;
+    }
+#endif
+    m_size = 0;
+  }
+
+  bool isOpen() const {
+#ifdef _WIN32
+    return m_file != INVALID_HANDLE_VALUE;
+#else
+    return m_fd >= 0;
+#endif
+  }
+
+  uint64_t size() const {
+    return m_size;
+  }
+
+  // Returns up to maxBytes at offset without copying, valid until the next call.
+  // length is 0 at the end of the file or if the window cannot be mapped.
+  const char* slice(uint64_t offset, size_t maxBytes, size_t& length) {
+    length = 0;
+    if (offset >= m_size || maxBytes == 0) {
+      return nullptr;
+    }
+    if (!m_view || offset < m_viewOffset || offset >= m_viewOffset + m_viewSize) {
+      if (!mapWindow(offset)) {
+        return nullptr;
+      }
+    }
+    uint64_t inView = offset - m_viewOffset;
+    length = static_cast<size_t>(std::min<uint64_t>(maxBytes, m_viewSize - inView));
+    return m_view + inView;
+  }
+
+  // Copies up to size bytes at offset into out, the one copy a cURL read callback needs
+  size_t read(uint64_t offset, char* out, size_t size) {
+    size_t copied = 0;
+    while (copied < size) {
+      size_t length = 0;
+      const char* data = slice(offset + copied, size - copied, length);
+      if (length == 0) {
+        break;
+      }
+      memcpy(out + copied, data, length);
+      copied += length;
+    }
+    return copied;
+  }
+
+private:
+  bool mapWindow(uint64_t offset) {
+    unmapWindow();
+    uint64_t start = offset - offset % kWindowAlign;
+    size_t length = static_cast<size_t>(std::min<uint64_t>(kWindowSize, m_size - start));
+#ifdef _WIN32
+    void* view = MapViewOfFile(m_mapping, FILE_MAP_READ,
+                               static_cast<DWORD>(start >> 32), static_cast<DWORD>(start & 0xFFFFFFFF),
+                               length);
+    if (!view) {
+      return false;
+    }
+#else
+    void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, m_fd, static_cast<off_t>(start));
+    if (view == MAP_FAILED) {
+      return false;
+    }
+    madvise(view, length, MADV_SEQUENTIAL);
+    madvise(view, length, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    // Only taken where the kernel supports huge pages for file mappings, harmless elsewhere
+    madvise(view, length, MADV_HUGEPAGE);
+#endif
+#endif
+    m_view = static_cast<const char*>(view);
+    m_viewOffset = start;
+    m_viewSize = length;
+    return true;
+  }
+
+  void unmapWindow() {
+    if (!m_view) {
+      return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(m_view);
+#else
+    munmap(const_cast<char*>(m_view), m_viewSize);
+#endif
+    m_view = nullptr;
+    m_viewOffset = 0;
+    m_viewSize = 0;
+  }
+
+#ifdef _WIN32
+  HANDLE m_file = INVALID_HANDLE_VALUE;
+  HANDLE m_mapping = nullptr;
+#else
+  int m_fd = -1;
+#endif
+  uint64_t m_size = 0;
+  const char* m_view = nullptr;
+  uint64_t m_viewOffset = 0;
+  size_t m_viewSize = 0;
+};
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET MetricsSocket;
+static const MetricsSocket kNoMetricsSocket = INVALID_SOCKET;
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int MetricsSocket;
+static const MetricsSocket kNoMetricsSocket = -1;
+#endif
+
+#ifdef MSG_NOSIGNAL
+// A scraper that hangs up early must not raise SIGPIPE in the daemon
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+// Serves GET /metrics on 127.0.0.1 for a Prometheus scraper on the same host.
+// Bound to the loopback address only, so it never exposes anything to the
+// network; put a reverse proxy in front of it to scrape from elsewhere.
+// One request at a time on its own thread, which is plenty for a scraper.
+class MetricsServer
+{
+public:
+  MetricsServer() = default;
+  MetricsServer(const MetricsServer&) = delete;
+  MetricsServer& operator=(const MetricsServer&) = delete;
+
+  ~MetricsServer() {
+    stop();
+  }
+
+  // render is called on the server thread for every scrape
+  bool start(uint16_t port, std::function<std::string()> render, std::string& error) {
+    stop();
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+      error = "WSAStartup failed";
+      return false;
+    }
+    m_wsa = true;
+#endif
+    m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (m_socket == kNoMetricsSocket) {
+      error = "Cannot create the metrics socket";
+      stop();
+      return false;
+    }
+    int reuse = 1;
+    setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(m_socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(m_socket, 8) != 0) {
+      error = "Cannot listen on 127.0.0.1:" + std::to_string(port);
+      stop();
+      return false;
+    }
+
+    m_render = std::move(render);
+    m_stopping = false;
+    m_thread = std::thread(&MetricsServer::run, this);
+    return true;
+  }
+
+  void stop() {
+    m_stopping = true;
+    if (m_thread.joinable()) {
+      m_thread.join();
+    }
+    closeSocket(m_socket);
+#ifdef _WIN32
+    if (m_wsa) {
+      WSACleanup();
+      m_wsa = false;
+    }
+#endif
+  }
+
+private:
+  void run() {
+    while (!m_stopping) {
+      // Polls so stop() is noticed within a fraction of a second
+#ifdef _WIN32
+      WSAPOLLFD waiting = { m_socket, POLLRDNORM, 0 };
+      if (WSAPoll(&waiting, 1, 200) <= 0) {
+        continue;
+      }
+#else
+      pollfd waiting = { m_socket, POLLIN, 0 };
+      if (poll(&waiting, 1, 200) <= 0) {
+        continue;
+      }
+#endif
+      MetricsSocket client = accept(m_socket, nullptr, nullptr);
+      if (client == kNoMetricsSocket) {
+        continue;
+      }
+      serve(client);
+      closeSocket(client);
+    }
+  }
+
+  void serve(MetricsSocket client) {
+#ifdef _WIN32
+    DWORD timeout = 2000;
+#else
+    timeval timeout = { 2, 0 };
+#endif
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+
+    // Only the request line matters; headers are read up to the blank line and ignored
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+      int got = static_cast<int>(recv(client, buffer, sizeof(buffer), 0));
+      if (got <= 0) {
+        return;
+      }
+      request.append(buffer, got);
+    }
+
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0) {
+      body = m_render();
+    }
+    else if (request.compare(0, 4, "GET ") == 0) {
+      status = "404 Not Found";
+      body = "Only /metrics is served here\n";
+    }
+    else {
+      status = "405 Method Not Allowed";
+    }
+
+    std::string response = "HTTP/1.1 " + status + "\r\n"
+      "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+      "Content-Length: " + std::to_string(body.size()) + "\r\n"
+      "Connection: close\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size()) {
+      int wrote = static_cast<int>(send(client, response.data() + sent, static_cast<int>(response.size() - sent), kSendFlags));
+      if (wrote <= 0) {
+        return;
+      }
+      sent += static_cast<size_t>(wrote);
+    }
+  }
+
+  static void closeSocket(MetricsSocket& handle) {
+    if (handle == kNoMetricsSocket) {
+      return;
+    }
+#ifdef _WIN32
+    closesocket(handle);
+#else
+    close(handle);
+#endif
+    handle = kNoMetricsSocket;
+  }
+
+  MetricsSocket m_socket = kNoMetricsSocket;
+  std::function<std::string()> m_render;
+  std::atomic<bool> m_stopping{ false };
+  std::thread m_thread;
+#ifdef _WIN32
+  bool m_wsa = false;
+#endif
+};
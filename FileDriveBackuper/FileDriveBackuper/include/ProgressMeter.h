@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Bytes done towards a total. Writers only add to relaxed atomics, so cURL
+// progress callbacks and copy loops can feed it without locks or allocations.
+struct ProgressCounter {
+  std::atomic<uint64_t> done{ 0 };
+  std::atomic<uint64_t> total{ 0 };
+
+  void start(uint64_t bytes) {
+    done.store(0, std::memory_order_relaxed);
+    total.store(bytes, std::memory_order_relaxed);
+  }
+
+  void add(uint64_t bytes) {
+    done.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  bool active() const {
+    uint64_t all = total.load(std::memory_order_relaxed);
+    return all > 0 && done.load(std::memory_order_relaxed) < all;
+  }
+
+  double fraction() const {
+    uint64_t all = total.load(std::memory_order_relaxed);
+    if (all == 0) {
+      return 0.0;
+    }
+    return std::min(1.0, static_cast<double>(done.load(std::memory_order_relaxed)) / static_cast<double>(all));
+  }
+};
+
+inline int64_t steadyMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Turns a growing byte count into a rate, an ETA and a sparkline. It belongs
+// to the thread that reads the count (the UI, the daemon loop), which calls
+// sample() whenever it likes; the writers never see it. The rate is an EWMA
+// over intervalMs buckets, and every elapsed bucket adds one point to a fixed
+// ring of raw rates for the sparkline.
+class RateMeter
+{
+public:
+  static constexpr int kHistory = 120;
+  int64_t intervalMs = 500;
+  double smoothing = 0.3; // weight of the newest bucket
+
+  void sample(uint64_t count, int64_t nowMs = steadyMs()) {
+    if (m_lastMs == 0 || count < m_lastCount) {
+      m_lastMs = nowMs;
+      m_lastCount = count;
+      return;
+    }
+    int64_t elapsed = nowMs - m_lastMs;
+    if (elapsed < intervalMs) {
+      return;
+    }
+    // A long gap counts as several buckets at its average rate, so the EWMA
+    // decays and the sparkline keeps its time scale
+    double rate = (count - m_lastCount) * 1000.0 / elapsed;
+    int64_t buckets = std::min<int64_t>(elapsed / intervalMs, kHistory);
+    for (int64_t i = 0; i < buckets; ++i) {
+      m_rate = m_primed ? (1.0 - smoothing) * m_rate + smoothing * rate : rate;
+      m_primed = true;
+      m_history[m_next] = static_cast<float>(rate);
+      m_next = (m_next + 1) % kHistory;
+    }
+    m_lastMs = nowMs;
+    m_lastCount = count;
+  }
+
+  // Bytes per second
+  double rate() const {
+    return m_rate;
+  }
+
+  // Seconds to move remaining bytes at the current rate, negative when unknown
+  double etaSeconds(uint64_t remaining) const {
+    if (remaining == 0) {
+      return 0.0;
+    }
+    return m_rate > 1.0 ? remaining / m_rate : -1.0;
+  }
+
+  // The ring for ImGui::PlotLines(label, history(), kHistory, historyOffset()),
+  // oldest point at historyOffset(); points not sampled yet are 0
+  const float* history() const {
+    return m_history.data();
+  }
+
+  int historyOffset() const {
+    return m_next;
+  }
+
+  float historyMax() const {
+    return std::max(1.0f, *std::max_element(m_history.begin(), m_history.end()));
+  }
+
+private:
+  std::array<float, kHistory> m_history{};
+  int m_next = 0;
+  int64_t m_lastMs = 0;
+  uint64_t m_lastCount = 0;
+  double m_rate = 0.0;
+  bool m_primed = false;
+};
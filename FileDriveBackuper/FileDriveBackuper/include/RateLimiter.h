@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A time-of-day window with its limits, in bytes per second. 0 means unlimited.
+struct RateWindow {
+  int startMinute = 0; // minutes since local midnight
+  int endMinute = 24 * 60;
+  uint64_t uploadRate = 0;
+  uint64_t downloadRate = 0;
+  std::string label;
+
+  bool contains(int minute) const {
+    if (startMinute <= endMinute) {
+      return minute >= startMinute && minute < endMinute;
+    }
+    // Wraps past midnight, e.g. 18:00-09:00
+    return minute >= startMinute || minute < endMinute;
+  }
+};
+
+// Parses "2M", "512K", "0" (unlimited) into bytes per second
+inline bool parseRate(const std::string& text, uint64_t& rate) {
+  if (text.empty()) {
+    return false;
+  }
+  char* end = nullptr;
+  double value = std::strtod(text.c_str(), &end);
+  if (end == text.c_str() || value < 0.0) {
+    return false;
+  }
+  double multiplier = 1.0;
+  switch (*end) {
+  case 'k': case 'K': multiplier = 1024.0; break;
+  case 'm': case 'M': multiplier = 1024.0 * 1024.0; break;
+  case 'g': case 'G': multiplier = 1024.0 * 1024.0 * 1024.0; break;
+  case '\0': break;
+  default: return false;
+  }
+  rate = static_cast<uint64_t>(value * multiplier);
+  return true;
+}
+
+// Schedule text is a ';' separated list of windows, first match wins:
+//   "09:00-18:00 up=2M down=8M; * up=0"
+// '*' matches the whole day. Times outside every window are unlimited.
+inline bool parseSchedule(const std::string& text, std::vector<RateWindow>& windows, std::string& error) {
+  windows.clear();
+  std::stringstream entries(text);
+  std::string entry;
+  while (std::getline(entries, entry, ';')) {
+    std::stringstream tokens(entry);
+    std::string token;
+    if (!(tokens >> token)) {
+      continue;
+    }
+
+    RateWindow window;
+    window.label = token;
+    if (token != "*") {
+      int h1 = 0, m1 = 0, h2 = 0, m2 = 0;
+      // 24:00 is the end of the day, nothing later
+      if (sscanf(token.c_str(), "%d:%d-%d:%d", &h1, &m1, &h2, &m2) != 4 ||
+          h1 < 0 || h1 > 24 || h2 < 0 || h2 > 24 || m1 < 0 || m1 > 59 || m2 < 0 || m2 > 59 ||
+          (h1 == 24 && m1 != 0) || (h2 == 24 && m2 != 0)) {
+        error = "Bad time range: " + token;
+        return false;
+      }
+      window.startMinute = h1 * 60 + m1;
+      window.endMinute = h2 * 60 + m2;
+    }
+
+    while (tokens >> token) {
+      size_t equals = token.find('=');
+      std::string key = token.substr(0, equals);
+      uint64_t rate = 0;
+      if (equals == std::string::npos || !parseRate(token.substr(equals + 1), rate)) {
+        error = "Bad rate: " + token;
+        return false;
+      }
+      if (key == "up") {
+        window.uploadRate = rate;
+      }
+      else if (key == "down") {
+        window.downloadRate = rate;
+      }
+      else {
+        error = "Unknown limit: " + key;
+        return false;
+      }
+    }
+    windows.push_back(window);
+  }
+  return true;
+}
+
+// Token bucket shared by every concurrent transfer in one direction.
+// The rate can change at any time and applies to transfers already running.
+class TokenBucket
+{
+public:
+  void setRate(uint64_t bytesPerSecond) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (bytesPerSecond == m_rate) {
+      return;
+    }
+    m_rate = bytesPerSecond;
+    // A quarter second of burst keeps callbacks reasonably sized at any rate
+    m_burst = std::max<double>(16 * 1024.0, m_rate / 4.0);
+    m_tokens = std::min(m_tokens, m_burst);
+  }
+
+  uint64_t rate() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_rate;
+  }
+
+  // Blocks until at least one byte may be sent and returns how many (<= wanted).
+  // Returns wanted right away when unlimited or cancelled.
+  size_t acquire(size_t wanted, const std::atomic<bool>* cancel) {
+    while (true) {
+      double waitSeconds = 0.0;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_rate == 0 || wanted == 0) {
+          return wanted;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - m_lastRefill).count();
+        m_lastRefill = now;
+        m_tokens = std::min(m_burst, m_tokens + elapsed * m_rate);
+
+        if (m_tokens >= 1.0) {
+          size_t granted = std::min(wanted, static_cast<size_t>(m_tokens));
+          m_tokens -= granted;
+          return granted;
+        }
+        waitSeconds = (std::min<double>(wanted, m_burst) - m_tokens) / m_rate;
+      }
+
+      if (cancel && cancel->load()) {
+        return wanted;
+      }
+      // Short sleeps so a raised limit or a cancel is picked up quickly
+      std::this_thread::sleep_for(std::chrono::duration<double>(std::min(waitSeconds, 0.05)));
+    }
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  uint64_t m_rate = 0;
+  double m_burst = 16 * 1024.0;
+  double m_tokens = 0.0;
+  std::chrono::steady_clock::time_point m_lastRefill = std::chrono::steady_clock::now();
+};
+
+// Bytes moved while a schedule window was active
+struct WindowThroughput {
+  std::string label;
+  uint64_t uploadBytes = 0;
+  uint64_t downloadBytes = 0;
+  double activeSeconds = 0.0;
+};
+
+// Global upload/download shaping following a time-of-day schedule
+class RateLimiter
+{
+public:
+  bool setSchedule(const std::string& text, std::string& error) {
+    std::vector<RateWindow> windows;
+    if (!parseSchedule(text, windows, error)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_scheduleText = text;
+    m_windows = windows;
+    m_usage.assign(windows.size() + 1, WindowThroughput());
+    for (size_t i = 0; i < windows.size(); ++i) {
+      m_usage[i].label = windows[i].label;
+    }
+    m_usage.back().label = "unscheduled";
+    m_nextCheck = std::chrono::steady_clock::time_point();
+    applyScheduleLocked(std::chrono::steady_clock::now());
+    return true;
+  }
+
+  std::string scheduleText() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_scheduleText;
+  }
+
+  size_t acquireUpload(size_t wanted, const std::atomic<bool>* cancel) {
+    refresh();
+    size_t granted = m_upload.acquire(wanted, cancel);
+    record(granted, true);
+    return granted;
+  }
+
+  size_t acquireDownload(size_t wanted, const std::atomic<bool>* cancel) {
+    refresh();
+    size_t granted = m_download.acquire(wanted, cancel);
+    record(granted, false);
+    return granted;
+  }
+
+  uint64_t uploadRate() const {
+    return m_upload.rate();
+  }
+
+  uint64_t downloadRate() const {
+    return m_download.rate();
+  }
+
+  std::vector<WindowThroughput> throughput() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_usage;
+  }
+
+private:
+  // Re-evaluates the active window at most once per second
+  void refresh() {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (now >= m_nextCheck) {
+      applyScheduleLocked(now);
+    }
+  }
+
+  void applyScheduleLocked(std::chrono::steady_clock::time_point now) {
+    m_nextCheck = now + std::chrono::seconds(1);
+
+    // Called from every transfer thread, localtime's shared buffer would race
+    std::time_t time = std::time(nullptr);
+    std::tm tm = {};
+#ifdef _WIN32
+    localtime_s(&tm, &time);
+#else
+    localtime_r(&time, &tm);
+#endif
+    int minute = tm.tm_hour * 60 + tm.tm_min;
+
+    m_activeWindow = m_windows.size();
+    for (size_t i = 0; i < m_windows.size(); ++i) {
+      if (m_windows[i].contains(minute)) {
+        m_activeWindow = i;
+        break;
+      }
+    }
+
+    bool scheduled = m_activeWindow < m_windows.size();
+    m_upload.setRate(scheduled ? m_windows[m_activeWindow].uploadRate : 0);
+    m_download.setRate(scheduled ? m_windows[m_activeWindow].downloadRate : 0);
+  }
+
+  void record(size_t bytes, bool upload) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_usage.empty()) {
+      m_usage.assign(1, WindowThroughput());
+      m_usage.back().label = "unscheduled";
+      m_activeWindow = 0;
+    }
+
+    WindowThroughput& usage = m_usage[std::min(m_activeWindow, m_usage.size() - 1)];
+    (upload ? usage.uploadBytes : usage.downloadBytes) += bytes;
+
+    // Gaps longer than a second are idle time, not transfer time
+    double gap = std::chrono::duration<double>(now - m_lastRecord).count();
+    if (gap < 1.0) {
+      usage.activeSeconds += gap;
+    }
+    m_lastRecord = now;
+  }
+
+  TokenBucket m_upload;
+  TokenBucket m_download;
+
+  mutable std::mutex m_mutex;
+  std::string m_scheduleText;
+  std::vector<RateWindow> m_windows;
+  std::vector<WindowThroughput> m_usage;
+  size_t m_activeWindow = 0;
+  std::chrono::steady_clock::time_point m_nextCheck;
+  std::chrono::steady_clock::time_point m_lastRecord;
+};
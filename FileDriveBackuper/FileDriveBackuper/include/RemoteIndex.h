@@ -0,0 +1,342 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "BackblazeCredentials.h"
+
+struct RemoteFile {
+  std::string name;
+  std::string fileId;
+  std::string sha1;
+  uint64_t size = 0;
+};
+
+struct RemoteIndexStatus {
+  size_t files = 0;
+  bool complete = false;
+  int64_t listedAt = 0; // unix seconds the last full listing finished, 0 if never
+  std::string cursor;   // where an unfinished listing resumes
+};
+
+// Local mirror of the bucket's file names, by name and by content, so lookups
+// never go to the network. It is built from b2_list_file_names one page at a
+// time and kept in a journal in the state directory together with the listing
+// cursor, so an interrupted listing resumes where it stopped and a finished one
+// is not repeated on the next run:
+//   file <name> <fileId> [<sha1>] <size>   (tab separated)
+//   gone <name>
+//   cursor <startFileName>
+//   complete <time>
+//   reset
+// Every upload and copy made through it is recorded, which keeps the mirror
+// current without listing again. A full listing is repeated only once the last
+// one is older than maxAgeSeconds, to pick up changes made from elsewhere.
+class RemoteFileIndex
+{
+public:
+  // Largest source b2_copy_file accepts in one call
+  static constexpr uint64_t kMaxCopySize = 5ULL * 1000 * 1000 * 1000;
+
+  int64_t maxAgeSeconds = 7 * 24 * 3600;
+
+  void open(const std::filesystem::path& directory) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_directory = directory;
+  }
+
+  // Loads the mirror of the credentials' bucket and lists whatever a previous
+  // run did not finish. Cheap to call before every lookup once complete.
+  bool ensureLoaded(BackblazeCredentials& credentials) {
+    std::lock_guard<std::mutex> loadLock(m_loadMutex);
+    std::string cursor;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::string bucketId = credentials.getBucketId();
+      if (m_bucketId != bucketId) {
+        loadLocked(bucketId);
+      }
+      if (m_complete && static_cast<int64_t>(std::time(nullptr)) - m_listedAt < maxAgeSeconds) {
+        return true;
+      }
+      if (m_complete) {
+        // Stale, list again from the start
+        clearLocked();
+        m_journal << "reset\n";
+        m_journal.flush();
+      }
+      cursor = m_cursor;
+    }
+
+    // A page is journaled with the cursor after it, so a crash mid-page lists that page again
+    std::vector<RemoteFile> page;
+    bool listed = credentials.listFileNames("", [&page](const B2FileEntry& file) {
+      if (file.action != "upload") {
+        return;
+      }
+      RemoteFile remote;
+      remote.name = file.fileName;
+      remote.fileId = file.fileId;
+      remote.size = file.contentLength;
+      remote.sha1 = contentSha1(file);
+      page.push_back(std::move(remote));
+    }, "", cursor, [this, &page](const std::string& next) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (const auto& file : page) {
+        addLocked(file);
+        writeFile(m_journal, file);
+      }
+      page.clear();
+      m_cursor = next;
+      if (next.empty()) {
+        m_complete = true;
+        m_listedAt = static_cast<int64_t>(std::time(nullptr));
+        m_journal << "complete\t" << m_listedAt << '\n';
+      }
+      else {
+        m_journal << "cursor\t" << next << '\n';
+      }
+      m_journal.flush();
+    });
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (listed) {
+      compactLocked();
+    }
+    return listed;
+  }
+
+  bool find(const std::string& name, RemoteFile& out) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_byName.find(name);
+    if (it == m_byName.end()) {
+      return false;
+    }
+    out = it->second;
+    return true;
+  }
+
+  bool findContent(const std::string& sha1, uint64_t size, RemoteFile& out) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_byContent.find(contentKey(sha1, size));
+    if (it == m_byContent.end()) {
+      return false;
+    }
+    out = m_byName.at(it->second);
+    return true;
+  }
+
+  void record(const RemoteFile& file) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_bucketId.empty()) {
+      return;
+    }
+    addLocked(file);
+    writeFile(m_journal, file);
+    m_journal.flush();
+  }
+
+  // Drops a name the bucket turned out not to have, deleted from elsewhere
+  void forget(const std::string& name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (removeLocked(name)) {
+      m_journal << "gone\t" << name << '\n';
+      m_journal.flush();
+    }
+  }
+
+  // Makes the next ensureLoaded list the whole bucket again
+  void invalidate() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_listedAt = 0;
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_byName.size();
+  }
+
+  RemoteIndexStatus status() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    RemoteIndexStatus status;
+    status.files = m_byName.size();
+    status.complete = m_complete;
+    status.listedAt = m_listedAt;
+    status.cursor = m_cursor;
+    return status;
+  }
+
+  // contentSha1 of small files, the large_file_sha1 info of large ones. Empty if neither is known.
+  static std::string contentSha1(const B2FileEntry& file) {
+    std::string sha1 = file.contentSha1;
+    if (sha1.empty() || sha1 == "none") {
+      sha1 = file.largeFileSha1;
+    }
+    const std::string unverified = "unverified:";
+    if (sha1.compare(0, unverified.size(), unverified) == 0) {
+      sha1 = sha1.substr(unverified.size());
+    }
+    return sha1 == "none" ? "" : sha1;
+  }
+
+private:
+  static std::string contentKey(const std::string& sha1, uint64_t size) {
+    return sha1 + ":" + std::to_string(size);
+  }
+
+  static void writeFile(std::ostream& out, const RemoteFile& file) {
+    out << "file\t" << file.name << '\t' << file.fileId << '\t';
+    if (!file.sha1.empty()) {
+      out << file.sha1 << '\t';
+    }
+    out << file.size << '\n';
+  }
+
+  std::filesystem::path journalPath() const {
+    return m_directory / ("remote_" + m_bucketId + ".idx");
+  }
+
+  void clearLocked() {
+    m_byName.clear();
+    m_byContent.clear();
+    m_cursor.clear();
+    m_complete = false;
+    m_listedAt = 0;
+  }
+
+  void loadLocked(const std::string& bucketId) {
+    if (m_journal.is_open()) {
+      m_journal.close();
+    }
+    clearLocked();
+    m_bucketId = bucketId;
+
+    std::ifstream in(journalPath());
+    std::string line;
+    while (std::getline(in, line)) {
+      // A line cut off by a crash has no newline yet, and is skipped
+      if (in.eof()) {
+        break;
+      }
+      std::vector<std::string> fields;
+      std::stringstream stream(line);
+      std::string field;
+      while (std::getline(stream, field, '\t')) {
+        fields.push_back(field);
+      }
+
+      uint64_t number = 0;
+      if (fields.size() == 5 && fields[0] == "file" && isSha1(fields[3]) && parseNumber(fields[4], number)) {
+        addLocked({ fields[1], fields[2], fields[3], number });
+      }
+      else if (fields.size() == 4 && fields[0] == "file" && parseNumber(fields[3], number)) {
+        addLocked({ fields[1], fields[2], "", number });
+      }
+      else if (fields.size() == 2 && fields[0] == "gone") {
+        removeLocked(fields[1]);
+      }
+      else if (fields.size() == 2 && fields[0] == "cursor") {
+        m_cursor = fields[1];
+      }
+      else if (fields.size() == 2 && fields[0] == "complete" && parseNumber(fields[1], number)) {
+        m_complete = true;
+        m_listedAt = static_cast<int64_t>(number);
+        m_cursor.clear();
+      }
+      else if (fields.size() == 1 && fields[0] == "reset") {
+        clearLocked();
+      }
+      // Anything else is damaged and ignored, the next full listing restores it
+    }
+    in.close();
+
+    std::error_code error;
+    std::filesystem::create_directories(m_directory, error);
+    compactLocked();
+  }
+
+  // Rewrites the journal with only the current mirror and cursor, then swaps it in
+  void compactLocked() {
+    if (m_journal.is_open()) {
+      m_journal.close();
+    }
+
+    std::filesystem::path path = journalPath();
+    std::filesystem::path temporary = path;
+    temporary += ".tmp";
+    {
+      std::ofstream out(temporary, std::ios::trunc);
+      for (const auto& item : m_byName) {
+        writeFile(out, item.second);
+      }
+      if (m_complete) {
+        out << "complete\t" << m_listedAt << '\n';
+      }
+      else if (!m_cursor.empty()) {
+        out << "cursor\t" << m_cursor << '\n';
+      }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+
+    m_journal.open(path, std::ios::app);
+  }
+
+  static bool parseNumber(const std::string& text, uint64_t& value) {
+    if (text.empty() || text[0] < '0' || text[0] > '9') {
+      return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtoull(text.c_str(), &end, 10);
+    return errno == 0 && *end == '\0';
+  }
+
+  static bool isSha1(const std::string& text) {
+    return text.size() == 40 &&
+      text.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos;
+  }
+
+  void addLocked(const RemoteFile& file) {
+    removeLocked(file.name);
+    m_byName[file.name] = file;
+    if (!file.sha1.empty()) {
+      m_byContent[contentKey(file.sha1, file.size)] = file.name;
+    }
+  }
+
+  bool removeLocked(const std::string& name) {
+    auto it = m_byName.find(name);
+    if (it == m_byName.end()) {
+      return false;
+    }
+    if (!it->second.sha1.empty()) {
+      auto content = m_byContent.find(contentKey(it->second.sha1, it->second.size));
+      if (content != m_byContent.end() && content->second == name) {
+        m_byContent.erase(content);
+      }
+    }
+    m_byName.erase(it);
+    return true;
+  }
+
+  mutable std::mutex m_mutex;
+  std::mutex m_loadMutex;
+  std::filesystem::path m_directory = ".";
+  std::string m_bucketId;
+  std::ofstream m_journal;
+  std::string m_cursor;
+  bool m_complete = false;
+  int64_t m_listedAt = 0;
+  std::unordered_map<std::string, RemoteFile> m_byName;
+  std::unordered_map<std::string, std::string> m_byContent;
+};
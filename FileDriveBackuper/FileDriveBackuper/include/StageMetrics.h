@@ -0,0 +1,319 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "TraceRecorder.h"
+
+// Latency histogram in the HDR style: exact buckets below 32 us, then 16
+// linear sub-buckets per power of two, so any percentile is within about 6%
+// of the true value from 1 us to days. Recording is a few relaxed atomic adds,
+// safe from any number of threads; readers walk a copy of the counts.
+class LatencyHistogram
+{
+public:
+  static constexpr int kSubBits = 4;
+  static constexpr int kSubBuckets = 1 << kSubBits;
+  static constexpr int kLinear = 2 * kSubBuckets; // values below this have their own bucket
+  static constexpr int kBuckets = kLinear + (40 - kSubBits - 1) * kSubBuckets;
+
+  void record(uint64_t micros) {
+    m_counts[index(micros)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(micros, std::memory_order_relaxed);
+    uint64_t seen = m_max.load(std::memory_order_relaxed);
+    while (micros > seen && !m_max.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {
+    }
+  }
+
+  void record(std::chrono::steady_clock::duration elapsed) {
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    record(static_cast<uint64_t>(std::max<int64_t>(micros, 0)));
+  }
+
+  uint64_t count() const {
+    return m_count.load(std::memory_order_relaxed);
+  }
+
+  uint64_t sumMicros() const {
+    return m_sum.load(std::memory_order_relaxed);
+  }
+
+  uint64_t maxMicros() const {
+    return m_max.load(std::memory_order_relaxed);
+  }
+
+  double meanMicros() const {
+    uint64_t n = count();
+    return n ? static_cast<double>(sumMicros()) / n : 0.0;
+  }
+
+  // Highest value of the bucket holding the q-th fraction of samples, 0 when empty
+  uint64_t percentileMicros(double q) const {
+    std::array<uint64_t, kBuckets> counts;
+    uint64_t total = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      counts[i] = m_counts[i].load(std::memory_order_relaxed);
+      total += counts[i];
+    }
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * total + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(upperBound(i), maxMicros());
+      }
+    }
+    return maxMicros();
+  }
+
+private:
+  static int index(uint64_t value) {
+    if (value < static_cast<uint64_t>(kLinear)) {
+      return static_cast<int>(value);
+    }
+    int exponent = 63;
+    while (!(value >> exponent)) {
+      --exponent;
+    }
+    int shift = exponent - kSubBits;
+    int sub = static_cast<int>((value >> shift) & (kSubBuckets - 1));
+    int bucket = kLinear + (exponent - kSubBits - 1) * kSubBuckets + sub;
+    return std::min(bucket, kBuckets - 1);
+  }
+
+  static uint64_t upperBound(int bucket) {
+    if (bucket < kLinear) {
+      return static_cast<uint64_t>(bucket);
+    }
+    int exponent = (bucket - kLinear) / kSubBuckets + kSubBits + 1;
+    int sub = (bucket - kLinear) % kSubBuckets;
+    int shift = exponent - kSubBits;
+    return ((static_cast<uint64_t>(kSubBuckets + sub) + 1) << shift) - 1;
+  }
+
+  std::array<std::atomic<uint64_t>, kBuckets> m_counts{};
+  std::atomic<uint64_t> m_count{ 0 };
+  std::atomic<uint64_t> m_sum{ 0 };
+  std::atomic<uint64_t> m_max{ 0 };
+};
+
+// Where backup time goes, from a click or a timer to an object in the bucket
+enum class Stage {
+  Authenticate,
+  UploadUrl,  // b2_get_upload_url and b2_get_upload_part_url
+  LocalCopy,
+  Sha1,       // whole-file hash before an upload
+  Transfer,   // one upload request: a file, a part, a chunk or a manifest
+  Upload,     // one spooled version, every request and retry included
+  Count
+};
+
+inline const char* stageName(Stage stage) {
+  switch (stage) {
+  case Stage::Authenticate: return "authenticate";
+  case Stage::UploadUrl: return "get_upload_url";
+  case Stage::LocalCopy: return "local_copy";
+  case Stage::Sha1: return "sha1";
+  case Stage::Transfer: return "transfer";
+  case Stage::Upload: return "upload";
+  case Stage::Count: break;
+  }
+  return "";
+}
+
+constexpr int kStageCount = static_cast<int>(Stage::Count);
+
+// Stage latencies and the byte counters that explain them
+struct PipelineMetrics {
+  std::array<LatencyHistogram, kStageCount> stages;
+
+  std::atomic<uint64_t> bytesCopied{ 0 };
+  std::atomic<uint64_t> bytesHashed{ 0 };
+  // Uploads skipped because the bucket already had identical content
+  std::atomic<uint64_t> skippedIdentical{ 0 };
+  // Chunked uploads: what the versions held and what actually had to be sent
+  std::atomic<uint64_t> chunksSeen{ 0 };
+  std::atomic<uint64_t> chunksSent{ 0 };
+  std::atomic<uint64_t> chunkBytesSeen{ 0 };
+  std::atomic<uint64_t> chunkBytesSent{ 0 };
+  // Stage spans of sampled cycles also go to this timeline when it is set
+  Tracer* tracer = nullptr;
+
+  LatencyHistogram& stage(Stage which) {
+    return stages[static_cast<int>(which)];
+  }
+
+  const LatencyHistogram& stage(Stage which) const {
+    return stages[static_cast<int>(which)];
+  }
+
+  // Share of chunk bytes that did not need sending, 0 before any chunked upload
+  double dedupRatio() const {
+    uint64_t seen = chunkBytesSeen.load(std::memory_order_relaxed);
+    return seen ? 1.0 - static_cast<double>(chunkBytesSent.load(std::memory_order_relaxed)) / seen : 0.0;
+  }
+};
+
+// Records the time from construction to destruction in one stage, and as a
+// trace span when the thread works on a sampled cycle. A null metrics pointer
+// makes it a no-op, so optional instrumentation stays one line.
+class StageTimer
+{
+public:
+  StageTimer(PipelineMetrics* metrics, Stage stage)
+    : m_metrics(metrics), m_stage(stage), m_start(std::chrono::steady_clock::now()) {}
+
+  ~StageTimer() {
+    if (!m_metrics) {
+      return;
+    }
+    auto end = std::chrono::steady_clock::now();
+    m_metrics->stage(m_stage).record(end - m_start);
+    if (m_metrics->tracer) {
+      m_metrics->tracer->complete(stageName(m_stage), m_start, end, m_bytes);
+    }
+  }
+
+  // Bytes the stage handled, shown on its trace span
+  void setBytes(uint64_t bytes) {
+    m_bytes = bytes;
+  }
+
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+  PipelineMetrics* m_metrics;
+  Stage m_stage;
+  std::chrono::steady_clock::time_point m_start;
+  uint64_t m_bytes = 0;
+};
+
+// Prometheus text exposition. Samples are grouped by metric name, so several
+// savers can add the same metrics with their own labels and the HELP and TYPE
+// lines still appear once.
+class MetricsText
+{
+public:
+  void counter(const std::string& name, const std::string& help, const std::string& labels, double value) {
+    family(name, help, "counter").push_back(name + braces(labels) + " " + number(value));
+  }
+
+  void gauge(const std::string& name, const std::string& help, const std::string& labels, double value) {
+    family(name, help, "gauge").push_back(name + braces(labels) + " " + number(value));
+  }
+
+  // A summary in seconds with the quantiles worth tuning against
+  void summary(const std::string& name, const std::string& help, const std::string& labels,
+               const LatencyHistogram& histogram) {
+    std::vector<std::string>& lines = family(name, help, "summary");
+    for (double q : { 0.5, 0.9, 0.99 }) {
+      lines.push_back(name + braces(join(labels, "quantile=\"" + number(q) + "\"")) + " " +
+                      number(histogram.percentileMicros(q) / 1e6));
+    }
+    lines.push_back(name + "_sum" + braces(labels) + " " + number(histogram.sumMicros() / 1e6));
+    lines.push_back(name + "_count" + braces(labels) + " " + number(static_cast<double>(histogram.count())));
+  }
+
+  std::string str() const {
+    std::string text;
+    for (const auto& item : m_families) {
+      text += "# HELP " + item.name + " " + item.help + "\n";
+      text += "# TYPE " + item.name + " " + item.type + "\n";
+      for (const auto& line : item.lines) {
+        text += line + "\n";
+      }
+    }
+    return text;
+  }
+
+  // Replaces file in one rename, as the node exporter textfile collector expects
+  bool writeFile(const std::filesystem::path& file, std::string& error) const {
+    std::filesystem::path temporary = file;
+    temporary += ".tmp";
+    {
+      std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+      out << str();
+      if (!out) {
+        error = "Cannot write " + temporary.string();
+        return false;
+      }
+    }
+    std::error_code renameError;
+    std::filesystem::rename(temporary, file, renameError);
+    if (renameError) {
+      error = "Cannot replace " + file.string() + ": " + renameError.message();
+      return false;
+    }
+    return true;
+  }
+
+  static std::string join(const std::string& labels, const std::string& more) {
+    return labels.empty() ? more : labels + "," + more;
+  }
+
+  // A label pair with the value escaped as the format requires
+  static std::string label(const std::string& name, const std::string& value) {
+    std::string escaped;
+    for (char c : value) {
+      if (c == '\\' || c == '"') {
+        escaped += '\\';
+        escaped += c;
+      }
+      else if (c == '\n') {
+        escaped += "\\n";
+      }
+      else {
+        escaped += c;
+      }
+    }
+    return name + "=\"" + escaped + "\"";
+  }
+
+private:
+  struct Family {
+    std::string name;
+    std::string help;
+    std::string type;
+    std::vector<std::string> lines;
+  };
+
+  std::vector<std::string>& family(const std::string& name, const std::string& help, const char* type) {
+    for (auto& item : m_families) {
+      if (item.name == name) {
+        return item.lines;
+      }
+    }
+    m_families.push_back({ name, help, type, {} });
+    return m_families.back().lines;
+  }
+
+  static std::string braces(const std::string& labels) {
+    return labels.empty() ? "" : "{" + labels + "}";
+  }
+
+  static std::string number(double value) {
+    char text[32];
+    if (value == static_cast<double>(static_cast<int64_t>(value))) {
+      snprintf(text, sizeof(text), "%lld", static_cast<long long>(value));
+    }
+    else {
+      snprintf(text, sizeof(text), "%.9g", value);
+    }
+    return text;
+  }
+
+  std::vector<Family> m_families;
+};
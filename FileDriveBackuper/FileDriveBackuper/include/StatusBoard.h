@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// A value any thread can publish and any thread can read without locks.
+// Publishers take the sequence from even to odd with a CAS, which also orders
+// them, write the value and make the sequence even again. Readers copy the
+// value and keep the copy only if the sequence was even and unchanged around
+// it; they never block a publisher and only retry while one is mid-write.
+// The value is stored as atomic words so the racing copy is well defined.
+template <typename T>
+class Seqlock
+{
+  static_assert(std::is_trivially_copyable<T>::value, "Seqlock values are copied word by word");
+
+public:
+  Seqlock() {
+    store(T());
+  }
+
+  Seqlock(const Seqlock&) = delete;
+  Seqlock& operator=(const Seqlock&) = delete;
+
+  T load() const {
+    uint64_t words[kWords];
+    for (;;) {
+      uint64_t before = m_sequence.load(std::memory_order_acquire);
+      if ((before & 1) == 0) {
+        for (size_t i = 0; i < kWords; ++i) {
+          words[i] = m_words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) == before) {
+          break;
+        }
+      }
+    }
+    T value;
+    memcpy(&value, words, sizeof(T));
+    return value;
+  }
+
+  // Applies change to the current value and publishes the result
+  template <typename Change>
+  void update(Change&& change) {
+    uint64_t sequence = lockWriter();
+    uint64_t words[kWords];
+    for (size_t i = 0; i < kWords; ++i) {
+      words[i] = m_words[i].load(std::memory_order_relaxed);
+    }
+    T value;
+    memcpy(&value, words, sizeof(T));
+    change(value);
+    publish(value, sequence);
+  }
+
+  void store(const T& value) {
+    publish(value, lockWriter());
+  }
+
+  // Number of publishes so far, readers can skip work when it has not moved
+  uint64_t version() const {
+    return m_sequence.load(std::memory_order_acquire) / 2;
+  }
+
+private:
+  static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  uint64_t lockWriter() {
+    uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+    for (;;) {
+      if ((sequence & 1) == 0 &&
+          m_sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire)) {
+        return sequence;
+      }
+      sequence = m_sequence.load(std::memory_order_relaxed);
+    }
+  }
+
+  void publish(const T& value, uint64_t sequence) {
+    uint64_t words[kWords] = {};
+    memcpy(words, &value, sizeof(T));
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; ++i) {
+      m_words[i].store(words[i], std::memory_order_relaxed);
+    }
+    m_sequence.store(sequence + 2, std::memory_order_release);
+  }
+
+  std::atomic<uint64_t> m_sequence{ 0 };
+  std::atomic<uint64_t> m_words[kWords];
+};
+
+enum class BackupPhase {
+  Stopped,
+  Waiting,   // for the next capture
+  Capturing, // taking the local copy
+  Uploading,
+  Offline    // uploads wait for the network or valid credentials
+};
+
+inline const char* backupPhaseName(BackupPhase phase) {
+  switch (phase) {
+  case BackupPhase::Stopped: return "Stopped";
+  case BackupPhase::Waiting: return "Waiting";
+  case BackupPhase::Capturing: return "Capturing";
+  case BackupPhase::Uploading: return "Uploading";
+  case BackupPhase::Offline: return "Offline";
+  }
+  return "";
+}
+
+enum class BackupResult {
+  None,
+  Succeeded,
+  Failed
+};
+
+// What a FileSaver is doing, published by its threads on every change and
+// read whole by the UI, the daemon and anything else that reports on it
+struct BackupStatus {
+  bool saving = false;
+  bool savingOnlyLocal = false;
+  bool filePathSet = false;
+  bool authenticated = false;
+  BackupPhase phase = BackupPhase::Stopped;
+  uint32_t uploadsInFlight = 0;
+  uint64_t spoolPending = 0;
+
+  uint64_t captures = 0;
+  uint64_t uploads = 0;
+  uint64_t failures = 0;
+  BackupResult lastResult = BackupResult::None;
+  int64_t lastResultAt = 0;        // unix seconds
+  int64_t nextCaptureAt = 0;       // unix seconds, 0 when not scheduled
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "UiWake.h"
+
+enum class TaskState {
+  Queued,
+  Running,
+  Succeeded,
+  Failed
+};
+
+// One piece of work handed off by the UI. The worker writes message and
+// anything the work captured before it publishes the final state, so once
+// finished() is true they can be read without a lock.
+class AsyncTask
+{
+public:
+  explicit AsyncTask(std::string label) : label(std::move(label)) {}
+
+  const std::string label;
+
+  TaskState state() const {
+    return m_state.load(std::memory_order_acquire);
+  }
+
+  bool finished() const {
+    TaskState current = state();
+    return current == TaskState::Succeeded || current == TaskState::Failed;
+  }
+
+  bool succeeded() const {
+    return state() == TaskState::Succeeded;
+  }
+
+  // Result text of a finished task, e.g. why it failed
+  const std::string& message() const {
+    return m_message;
+  }
+
+  // Seconds since it was queued, or how long it took once finished
+  double seconds() const {
+    auto end = finished() ? m_finishedAt : std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - m_queuedAt).count();
+  }
+
+private:
+  friend class TaskQueue;
+
+  std::function<bool(std::string&)> m_work;
+  std::atomic<TaskState> m_state{ TaskState::Queued };
+  std::string m_message;
+  std::chrono::steady_clock::time_point m_queuedAt = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point m_finishedAt;
+};
+
+typedef std::shared_ptr<const AsyncTask> TaskHandle;
+
+inline bool taskBusy(const TaskHandle& task) {
+  return task && !task->finished();
+}
+
+// Runs blocking work (network, disk) for the UI thread on a few worker
+// threads. submit() returns at once with a handle the UI polls each frame;
+// the UI is woken when a task finishes. Submitting a label that is still
+// queued or running returns the task already there, so a double click does
+// not authenticate twice.
+class TaskQueue
+{
+public:
+  static constexpr size_t kKeepFinished = 32;
+
+  explicit TaskQueue(UiWake* wake = nullptr, int workers = 2) : m_wake(wake) {
+    for (int i = 0; i < std::max(workers, 1); ++i) {
+      m_workers.emplace_back(&TaskQueue::run, this);
+    }
+  }
+
+  ~TaskQueue() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_wakeWorkers.notify_all();
+    for (auto& worker : m_workers) {
+      worker.join();
+    }
+  }
+
+  TaskQueue(const TaskQueue&) = delete;
+  TaskQueue& operator=(const TaskQueue&) = delete;
+
+  // work returns whether it succeeded and may leave a message for the UI
+  TaskHandle submit(const std::string& label, std::function<bool(std::string& message)> work) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& task : m_tasks) {
+      if (task->label == label && !task->finished()) {
+        return task;
+      }
+    }
+    auto task = std::make_shared<AsyncTask>(label);
+    task->m_work = std::move(work);
+    m_queue.push_back(task);
+    m_tasks.push_back(task);
+    trimLocked();
+    m_wakeWorkers.notify_one();
+    return task;
+  }
+
+  // Recent tasks, oldest first
+  std::vector<TaskHandle> recent() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return std::vector<TaskHandle>(m_tasks.begin(), m_tasks.end());
+  }
+
+  size_t pending() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t count = 0;
+    for (const auto& task : m_tasks) {
+      count += task->finished() ? 0 : 1;
+    }
+    return count;
+  }
+
+private:
+  void run() {
+    for (;;) {
+      std::shared_ptr<AsyncTask> task;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wakeWorkers.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+        if (m_stopping) {
+          return;
+        }
+        task = m_queue.front();
+        m_queue.pop_front();
+      }
+
+      task->m_state.store(TaskState::Running, std::memory_order_release);
+      notify();
+      bool ok = false;
+      try {
+        ok = task->m_work(task->m_message);
+      }
+      catch (const std::exception& e) {
+        task->m_message = e.what();
+      }
+      task->m_work = nullptr;
+      task->m_finishedAt = std::chrono::steady_clock::now();
+      task->m_state.store(ok ? TaskState::Succeeded : TaskState::Failed, std::memory_order_release);
+      notify();
+    }
+  }
+
+  void notify() {
+    if (m_wake) {
+      m_wake->notify();
+    }
+  }
+
+  // Finished tasks beyond kKeepFinished are forgotten, oldest first
+  void trimLocked() {
+    size_t finished = 0;
+    for (const auto& task : m_tasks) {
+      finished += task->finished() ? 1 : 0;
+    }
+    for (auto it = m_tasks.begin(); it != m_tasks.end() && finished > kKeepFinished;) {
+      if ((*it)->finished()) {
+        it = m_tasks.erase(it);
+        --finished;
+      }
+      else {
+        ++it;
+      }
+    }
+  }
+
+  UiWake* m_wake;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_wakeWorkers;
+  std::deque<std::shared_ptr<AsyncTask>> m_queue;
+  std::deque<std::shared_ptr<AsyncTask>> m_tasks;
+  std::vector<std::thread> m_workers;
+  bool m_stopping = false;
+};
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// One finished span. Names point at string literals, so recording copies no text.
+struct TraceEvent {
+  const char* name = "";
+  int64_t startUs = 0;
+  int64_t durationUs = 0;
+  uint64_t cycle = 0;
+  uint64_t bytes = 0;
+};
+
+// Events of one thread on their way to the file. The owning thread is the
+// only producer and the tracer's writer thread the only consumer, so a full
+// ring drops the event instead of waiting.
+struct TraceBuffer {
+  static constexpr size_t kEvents = 1024;
+
+  std::array<TraceEvent, kEvents> events;
+  std::atomic<uint64_t> head{ 0 };
+  std::atomic<uint64_t> tail{ 0 };
+  std::atomic<bool> closed{ false }; // the thread has exited
+  uint32_t threadId = 0;
+
+  bool push(const TraceEvent& event) {
+    uint64_t at = head.load(std::memory_order_relaxed);
+    if (at - tail.load(std::memory_order_acquire) >= kEvents) {
+      return false;
+    }
+    events[at % kEvents] = event;
+    head.store(at + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// What a thread knows about tracing: the cycle it works on (0 when that
+// cycle is not sampled) and its buffer in each tracer it has written to
+struct TraceThreadState {
+  uint64_t cycle = 0;
+  uint32_t threadId = 0;
+  std::vector<std::pair<uint64_t, std::shared_ptr<TraceBuffer>>> buffers;
+
+  ~TraceThreadState() {
+    for (auto& item : buffers) {
+      item.second->closed.store(true, std::memory_order_release);
+    }
+  }
+};
+
+inline TraceThreadState& traceThread() {
+  static std::atomic<uint32_t> nextThreadId{ 1 };
+  thread_local TraceThreadState state;
+  if (state.threadId == 0) {
+    state.threadId = nextThreadId.fetch_add(1, std::memory_order_relaxed);
+  }
+  return state;
+}
+
+// Optional timeline of backup cycles in the Chrome trace-event format, which
+// chrome://tracing and ui.perfetto.dev open as is. Only every sampleEvery-th
+// cycle is recorded. Spans go into per-thread rings without locks or
+// allocations and a background thread writes them out twice a second, so it
+// can stay on in production. A thread takes the tracer's mutex once, the first
+// time it records. Files rotate at maxFileBytes and the newest kKeepFiles stay.
+class Tracer
+{
+public:
+  static constexpr size_t kKeepFiles = 8;
+  std::atomic<uint32_t> sampleEvery{ 1 };
+  uint64_t maxFileBytes = 64ULL * 1024 * 1024;
+  // Shown as the process name, e.g. the daemon job
+  std::string label = "filesaver";
+
+  Tracer() : m_id(nextTracerId()) {}
+
+  ~Tracer() {
+    stop();
+  }
+
+  Tracer(const Tracer&) = delete;
+  Tracer& operator=(const Tracer&) = delete;
+
+  // Starts a new trace file in directory
+  bool start(const std::filesystem::path& directory, std::string& error) {
+    std::lock_guard<std::mutex> control(m_controlMutex);
+    if (m_running) {
+      return true;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    m_directory = directory;
+    {
+      // Leftovers from an earlier session do not belong in this file
+      std::lock_guard<std::mutex> lock(m_mutex);
+      for (auto& buffer : m_buffers) {
+        buffer->tail.store(buffer->head.load(std::memory_order_acquire), std::memory_order_release);
+      }
+      if (!openFile()) {
+        error = "Cannot create a trace file in " + directory.string();
+        return false;
+      }
+    }
+    m_stopping = false;
+    m_running.store(true, std::memory_order_release);
+    m_writer = std::thread(&Tracer::writeLoop, this);
+    return true;
+  }
+
+  // Writes what is buffered and closes the file
+  void stop() {
+    std::lock_guard<std::mutex> control(m_controlMutex);
+    if (!m_running) {
+      return;
+    }
+    m_running.store(false, std::memory_order_release);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_wake.notify_all();
+    m_writer.join();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    drainLocked();
+    closeFile();
+  }
+
+  bool running() const {
+    return m_running.load(std::memory_order_acquire);
+  }
+
+  bool sampled(uint64_t cycle) const {
+    uint32_t every = std::max<uint32_t>(1, sampleEvery.load(std::memory_order_relaxed));
+    return running() && cycle % every == 0;
+  }
+
+  // Records a finished span if the calling thread works on a sampled cycle
+  void complete(const char* name,
+                std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end,
+                uint64_t bytes = 0) {
+    if (!running()) {
+      return;
+    }
+    TraceThreadState& thread = traceThread();
+    if (thread.cycle == 0) {
+      return;
+    }
+    TraceEvent event;
+    event.name = name;
+    event.startUs = micros(start);
+    event.durationUs = std::max<int64_t>(0, micros(end) - event.startUs);
+    event.cycle = thread.cycle;
+    event.bytes = bytes;
+    if (!bufferFor(thread).push(event)) {
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t written() const {
+    return m_written.load(std::memory_order_relaxed);
+  }
+
+  uint64_t dropped() const {
+    return m_dropped.load(std::memory_order_relaxed);
+  }
+
+  std::filesystem::path currentFile() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_path;
+  }
+
+  // The cycle of the calling thread, to hand to the threads it starts
+  static uint64_t currentCycle() {
+    return traceThread().cycle;
+  }
+
+  // Marks the calling thread as working on a cycle for its lifetime, and records
+  // the whole cycle as one span named name. Cycles that are not sampled cost a
+  // thread-local write.
+  class Cycle
+  {
+  public:
+    Cycle(Tracer* tracer, const char* name, uint64_t id, uint64_t bytes = 0)
+      : m_tracer(tracer), m_name(name), m_bytes(bytes), m_previous(traceThread().cycle),
+        m_start(std::chrono::steady_clock::now()) {
+      // Cycle ids start at 1 so 0 can mean "not traced"
+      traceThread().cycle = tracer && tracer->sampled(id) ? id + 1 : 0;
+    }
+
+    ~Cycle() {
+      if (m_tracer) {
+        m_tracer->complete(m_name, m_start, std::chrono::steady_clock::now(), m_bytes);
+      }
+      traceThread().cycle = m_previous;
+    }
+
+    Cycle(const Cycle&) = delete;
+    Cycle& operator=(const Cycle&) = delete;
+
+  private:
+    Tracer* m_tracer;
+    const char* m_name;
+    uint64_t m_bytes;
+    uint64_t m_previous;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+  // Continues a cycle from currentCycle() on a helper thread
+  class Adopt
+  {
+  public:
+    explicit Adopt(uint64_t cycle) : m_previous(traceThread().cycle) {
+      traceThread().cycle = cycle;
+    }
+
+    ~Adopt() {
+      traceThread().cycle = m_previous;
+    }
+
+    Adopt(const Adopt&) = delete;
+    Adopt& operator=(const Adopt&) = delete;
+
+  private:
+    uint64_t m_previous;
+  };
+
+private:
+  static uint64_t nextTracerId() {
+    static std::atomic<uint64_t> next{ 1 };
+    return next.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static int64_t micros(std::chrono::steady_clock::time_point at) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(at.time_since_epoch()).count();
+  }
+
+  TraceBuffer& bufferFor(TraceThreadState& thread) {
+    for (auto& item : thread.buffers) {
+      if (item.first == m_id) {
+        return *item.second;
+      }
+    }
+    auto buffer = std::make_shared<TraceBuffer>();
+    buffer->threadId = thread.threadId;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_buffers.push_back(buffer);
+    }
+    thread.buffers.emplace_back(m_id, buffer);
+    return *buffer;
+  }
+
+  void writeLoop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping) {
+      m_wake.wait_for(lock, std::chrono::milliseconds(500), [this] { return m_stopping; });
+      drainLocked();
+    }
+  }
+
+  // Writes out every ring and forgets the ones whose thread is gone
+  void drainLocked() {
+    char line[256];
+    for (auto it = m_buffers.begin(); it != m_buffers.end();) {
+      TraceBuffer& buffer = **it;
+      bool closed = buffer.closed.load(std::memory_order_acquire);
+      uint64_t head = buffer.head.load(std::memory_order_acquire);
+      for (uint64_t at = buffer.tail.load(std::memory_order_relaxed); at < head; ++at) {
+        const TraceEvent& event = buffer.events[at % TraceBuffer::kEvents];
+        int length = snprintf(line, sizeof(line),
+                              ",\n{\"name\":\"%s\",\"cat\":\"backup\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                              "\"ts\":%lld,\"dur\":%lld,\"args\":{\"cycle\":%llu,\"bytes\":%llu}}",
+                              event.name, buffer.threadId,
+                              static_cast<long long>(event.startUs), static_cast<long long>(event.durationUs),
+                              static_cast<unsigned long long>(event.cycle - 1),
+                              static_cast<unsigned long long>(event.bytes));
+        write(line, std::min<size_t>(static_cast<size_t>(std::max(length, 0)), sizeof(line) - 1));
+        m_written.fetch_add(1, std::memory_order_relaxed);
+      }
+      buffer.tail.store(head, std::memory_order_release);
+      it = closed ? m_buffers.erase(it) : std::next(it);
+    }
+    m_file.flush();
+    if (m_fileBytes > maxFileBytes) {
+      closeFile();
+      openFile();
+    }
+  }
+
+  void write(const char* data, size_t length) {
+    m_file.write(data, static_cast<std::streamsize>(length));
+    m_fileBytes += length;
+  }
+
+  bool openFile() {
+    char stamp[32];
+    char name[64];
+    std::time_t now = std::time(nullptr);
+    std::tm tm = {};
+#ifdef _WIN32
+    localtime_s(&tm, &now);
+#else
+    localtime_r(&now, &tm);
+#endif
+    std::strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tm);
+    snprintf(name, sizeof(name), "trace_%s_%04llu.json", stamp, static_cast<unsigned long long>(++m_fileCount));
+    m_path = m_directory / name;
+    m_file.open(m_path, std::ios::binary | std::ios::trunc);
+    if (!m_file) {
+      return false;
+    }
+    // The array format lets every event start with a comma after this first one
+    std::string header = "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"" + label + "\"}}";
+    m_fileBytes = 0;
+    write(header.data(), header.size());
+    pruneFiles();
+    return true;
+  }
+
+  void closeFile() {
+    if (m_file.is_open()) {
+      write("\n]\n", 3);
+      m_file.close();
+    }
+  }
+
+  void pruneFiles() {
+    std::vector<std::filesystem::path> traces;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(m_directory, ec)) {
+      std::string name = entry.path().filename().string();
+      if (name.compare(0, 6, "trace_") == 0 && entry.path().extension() == ".json") {
+        traces.push_back(entry.path());
+      }
+    }
+    if (traces.size() <= kKeepFiles) {
+      return;
+    }
+    // Names start with the time they were opened, so they sort oldest first
+    std::sort(traces.begin(), traces.end());
+    for (size_t i = 0; i + kKeepFiles < traces.size(); ++i) {
+      std::filesystem::remove(traces[i], ec);
+    }
+  }
+
+  const uint64_t m_id;
+  std::mutex m_controlMutex;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::vector<std::shared_ptr<TraceBuffer>> m_buffers;
+  std::thread m_writer;
+  std::atomic<bool> m_running{ false };
+  bool m_stopping = false;
+
+  std::filesystem::path m_directory;
+  std::filesystem::path m_path;
+  std::ofstream m_file;
+  uint64_t m_fileBytes = 0;
+  uint64_t m_fileCount = 0;
+  std::atomic<uint64_t> m_written{ 0 };
+  std::atomic<uint64_t> m_dropped{ 0 };
+};
@@ -0,0 +1,667 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+#include <openssl/sha.h>
+#include <rapidjson/document.h>
+
+#include "BackblazeCredentials.h"
+#include "MappedFile.h"
+#include "TransferWatchdog.h"
+
+// What the concurrency controller is currently doing, for display
+struct TransferDecision {
+  int concurrency = 0;
+  uint64_t partSize = 0;
+  double goodput = 0.0;       // bytes/s, all streams
+  double streamGoodput = 0.0; // bytes/s, per stream (EWMA)
+  double rttMs = 0.0;
+  std::string reason;
+};
+
+// AIMD controller for multi-part uploads. Concurrency grows by one stream per
+// round while aggregate goodput keeps improving and is halved on 503/429 or
+// timeouts. Part size follows the measured per-part duration, inside B2 limits.
+class AimdController
+{
+public:
+  // B2 large file limits
+  static constexpr uint64_t kMinPartSize = 5ULL * 1024 * 1024;
+  static constexpr uint64_t kMaxPartSize = 5ULL * 1024 * 1024 * 1024;
+  static constexpr int kMaxParts = 10000;
+
+  int minConcurrency = 1;
+  int maxConcurrency = 16;
+  double targetPartSeconds = 15.0;
+
+  int concurrency() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_concurrency;
+  }
+
+  // Part size for the next part, never lets the file run past kMaxParts
+  uint64_t nextPartSize(uint64_t remaining, int partNumber) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t partsLeft = static_cast<uint64_t>(std::max(1, kMaxParts - partNumber + 1));
+    uint64_t size = std::max(m_partSize, (remaining + partsLeft - 1) / partsLeft);
+    size = std::min(std::max(size, kMinPartSize), kMaxPartSize);
+    // Never leave a trailing part below the minimum
+    if (remaining <= size || remaining - size < kMinPartSize) {
+      return remaining;
+    }
+    return size;
+  }
+
+  void onPartComplete(uint64_t bytes, double seconds, double rttSeconds) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (m_roundParts == 0 && m_roundBytes == 0) {
+      m_roundStart = now - std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(seconds));
+    }
+
+    m_roundBytes += bytes;
+    ++m_roundParts;
+
+    if (seconds > 0.0) {
+      double streamRate = bytes / seconds;
+      m_streamGoodput = m_streamGoodput == 0.0 ? streamRate : 0.8 * m_streamGoodput + 0.2 * streamRate;
+      m_partSeconds = m_partSeconds == 0.0 ? seconds : 0.8 * m_partSeconds + 0.2 * seconds;
+    }
+    if (rttSeconds > 0.0) {
+      m_minRtt = m_minRtt == 0.0 ? rttSeconds : std::min(m_minRtt, rttSeconds);
+      m_srtt = m_srtt == 0.0 ? rttSeconds : 0.875 * m_srtt + 0.125 * rttSeconds;
+    }
+
+    if (m_roundParts < m_concurrency) {
+      return;
+    }
+    endRound(now);
+  }
+
+  // throttled is true for 503 service_unavailable / 429 and for stalled streams
+  void onPartError(bool throttled) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!throttled) {
+      return;
+    }
+    m_concurrency = std::max(minConcurrency, m_concurrency / 2);
+    m_bestGoodput *= 0.5;
+    m_roundBytes = 0;
+    m_roundParts = 0;
+    m_holdRounds = 0;
+    m_reason = "backed off after throttling";
+  }
+
+  TransferDecision snapshot() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    TransferDecision decision;
+    decision.concurrency = m_concurrency;
+    decision.partSize = m_partSize;
+    decision.goodput = m_goodput;
+    decision.streamGoodput = m_streamGoodput;
+    decision.rttMs = m_srtt * 1000.0;
+    decision.reason = m_reason;
+    return decision;
+  }
+
+private:
+  void endRound(std::chrono::steady_clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - m_roundStart).count();
+    m_goodput = elapsed > 0.0 ? m_roundBytes / elapsed : 0.0;
+    bool queueing = m_minRtt > 0.0 && m_srtt > 2.0 * m_minRtt;
+
+    if (m_goodput > m_bestGoodput * 1.05 && !queueing) {
+      m_bestGoodput = m_goodput;
+      if (m_concurrency < maxConcurrency) {
+        ++m_concurrency;
+        m_reason = "goodput improving, added a stream";
+      }
+      else {
+        m_reason = "at stream limit";
+      }
+      m_holdRounds = 0;
+    }
+    else if (queueing && m_concurrency > minConcurrency) {
+      --m_concurrency;
+      m_reason = "RTT inflated, removed a stream";
+    }
+    else if (++m_holdRounds >= 8 && m_concurrency < maxConcurrency) {
+      // Probe again from time to time, the link may have freed up
+      ++m_concurrency;
+      m_holdRounds = 0;
+      m_reason = "probing for more bandwidth";
+    }
+    else {
+      m_reason = "goodput flat, holding";
+    }
+
+    if (m_partSeconds > 0.0 && m_partSeconds < targetPartSeconds / 3.0) {
+      m_partSize = std::min(m_partSize * 2, kMaxPartSize);
+    }
+    else if (m_partSeconds > targetPartSeconds * 3.0) {
+      m_partSize = std::max(m_partSize / 2, kMinPartSize);
+    }
+
+    m_roundBytes = 0;
+    m_roundParts = 0;
+    m_roundStart = now;
+  }
+
+  mutable std::mutex m_mutex;
+  int m_concurrency = 2;
+  uint64_t m_partSize = 16ULL * 1024 * 1024;
+
+  std::chrono::steady_clock::time_point m_roundStart = std::chrono::steady_clock::now();
+  uint64_t m_roundBytes = 0;
+  int m_roundParts = 0;
+  int m_holdRounds = 0;
+
+  double m_goodput = 0.0;
+  double m_bestGoodput = 0.0;
+  double m_streamGoodput = 0.0;
+  double m_partSeconds = 0.0;
+  double m_minRtt = 0.0;
+  double m_srtt = 0.0;
+  std::string m_reason = "starting";
+};
+
+// Recent part durations per part-size class (powers of two), used to decide
+// when a part is slow enough to be worth hedging.
+class PartLatencyTracker
+{
+public:
+  static constexpr size_t kSamplesPerClass = 128;
+
+  void record(uint64_t partSize, double seconds) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& samples = m_samples[sizeClass(partSize)];
+    if (samples.size() >= kSamplesPerClass) {
+      samples.pop_front();
+    }
+    samples.push_back(seconds);
+  }
+
+  // Returns 0 while there are fewer than minSamples for this size class
+  double percentile(uint64_t partSize, double fraction, size_t minSamples) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_samples.find(sizeClass(partSize));
+    if (it == m_samples.end() || it->second.size() < minSamples) {
+      return 0.0;
+    }
+    std::vector<double> sorted(it->second.begin(), it->second.end());
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index];
+  }
+
+private:
+  static int sizeClass(uint64_t size) {
+    int bits = 0;
+    while (size > 1) {
+      size >>= 1;
+      ++bits;
+    }
+    return bits;
+  }
+
+  mutable std::mutex m_mutex;
+  std::map<int, std::deque<double>> m_samples;
+};
+
+// Optional duplicate uploads of slow parts. A part running past the p95 of its
+// size class gets a second attempt on another upload URL; the first one to
+// finish wins and the other is aborted. Extra bytes are capped by budgetFraction.
+struct HedgePolicy {
+  std::atomic<bool> enabled{ false };
+  double percentile = 0.95;
+  double budgetFraction = 0.05;
+  size_t minSamples = 8;
+
+  PartLatencyTracker latencies;
+  std::atomic<uint64_t> hedgesLaunched{ 0 };
+  std::atomic<uint64_t> hedgesWon{ 0 };
+  std::atomic<uint64_t> hedgedBytes{ 0 };
+};
+
+// Multi-part upload of one file through b2_start_large_file / b2_upload_part.
+// Every worker owns its upload part URL and cURL handle, the controller decides
+// how many of them run at once and how big the next part is.
+class LargeFileUploader
+{
+public:
+  LargeFileUploader(BackblazeCredentials& credentials, AimdController& controller)
+    : m_credentials(credentials), m_controller(controller) {}
+
+  int maxAttemptsPerPart = 5;
+  HedgePolicy* hedgePolicy = nullptr;
+  TransferJob* job = nullptr;
+  std::string fileSha1; // optional, stored as large_file_sha1
+  std::string uploadedFileId; // set once upload() succeeded
+
+  bool upload(const std::filesystem::path& localPath, const std::string& remoteFileName, std::string& error) {
+    std::error_code ec;
+    uint64_t fileSize = std::filesystem::file_size(localPath, ec);
+    if (ec) {
+      error = "Cannot read size of " + localPath.string();
+      return false;
+    }
+
+    std::string fileId = m_credentials.startLargeFile(remoteFileName, "application/octet-stream", fileSha1);
+    if (fileId.empty()) {
+      error = "b2_start_large_file failed";
+      return false;
+    }
+
+    State state;
+    state.fileId = fileId;
+    state.path = localPath;
+    state.fileSize = fileSize;
+    state.traceCycle = Tracer::currentCycle();
+    if (hedgePolicy) {
+      state.hedgeBudget = static_cast<uint64_t>(fileSize * hedgePolicy->budgetFraction);
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<std::thread> hedges;
+    {
+      std::unique_lock<std::mutex> lock(state.mutex);
+      while (true) {
+        // One worker per stream the controller allows, started as it raises
+        // concurrency; workers left over after it lowers it just wait
+        while (!state.failed && state.hasWork() &&
+               static_cast<int>(workers.size()) < m_controller.concurrency()) {
+          ++state.workersRunning;
+          workers.emplace_back(&LargeFileUploader::worker, this, std::ref(state));
+        }
+        if (state.workersRunning == 0) {
+          break;
+        }
+        state.cv.wait_for(lock, std::chrono::milliseconds(100));
+        if (hedgePolicy && hedgePolicy->enabled && !state.failed) {
+          launchHedges(state, hedges);
+        }
+      }
+    }
+
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    for (auto& hedge : hedges) {
+      hedge.join();
+    }
+
+    if (state.failed) {
+      m_credentials.cancelLargeFile(fileId);
+      error = state.error;
+      return false;
+    }
+
+    // Every part from 1 up must be there, or B2 would finish a truncated object
+    std::vector<std::string> partSha1Array;
+    for (const auto& part : state.partSha1s) {
+      if (part.first != static_cast<int>(partSha1Array.size()) + 1) {
+        break;
+      }
+      partSha1Array.push_back(part.second);
+    }
+    if (state.nextOffset != fileSize ||
+        partSha1Array.size() != static_cast<size_t>(state.nextPartNumber - 1) ||
+        state.partSha1s.size() != partSha1Array.size()) {
+      m_credentials.cancelLargeFile(fileId);
+      error = "Upload of " + remoteFileName + " ended with parts missing";
+      return false;
+    }
+
+    if (!m_credentials.finishLargeFile(fileId, partSha1Array)) {
+      m_credentials.cancelLargeFile(fileId);
+      error = "b2_finish_large_file failed";
+      return false;
+    }
+    uploadedFileId = fileId;
+    return true;
+  }
+
+private:
+  struct Part {
+    int number = 0;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    int attempts = 0;
+  };
+
+  // Attempts of one part that are running right now (the primary and maybe a hedge)
+  struct InFlight {
+    Part part;
+    std::chrono::steady_clock::time_point start;
+    std::shared_ptr<std::atomic<bool>> done;
+    int running = 0;
+    bool hedged = false;
+  };
+
+  struct State {
+    std::string fileId;
+    std::filesystem::path path;
+    uint64_t fileSize = 0;
+    uint64_t traceCycle = 0; // the uploading thread's, continued by workers and hedges
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t nextOffset = 0;
+    int nextPartNumber = 1;
+    std::deque<Part> retries;
+    std::map<int, std::string> partSha1s;
+    std::map<int, InFlight> inFlight;
+    int active = 0;
+    int workersRunning = 0;
+    uint64_t hedgeBudget = 0;
+    uint64_t hedgeSpent = 0;
+    bool failed = false;
+    std::string error;
+
+    bool hasWork() const {
+      return !retries.empty() || nextOffset < fileSize;
+    }
+  };
+
+  // Streams a byte range of the file and appends its SHA1 as 40 hex digits, so
+  // parts are hashed in the same pass that sends them ("hex_digits_at_end").
+  struct PartSource {
+    MappedFile* file = nullptr;
+    uint64_t offset = 0;
+    RateLimiter* limiter = nullptr;
+    const std::atomic<bool>* cancel = nullptr;
+    uint64_t remaining = 0;
+    SHA_CTX context;
+    std::string trailer;
+    size_t trailerSent = 0;
+  };
+
+  static size_t partReadCallback(char* ptr, size_t size, size_t nmemb, PartSource* source) {
+    size_t capacity = size * nmemb;
+    if (source->remaining > 0) {
+      size_t toRead = static_cast<size_t>(std::min<uint64_t>(capacity, source->remaining));
+      if (source->limiter) {
+        toRead = source->limiter->acquireUpload(toRead, source->cancel);
+      }
+      size_t got = source->file->read(source->offset, ptr, toRead);
+      if (got == 0) {
+        return CURL_READFUNC_ABORT;
+      }
+      SHA1_Update(&source->context, ptr, got);
+      source->offset += got;
+      source->remaining -= got;
+      return got;
+    }
+
+    if (source->trailer.empty()) {
+      unsigned char hash[SHA_DIGEST_LENGTH];
+      SHA1_Final(hash, &source->context);
+      std::stringstream ss;
+      for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
+        ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+      }
+      source->trailer = ss.str();
+    }
+
+    size_t toCopy = std::min(capacity, source->trailer.size() - source->trailerSent);
+    memcpy(ptr, source->trailer.data() + source->trailerSent, toCopy);
+    source->trailerSent += toCopy;
+    return toCopy;
+  }
+
+  // A worker only quits once no attempt of any part is running: a hedge that
+  // outlives its failed primary may still put the part back in retries
+  bool takePart(State& state, Part& part, std::shared_ptr<std::atomic<bool>>& done) {
+    std::unique_lock<std::mutex> lock(state.mutex);
+    state.cv.wait(lock, [&] {
+      return state.failed ||
+        (!state.hasWork() && state.inFlight.empty()) ||
+        (state.hasWork() && state.active < m_controller.concurrency());
+    });
+
+    if (state.failed || (!state.hasWork() && state.inFlight.empty())) {
+      return false;
+    }
+
+    if (!state.retries.empty()) {
+      part = state.retries.front();
+      state.retries.pop_front();
+    }
+    else {
+      part = Part();
+      part.number = state.nextPartNumber++;
+      part.offset = state.nextOffset;
+      part.size = m_controller.nextPartSize(state.fileSize - state.nextOffset, part.number);
+      state.nextOffset += part.size;
+    }
+    ++state.active;
+
+    InFlight& flight = state.inFlight[part.number];
+    flight.part = part;
+    flight.start = std::chrono::steady_clock::now();
+    flight.done = std::make_shared<std::atomic<bool>>(false);
+    flight.running = 1;
+    flight.hedged = false;
+    done = flight.done;
+    return true;
+  }
+
+  // Called with state.mutex held
+  void launchHedges(State& state, std::vector<std::thread>& hedges) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto& entry : state.inFlight) {
+      InFlight& flight = entry.second;
+      if (flight.hedged || flight.done->load() || state.hedgeSpent + flight.part.size > state.hedgeBudget) {
+        continue;
+      }
+
+      double threshold = hedgePolicy->latencies.percentile(flight.part.size,
+                                                           hedgePolicy->percentile,
+                                                           hedgePolicy->minSamples);
+      double elapsed = std::chrono::duration<double>(now - flight.start).count();
+      if (threshold <= 0.0 || elapsed <= threshold) {
+        continue;
+      }
+
+      flight.hedged = true;
+      ++flight.running;
+      state.hedgeSpent += flight.part.size;
+      hedgePolicy->hedgesLaunched++;
+      hedgePolicy->hedgedBytes += flight.part.size;
+      hedges.emplace_back(&LargeFileUploader::hedge, this, std::ref(state), flight.part, flight.done);
+    }
+  }
+
+  // Records the outcome of one attempt, requeues the part once every attempt of it failed
+  void finishAttempt(State& state, Part& part, bool ok, bool isHedge, const std::string& sha1,
+                     TransferError error, bool& dropUploadUrl) {
+    auto it = state.inFlight.find(part.number);
+    InFlight& flight = it->second;
+    --flight.running;
+    dropUploadUrl = false;
+
+    if (ok && !flight.done->exchange(true)) {
+      state.partSha1s[part.number] = sha1;
+      if (isHedge) {
+        hedgePolicy->hedgesWon++;
+      }
+    }
+    else if (!ok && !flight.done->load()) {
+      // B2 asks for a fresh upload URL after any failure
+      dropUploadUrl = true;
+      m_controller.onPartError(error == TransferError::Throttled ||
+                               error == TransferError::Stalled ||
+                               error == TransferError::ConnectTimeout ||
+                               error == TransferError::Network);
+
+      if (flight.running == 0) {
+        if (!isRetryable(error) || ++part.attempts >= maxAttemptsPerPart) {
+          state.failed = true;
+          state.error = "Part " + std::to_string(part.number) + " failed: " + transferErrorName(error);
+          // The file is cancelled anyway, abort the other parts and their hedges
+          // instead of waiting for them to finish
+          for (auto& other : state.inFlight) {
+            other.second.done->store(true);
+          }
+        }
+        else {
+          if (m_credentials.stats) {
+            m_credentials.stats->retries++;
+          }
+          state.retries.push_back(part);
+        }
+      }
+    }
+
+    if (flight.running == 0) {
+      state.inFlight.erase(it);
+    }
+    state.cv.notify_all();
+  }
+
+  void worker(State& state) {
+    Tracer::Adopt traceCycle(state.traceCycle);
+    CURL* curl = curl_easy_init();
+    MappedFile file;
+    file.open(state.path);
+    UploadAuthorization partAuth;
+
+    Part part;
+    std::shared_ptr<std::atomic<bool>> done;
+    while (takePart(state, part, done)) {
+      if (part.attempts > 0) {
+        m_credentials.retryPolicy.backoff(part.attempts - 1, m_credentials.cancel);
+      }
+      if (partAuth.uploadUrl.empty()) {
+        partAuth = m_credentials.getUploadPartUrl(state.fileId);
+      }
+
+      std::string sha1;
+      TransferError error = TransferError::Network;
+      bool ok = !partAuth.uploadUrl.empty() && curl && file.isOpen() &&
+        uploadPart(curl, file, partAuth, part, *done, sha1, error);
+
+      std::lock_guard<std::mutex> lock(state.mutex);
+      --state.active;
+      bool dropUploadUrl = false;
+      finishAttempt(state, part, ok, false, sha1, error, dropUploadUrl);
+      if (dropUploadUrl) {
+        partAuth = UploadAuthorization();
+      }
+    }
+
+    if (curl) {
+      curl_easy_cleanup(curl);
+    }
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    --state.workersRunning;
+    state.cv.notify_all();
+  }
+
+  void hedge(State& state, Part part, std::shared_ptr<std::atomic<bool>> done) {
+    Tracer::Adopt traceCycle(state.traceCycle);
+    CURL* curl = curl_easy_init();
+    MappedFile file;
+    file.open(state.path);
+    // A different upload URL usually lands on a different pod
+    UploadAuthorization partAuth = m_credentials.getUploadPartUrl(state.fileId);
+
+    std::string sha1;
+    TransferError error = TransferError::Network;
+    bool ok = !partAuth.uploadUrl.empty() && curl && file.isOpen() &&
+      uploadPart(curl, file, partAuth, part, *done, sha1, error);
+
+    if (curl) {
+      curl_easy_cleanup(curl);
+    }
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    bool dropUploadUrl = false;
+    finishAttempt(state, part, ok, true, sha1, error, dropUploadUrl);
+  }
+
+  bool uploadPart(CURL* curl, MappedFile& file, const UploadAuthorization& partAuth,
+                  const Part& part, std::atomic<bool>& done, std::string& sha1, TransferError& error) {
+    StageTimer timer(m_credentials.metrics, Stage::Transfer);
+    timer.setBytes(part.size);
+    PartSource source;
+    source.file = &file;
+    source.offset = part.offset;
+    source.limiter = m_credentials.rateLimiter;
+    source.cancel = m_credentials.cancel;
+    source.remaining = part.size;
+    SHA1_Init(&source.context);
+
+    curl_easy_reset(curl);
+    struct curl_slist* headers = nullptr;
+    headers = curl_slist_append(headers, ("Authorization: " + partAuth.authorizationToken).c_str());
+    headers = curl_slist_append(headers, ("X-Bz-Part-Number: " + std::to_string(part.number)).c_str());
+    headers = curl_slist_append(headers, "X-Bz-Content-Sha1: hex_digits_at_end");
+
+    std::string response;
+    curl_easy_setopt(curl, CURLOPT_URL, partAuth.uploadUrl.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)(part.size + SHA_DIGEST_LENGTH * 2));
+    curl_easy_setopt(curl, CURLOPT_READDATA, &source);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, partReadCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, BackblazeCredentials::writeCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+
+    // The guard also aborts this attempt once the other attempt of the part has won
+    TransferGuard guard(m_credentials.timeouts, m_credentials.cancel, &done, job);
+    guard.attach(curl);
+
+    auto start = std::chrono::steady_clock::now();
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    long httpCode = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+
+    error = guard.classify(res, httpCode);
+    if (error == TransferError::None && httpCode != 200) {
+      error = TransferError::ServerError;
+    }
+    if (!done.load()) {
+      TransferGuard::count(error, m_credentials.stats);
+    }
+    if (error != TransferError::None) {
+      return false;
+    }
+
+    curl_off_t totalUs = 0;
+    curl_off_t connectUs = 0;
+    curl_off_t lookupUs = 0;
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &totalUs);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connectUs);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &lookupUs);
+    // The TCP handshake is one round trip; reused connections report no connect time
+    double rtt = connectUs > lookupUs ? (connectUs - lookupUs) / 1e6 : 0.0;
+    m_controller.onPartComplete(part.size, totalUs / 1e6, rtt);
+    if (hedgePolicy) {
+      hedgePolicy->latencies.record(part.size, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    sha1 = source.trailer;
+    return true;
+  }
+
+  BackblazeCredentials& m_credentials;
+  AimdController& m_controller;
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <curl/curl.h>
+
+// Deadlines applied to every request. 0 disables a limit.
+struct TransferTimeouts {
+  long connectTimeoutMs = 15000;
+  // No byte moved in either direction for this long counts as a stall. Covers
+  // the wait for the first response byte after the body has been sent.
+  long firstByteTimeoutMs = 60000;
+  long lowSpeedBytesPerSecond = 1024;
+  long lowSpeedWindowSeconds = 60;
+  long totalTimeoutMs = 0;
+};
+
+enum class TransferError {
+  None,
+  ConnectTimeout,
+  Stalled,
+  Throttled,   // 429 / 503
+  ServerError, // other 5xx, 408
+  AuthExpired, // 401, needs a new token or upload URL
+  ClientError, // other 4xx, retrying will not help
+  Network,
+  Cancelled
+};
+
+inline const char* transferErrorName(TransferError error) {
+  switch (error) {
+  case TransferError::None: return "none";
+  case TransferError::ConnectTimeout: return "connect timeout";
+  case TransferError::Stalled: return "stalled";
+  case TransferError::Throttled: return "throttled";
+  case TransferError::ServerError: return "server error";
+  case TransferError::AuthExpired: return "auth expired";
+  case TransferError::ClientError: return "client error";
+  case TransferError::Network: return "network error";
+  case TransferError::Cancelled: return "cancelled";
+  }
+  return "unknown";
+}
+
+inline bool isRetryable(TransferError error) {
+  return error == TransferError::ConnectTimeout ||
+    error == TransferError::Stalled ||
+    error == TransferError::Throttled ||
+    error == TransferError::ServerError ||
+    error == TransferError::AuthExpired ||
+    error == TransferError::Network;
+}
+
+inline TransferError classifyHttpStatus(long httpCode) {
+  if (httpCode == 429 || httpCode == 503) {
+    return TransferError::Throttled;
+  }
+  if (httpCode == 401) {
+    return TransferError::AuthExpired;
+  }
+  if (httpCode == 408 || httpCode >= 500) {
+    return TransferError::ServerError;
+  }
+  if (httpCode >= 400) {
+    return TransferError::ClientError;
+  }
+  return TransferError::None;
+}
+
+// Counters for bad network paths, shared by every transfer
+struct TransferStats {
+  std::atomic<uint64_t> stalls{ 0 };
+  std::atomic<uint64_t> connectTimeouts{ 0 };
+  std::atomic<uint64_t> retries{ 0 };
+  std::atomic<uint64_t> cancelled{ 0 };
+};
+
+// One queued upload as seen by its owner: a cancel flag for just this upload
+// and the bytes it has hashed and sent so far, summed over every request it makes.
+struct TransferJob {
+  std::atomic<bool> cancel{ false };
+  std::atomic<uint64_t> sentBytes{ 0 };
+  std::atomic<uint64_t> hashedBytes{ 0 };
+  uint64_t totalBytes = 0;
+  std::function<void(uint64_t)> onProgress; // bytes sent since the last call
+
+  // Retries send bytes again, so this is an estimate capped at 1
+  double fraction() const {
+    if (totalBytes == 0) {
+      return 0.0;
+    }
+    return std::min(1.0, static_cast<double>(sentBytes.load()) / static_cast<double>(totalBytes));
+  }
+};
+
+// Per-request watchdog. attach() installs the cURL deadlines plus a progress
+// callback that aborts the transfer when it stops moving or when one of the
+// cancel flags is raised (user stop, a hedge that already won, a superseded job).
+class TransferGuard
+{
+public:
+  TransferGuard(const TransferTimeouts& timeouts,
+                const std::atomic<bool>* cancel = nullptr,
+                const std::atomic<bool>* cancelOther = nullptr,
+                TransferJob* job = nullptr)
+    : m_timeouts(timeouts), m_cancel(cancel), m_cancelOther(cancelOther), m_job(job) {}
+
+  void attach(CURL* curl) {
+    m_lastProgress = std::chrono::steady_clock::now();
+    m_lastUpload = 0;
+    m_lastDownload = 0;
+    m_stalled = false;
+    m_cancelled = false;
+
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, m_timeouts.connectTimeoutMs);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, m_timeouts.totalTimeoutMs);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, m_timeouts.lowSpeedBytesPerSecond);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, m_timeouts.lowSpeedWindowSeconds);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progressCallback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, this);
+  }
+
+  TransferError classify(CURLcode res, long httpCode) const {
+    if (m_cancelled || res == CURLE_ABORTED_BY_CALLBACK) {
+      return m_stalled ? TransferError::Stalled : TransferError::Cancelled;
+    }
+    if (res == CURLE_OPERATION_TIMEDOUT) {
+      // Fires for both the connect deadline and the low speed window
+      return httpCode == 0 && m_lastUpload == 0 && m_lastDownload == 0 ?
+        TransferError::ConnectTimeout : TransferError::Stalled;
+    }
+    if (res != CURLE_OK) {
+      return TransferError::Network;
+    }
+    return classifyHttpStatus(httpCode);
+  }
+
+  // Bumps the shared counters for an error returned by classify()
+  static void count(TransferError error, TransferStats* stats) {
+    if (!stats) {
+      return;
+    }
+    if (error == TransferError::Stalled) {
+      stats->stalls++;
+    }
+    else if (error == TransferError::ConnectTimeout) {
+      stats->connectTimeouts++;
+    }
+    else if (error == TransferError::Cancelled) {
+      stats->cancelled++;
+    }
+  }
+
+private:
+  static int progressCallback(void* clientp, curl_off_t, curl_off_t dlnow, curl_off_t, curl_off_t ulnow) {
+    TransferGuard* guard = static_cast<TransferGuard*>(clientp);
+    if ((guard->m_cancel && guard->m_cancel->load()) ||
+        (guard->m_cancelOther && guard->m_cancelOther->load()) ||
+        (guard->m_job && guard->m_job->cancel.load())) {
+      guard->m_cancelled = true;
+      return 1;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (ulnow != guard->m_lastUpload || dlnow != guard->m_lastDownload) {
+      if (guard->m_job && ulnow > guard->m_lastUpload) {
+        guard->m_job->sentBytes.fetch_add(static_cast<uint64_t>(ulnow - guard->m_lastUpload), std::memory_order_relaxed);
+        if (guard->m_job->onProgress) {
+          guard->m_job->onProgress(static_cast<uint64_t>(ulnow - guard->m_lastUpload));
+        }
+      }
+      guard->m_lastUpload = ulnow;
+      guard->m_lastDownload = dlnow;
+      guard->m_lastProgress = now;
+      return 0;
+    }
+
+    if (guard->m_timeouts.firstByteTimeoutMs > 0 &&
+        now - guard->m_lastProgress > std::chrono::milliseconds(guard->m_timeouts.firstByteTimeoutMs)) {
+      guard->m_stalled = true;
+      guard->m_cancelled = true;
+      return 1;
+    }
+    return 0;
+  }
+
+  const TransferTimeouts& m_timeouts;
+  const std::atomic<bool>* m_cancel;
+  const std::atomic<bool>* m_cancelOther;
+  TransferJob* m_job;
+
+  std::chrono::steady_clock::time_point m_lastProgress;
+  curl_off_t m_lastUpload = 0;
+  curl_off_t m_lastDownload = 0;
+  bool m_stalled = false;
+  bool m_cancelled = false;
+};
+
+// Exponential backoff with full jitter
+struct RetryPolicy {
+  int maxAttempts = 5;
+  long baseDelayMs = 500;
+  long maxDelayMs = 30000;
+
+  long delayMs(int attempt) const {
+    long ceiling = baseDelayMs << std::min(attempt, 16);
+    if (ceiling > maxDelayMs || ceiling <= 0) {
+      ceiling = maxDelayMs;
+    }
+    thread_local std::mt19937 rng(std::random_device{}());
+    return std::uniform_int_distribution<long>(0, ceiling)(rng);
+  }
+
+  // Sleeps for the backoff of this attempt. Returns false if cancelled meanwhile.
+  bool backoff(int attempt, const std::atomic<bool>* cancel) const {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs(attempt));
+    while (std::chrono::steady_clock::now() < deadline) {
+      if (cancel && cancel->load()) {
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return !(cancel && cancel->load());
+  }
+};
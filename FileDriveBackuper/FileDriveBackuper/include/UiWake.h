@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// Lets worker threads wake a UI thread that sleeps until something changes.
+// Notifications coalesce: after the first one the handler is not called again
+// until the UI thread has consumed it, so a burst of log lines costs one
+// wakeup. Progress is noisier still and wakes at most every progressIntervalMs.
+class UiWake
+{
+public:
+  int64_t progressIntervalMs = 250;
+
+  // Called from a worker thread, so it must be thread safe, e.g. SDL_PushEvent
+  void setHandler(std::function<void()> handler) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_handler = std::move(handler);
+  }
+
+  void notify() {
+    if (m_pending.exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_handler) {
+      m_handler();
+    }
+  }
+
+  void notifyProgress() {
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t last = m_lastProgress.load(std::memory_order_relaxed);
+    if (now - last < progressIntervalMs ||
+        !m_lastProgress.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+      return;
+    }
+    notify();
+  }
+
+  // The UI thread calls this before it reads state for a frame; changes made after it wake it again
+  void consume() {
+    m_pending.store(false, std::memory_order_release);
+  }
+
+private:
+  std::mutex m_mutex;
+  std::function<void()> m_handler;
+  std::atomic<bool> m_pending{ false };
+  std::atomic<int64_t> m_lastProgress{ 0 };
+};
+
+// Wakeups, frames and CPU of the UI thread, averaged over the last full second
+class UiLoadMeter
+{
+public:
+  double wakeupsPerSecond = 0.0;
+  double framesPerSecond = 0.0;
+  double cpuPercent = 0.0;
+
+  void wakeup() {
+    ++m_wakeups;
+  }
+
+  void frame() {
+    ++m_frames;
+  }
+
+  // cpuNs is the thread's CPU time so far, threadCpuNs()
+  void update(uint64_t cpuNs) {
+    auto now = std::chrono::steady_clock::now();
+    if (m_windowStart == std::chrono::steady_clock::time_point()) {
+      m_windowStart = now;
+      m_windowCpuNs = cpuNs;
+      return;
+    }
+    double seconds = std::chrono::duration<double>(now - m_windowStart).count();
+    if (seconds < 1.0) {
+      return;
+    }
+    wakeupsPerSecond = m_wakeups / seconds;
+    framesPerSecond = m_frames / seconds;
+    cpuPercent = (cpuNs - m_windowCpuNs) / 1e9 / seconds * 100.0;
+    m_wakeups = 0;
+    m_frames = 0;
+    m_windowStart = now;
+    m_windowCpuNs = cpuNs;
+  }
+
+private:
+  uint64_t m_wakeups = 0;
+  uint64_t m_frames = 0;
+  uint64_t m_windowCpuNs = 0;
+  std::chrono::steady_clock::time_point m_windowStart;
+};
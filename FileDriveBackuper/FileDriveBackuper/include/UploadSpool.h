@@ -0,0 +1,491 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "JournalFile.h"
+#include "TransferWatchdog.h"
+
+enum class SpoolKind {
+  File,
+  Chunked,
+  Directory,
+  Tail // new bytes of a growing file, needs every earlier entry of its source
+};
+
+enum class SpoolDrainPolicy {
+  OldestFirst, // every captured version is uploaded, in capture order
+  LatestOnly   // a new version of a source replaces its pending one and cancels its upload
+};
+
+// A captured version waiting for upload. It points at the local backup copy,
+// the spool never holds file content itself.
+struct SpoolEntry {
+  uint64_t id = 0;
+  SpoolKind kind = SpoolKind::File;
+  int64_t enqueuedAt = 0; // unix seconds
+  uint64_t bytes = 0;
+  std::string localPath;
+  std::string sourcePath;
+  std::string remoteName;
+};
+
+struct SpoolStatus {
+  size_t pending = 0;
+  uint64_t pendingBytes = 0;
+  int64_t oldestEnqueuedAt = 0;
+  uint64_t uploaded = 0;
+  uint64_t superseded = 0;
+  uint64_t missing = 0;
+  uint64_t cancelledInFlight = 0;
+  size_t inFlight = 0;
+};
+
+struct SpoolUpload {
+  uint64_t id = 0;
+  std::string remoteName;
+  double fraction = 0.0;
+  uint64_t sentBytes = 0;
+  uint64_t hashedBytes = 0;
+  uint64_t totalBytes = 0;
+};
+
+// Durable queue of pending uploads backed by an append-only journal:
+//   add <id> <kind> <time> <bytes> <local> <source> <remote> end   (tab separated)
+//   done <id> <reason>
+// The closing "end" field shows an add line was written whole; lines a crash
+// cut short are dropped and the journal is rewritten without them on open.
+// Every line is synced to disk before enqueue() or complete() returns.
+// Entries survive restarts until they are uploaded, superseded by policy or
+// their local copy disappears. The journal is compacted once mostly done lines.
+class UploadSpool
+{
+public:
+  // Switched from the UI while drains run
+  std::atomic<SpoolDrainPolicy> policy{ SpoolDrainPolicy::LatestOnly };
+  // A superseded upload that is further along than this is left to finish
+  double finishFraction = 0.8;
+
+  bool open(const std::filesystem::path& journalPath) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_path = journalPath;
+    m_entries.clear();
+    m_doneLines = 0;
+
+    std::ifstream in(m_path);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::vector<std::string> fields = split(line);
+      SpoolEntry entry;
+      uint64_t id = 0;
+      if (parseAdd(fields, entry)) {
+        m_entries[entry.id] = entry;
+        m_nextId = std::max(m_nextId, entry.id + 1);
+      }
+      else if (fields.size() == 3 && fields[0] == "done" && parseNumber(fields[1], id)) {
+        m_entries.erase(id);
+        ++m_doneLines;
+      }
+      else {
+        // Torn by a crash: its entry is absent, and the rewrite below drops the
+        // fragment so the next line appended does not end up glued to it
+        ++m_doneLines;
+      }
+    }
+    in.close();
+
+    compactLocked();
+    return m_journal.isOpen();
+  }
+
+  bool isOpen() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_journal.isOpen();
+  }
+
+  // Under LatestOnly this also coalesces: older pending versions of the same
+  // source are dropped and an upload of one of them is cancelled, unless it
+  // has already sent more than finishFraction of its bytes. A Tail entry
+  // builds on the ones before it and never supersedes anything.
+  uint64_t enqueue(SpoolEntry entry) {
+    std::vector<uint64_t> superseded;
+    uint64_t id = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      id = appendLocked(entry);
+      if (policy == SpoolDrainPolicy::LatestOnly && entry.kind != SpoolKind::Tail) {
+        for (const auto& item : m_entries) {
+          if (item.first != id && item.second.sourcePath == entry.sourcePath &&
+              m_inFlight.find(item.first) == m_inFlight.end()) {
+            superseded.push_back(item.first);
+          }
+        }
+        for (auto& item : m_inFlight) {
+          if (item.second.sourcePath == entry.sourcePath &&
+              item.second.job->fraction() < finishFraction &&
+              !item.second.job->cancel.exchange(true)) {
+            ++m_counters.cancelledInFlight;
+          }
+        }
+      }
+    }
+
+    for (uint64_t old : superseded) {
+      complete(old, "superseded");
+    }
+    return id;
+  }
+
+  // Uploads pending entries with at most maxConcurrent uploads in flight. Stops
+  // handing out work after the first failure so an outage does not walk the
+  // whole backlog; what is left stays queued for the next drain. An upload that
+  // fails because a newer version superseded it is not a failure.
+  // Entries of one source go one at a time and in order, so a tail and its
+  // manifest never land before the object they extend. Once an entry of a
+  // source does not upload, the rest of that source waits for the next drain.
+  // onMissingBase is told about a non-tail entry whose local copy is gone, so
+  // whatever tracks tails built on it can start over.
+  // Returns the number of entries uploaded.
+  size_t drain(int maxConcurrent,
+               const std::function<bool(const SpoolEntry&, TransferJob&)>& upload,
+               const std::atomic<bool>* cancel = nullptr,
+               const std::function<void(const SpoolEntry&)>& onMissingBase = nullptr) {
+    std::deque<SpoolEntry> queue = plan();
+    if (queue.empty()) {
+      return 0;
+    }
+
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::set<std::string> busy;     // sources with an upload running
+    std::set<std::string> blocked;  // sources held back until the next drain
+    std::set<std::string> orphaned; // sources whose base copy is gone, their tails are useless
+    std::atomic<bool> failed{ false };
+    std::atomic<size_t> uploaded{ 0 };
+
+    // The oldest entry whose source is free, false once nothing is left to hand out
+    auto take = [&](SpoolEntry& entry) {
+      std::unique_lock<std::mutex> lock(queueMutex);
+      while (true) {
+        if (failed || (cancel && cancel->load())) {
+          return false;
+        }
+        queue.erase(std::remove_if(queue.begin(), queue.end(), [&](const SpoolEntry& item) {
+          return blocked.count(item.sourcePath) > 0;
+        }), queue.end());
+        if (queue.empty()) {
+          return false;
+        }
+        auto next = std::find_if(queue.begin(), queue.end(), [&](const SpoolEntry& item) {
+          return busy.count(item.sourcePath) == 0;
+        });
+        if (next != queue.end()) {
+          entry = *next;
+          queue.erase(next);
+          busy.insert(entry.sourcePath);
+          return true;
+        }
+        queueChanged.wait(lock);
+      }
+    };
+
+    auto release = [&](const SpoolEntry& entry, bool block) {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      busy.erase(entry.sourcePath);
+      if (block) {
+        blocked.insert(entry.sourcePath);
+      }
+      queueChanged.notify_all();
+    };
+
+    // A new base of a source ends what an earlier missing base orphaned
+    auto isOrphan = [&](const SpoolEntry& entry) {
+      std::lock_guard<std::mutex> lock(queueMutex);
+      if (entry.kind != SpoolKind::Tail) {
+        orphaned.erase(entry.sourcePath);
+        return false;
+      }
+      return orphaned.count(entry.sourcePath) > 0;
+    };
+
+    auto worker = [&]() {
+      SpoolEntry entry;
+      while (take(entry)) {
+        if (isOrphan(entry)) {
+          complete(entry.id, "missing");
+          release(entry, false);
+          continue;
+        }
+
+        std::error_code error;
+        if (!std::filesystem::exists(entry.localPath, error)) {
+          complete(entry.id, "missing");
+          if (entry.kind != SpoolKind::Tail) {
+            {
+              std::lock_guard<std::mutex> lock(queueMutex);
+              orphaned.insert(entry.sourcePath);
+            }
+            if (onMissingBase) {
+              onMissingBase(entry);
+            }
+          }
+          // A tail after a missing tail would leave a gap in the version
+          release(entry, entry.kind == SpoolKind::Tail);
+          continue;
+        }
+
+        std::shared_ptr<TransferJob> job = begin(entry);
+        if (!job) {
+          // Superseded while it waited in this drain's queue
+          release(entry, true);
+          continue;
+        }
+
+        bool ok = upload(entry, *job);
+        bool superseded = job->cancel.load();
+        finish(entry.id);
+
+        if (ok) {
+          complete(entry.id, "uploaded");
+          ++uploaded;
+        }
+        else if (superseded && !(cancel && cancel->load())) {
+          complete(entry.id, "superseded");
+        }
+        else {
+          failed = true;
+        }
+        release(entry, !ok);
+      }
+    };
+
+    size_t threadCount = std::min<size_t>(std::max(maxConcurrent, 1), queue.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    return uploaded;
+  }
+
+  std::vector<SpoolUpload> uploads() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<SpoolUpload> result;
+    for (const auto& item : m_inFlight) {
+      const TransferJob& job = *item.second.job;
+      result.push_back({ item.first, item.second.remoteName, job.fraction(),
+                         job.sentBytes.load(std::memory_order_relaxed),
+                         job.hashedBytes.load(std::memory_order_relaxed), job.totalBytes });
+    }
+    return result;
+  }
+
+  SpoolStatus status() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    SpoolStatus status = m_counters;
+    status.pending = m_entries.size();
+    status.inFlight = m_inFlight.size();
+    for (const auto& item : m_entries) {
+      status.pendingBytes += item.second.bytes;
+      if (status.oldestEnqueuedAt == 0 || item.second.enqueuedAt < status.oldestEnqueuedAt) {
+        status.oldestEnqueuedAt = item.second.enqueuedAt;
+      }
+    }
+    return status;
+  }
+
+  std::vector<SpoolEntry> pending() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<SpoolEntry> entries;
+    for (const auto& item : m_entries) {
+      entries.push_back(item.second);
+    }
+    return entries;
+  }
+
+private:
+  struct Running {
+    std::string sourcePath;
+    std::string remoteName;
+    std::shared_ptr<TransferJob> job;
+  };
+
+  uint64_t appendLocked(SpoolEntry& entry) {
+    entry.id = m_nextId++;
+    if (entry.enqueuedAt == 0) {
+      entry.enqueuedAt = static_cast<int64_t>(std::time(nullptr));
+    }
+    m_journal.append(addLine(entry));
+    m_entries[entry.id] = entry;
+    return entry.id;
+  }
+
+  // Registers an upload about to start, or returns null if the entry is gone
+  std::shared_ptr<TransferJob> begin(const SpoolEntry& entry) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_entries.find(entry.id) == m_entries.end()) {
+      return nullptr;
+    }
+    Running& running = m_inFlight[entry.id];
+    running.sourcePath = entry.sourcePath;
+    running.remoteName = entry.remoteName;
+    running.job = std::make_shared<TransferJob>();
+    running.job->totalBytes = entry.bytes;
+    return running.job;
+  }
+
+  void finish(uint64_t id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_inFlight.erase(id);
+  }
+
+  // Ordered work for one drain. Ids grow with capture time, so map order is oldest first.
+  // Under LatestOnly, versions queued while the policy was OldestFirst are
+  // collapsed here as well, keeping the newest self-contained entry of each
+  // source and the tails after it.
+  std::deque<SpoolEntry> plan() {
+    std::deque<SpoolEntry> queue;
+    std::vector<uint64_t> superseded;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      std::map<std::string, uint64_t> newest;
+      if (policy == SpoolDrainPolicy::LatestOnly) {
+        for (const auto& item : m_entries) {
+          if (item.second.kind != SpoolKind::Tail) {
+            newest[item.second.sourcePath] = item.first;
+          }
+        }
+      }
+
+      for (const auto& item : m_entries) {
+        auto cut = newest.find(item.second.sourcePath);
+        if (cut != newest.end() && item.first < cut->second) {
+          superseded.push_back(item.first);
+          continue;
+        }
+        queue.push_back(item.second);
+      }
+    }
+
+    for (uint64_t id : superseded) {
+      complete(id, "superseded");
+    }
+    return queue;
+  }
+
+  void complete(uint64_t id, const std::string& reason) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_entries.erase(id) == 0) {
+      return;
+    }
+    m_journal.append("done\t" + std::to_string(id) + '\t' + reason + '\n');
+    ++m_doneLines;
+
+    if (reason == "uploaded") {
+      ++m_counters.uploaded;
+    }
+    else if (reason == "superseded") {
+      ++m_counters.superseded;
+    }
+    else {
+      ++m_counters.missing;
+    }
+
+    if (m_doneLines > 256 && m_doneLines > 4 * m_entries.size()) {
+      compactLocked();
+    }
+  }
+
+  // Rewrites the journal with only the pending entries, then swaps it in
+  void compactLocked() {
+    m_journal.close();
+
+    // Until the rename the old journal is still complete, so a failed rewrite
+    // just keeps appending to it
+    if (m_doneLines > 0) {
+      std::string content;
+      for (const auto& item : m_entries) {
+        content += addLine(item.second);
+      }
+      if (JournalFile::replace(m_path, content)) {
+        m_doneLines = 0;
+      }
+    }
+
+    m_journal.open(m_path);
+  }
+
+  static std::string addLine(const SpoolEntry& entry) {
+    std::ostringstream line;
+    line << "add\t" << entry.id << '\t' << static_cast<int>(entry.kind) << '\t'
+      << entry.enqueuedAt << '\t' << entry.bytes << '\t' << entry.localPath << '\t'
+      << entry.sourcePath << '\t' << entry.remoteName << "\tend\n";
+    return line.str();
+  }
+
+  static bool parseNumber(const std::string& text, uint64_t& value) {
+    if (text.empty() || text[0] < '0' || text[0] > '9') {
+      return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtoull(text.c_str(), &end, 10);
+    return errno == 0 && *end == '\0';
+  }
+
+  static bool parseAdd(const std::vector<std::string>& fields, SpoolEntry& entry) {
+    uint64_t kind = 0;
+    uint64_t enqueuedAt = 0;
+    if (fields.size() != 9 || fields[0] != "add" || fields[8] != "end" ||
+        !parseNumber(fields[1], entry.id) || !parseNumber(fields[2], kind) ||
+        !parseNumber(fields[3], enqueuedAt) || !parseNumber(fields[4], entry.bytes) ||
+        kind > static_cast<uint64_t>(SpoolKind::Tail) || fields[5].empty() || fields[7].empty()) {
+      return false;
+    }
+    entry.kind = static_cast<SpoolKind>(kind);
+    entry.enqueuedAt = static_cast<int64_t>(enqueuedAt);
+    entry.localPath = fields[5];
+    entry.sourcePath = fields[6];
+    entry.remoteName = fields[7];
+    return true;
+  }
+
+  static std::vector<std::string> split(const std::string& line) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    std::string field;
+    while (std::getline(stream, field, '\t')) {
+      fields.push_back(field);
+    }
+    return fields;
+  }
+
+  mutable std::mutex m_mutex;
+  std::filesystem::path m_path;
+  JournalFile m_journal;
+  std::map<uint64_t, SpoolEntry> m_entries;
+  uint64_t m_nextId = 1;
+  size_t m_doneLines = 0;
+  SpoolStatus m_counters;
+  std::map<uint64_t, Running> m_inFlight;
+};
@@ -0,0 +1,199 @@
+// Headless backup daemon: runs the jobs of a config file with the same
+// FileSaver core as the UI, without SDL, OpenGL or ImGui.
+//
+//   filesaverd [--config filesaverd.ini] [--check]
+//
+// Stops cleanly on SIGTERM or SIGINT (Ctrl+C or a console close on Windows):
+// capture loops end, running uploads are cancelled and stay in the spool for
+// the next start. Log records go to stdout and to filesaver.log in each job's
+// state directory. Metrics of every job, labelled job="<name>", go to the
+// [daemon] metricsFile and/or http://127.0.0.1:<metricsPort>/metrics, and
+// with [daemon] trace on, sampled cycles to traces/ in each state directory.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "DaemonConfig.h"
+#include "FileSaver.h"
+#include "MetricsServer.h"
+#include "StageMetrics.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#include <time.h>
+#endif
+
+namespace {
+
+#ifdef _WIN32
+std::mutex stopMutex;
+std::condition_variable stopWake;
+std::atomic<bool> stopRequested{ false };
+
+BOOL WINAPI consoleHandler(DWORD) {
+  stopRequested = true;
+  stopWake.notify_all();
+  return TRUE;
+}
+#endif
+
+struct RunningJob {
+  std::string name;
+  std::unique_ptr<FileSaver> saver;
+  uint64_t nextLog = 0;
+  uint64_t missedLogs = 0;
+};
+
+// Copies the records written since the last call to stdout
+void forwardLogs(RunningJob& job) {
+  uint64_t missed = job.missedLogs;
+  for (const auto& record : job.saver->m_log.readFrom(job.nextLog, job.missedLogs)) {
+    std::cout << '[' << job.name << "] " << record.format() << '\n';
+  }
+  if (job.missedLogs != missed) {
+    std::cout << '[' << job.name << "] " << job.missedLogs - missed << " log records overwritten before they were printed\n";
+  }
+  std::cout.flush();
+}
+
+MetricsText collectMetrics(const std::vector<RunningJob>& jobs) {
+  MetricsText text;
+  for (const auto& job : jobs) {
+    job.saver->collectMetrics(text, MetricsText::label("job", job.name));
+  }
+  return text;
+}
+
+void writeMetricsFile(const std::filesystem::path& file, const std::vector<RunningJob>& jobs) {
+  std::string error;
+  if (!collectMetrics(jobs).writeFile(file, error)) {
+    std::cerr << "filesaverd: " << error << std::endl;
+  }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+  std::string configPath = "filesaverd.ini";
+  bool checkOnly = false;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "--config") == 0 || strcmp(argv[i], "-c") == 0) && i + 1 < argc) {
+      configPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--check") == 0) {
+      checkOnly = true;
+    }
+    else {
+      std::cerr << "Usage: " << argv[0] << " [--config filesaverd.ini] [--check]" << std::endl;
+      return 2;
+    }
+  }
+
+  DaemonConfig config;
+  std::string error;
+  if (!config.load(configPath, error)) {
+    std::cerr << "filesaverd: " << error << std::endl;
+    return 1;
+  }
+  if (checkOnly) {
+    std::cout << configPath << ": " << config.jobs.size() << " jobs" << std::endl;
+    return 0;
+  }
+
+#ifdef _WIN32
+  SetConsoleCtrlHandler(consoleHandler, TRUE);
+#else
+  // Blocked before any thread starts, so every thread inherits the mask and
+  // the signals are only ever taken by sigtimedwait below
+  sigset_t stopSignals;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGTERM);
+  sigaddset(&stopSignals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+#endif
+
+  // Nothing here touches the network: authentication happens on the first
+  // upload, and a server that is offline at boot just spools until it is not
+  std::vector<RunningJob> jobs;
+  for (const auto& job : config.jobs) {
+    RunningJob running;
+    running.name = job.name;
+    running.saver = std::make_unique<FileSaver>(config.stateDirectory / job.name);
+    config.apply(job, *running.saver);
+    if (config.trace) {
+      std::string error;
+      if (!running.saver->setTracing(true, error)) {
+        std::cerr << "filesaverd: " << error << std::endl;
+      }
+    }
+    if (job.localOnly) {
+      running.saver->setSaveOnlyLocalFileThread(true);
+    }
+    else {
+      running.saver->setSaveFileThread(true);
+    }
+    running.saver->log("Job started: " + job.path.string() + " every " +
+                       std::to_string(static_cast<int>(job.interval)) + " s" +
+                       (job.localOnly ? ", local copies only\n" : "\n"));
+    jobs.push_back(std::move(running));
+  }
+
+  // jobs does not change from here until shutdown, so the server thread can read it
+  MetricsServer metricsServer;
+  if (config.metricsPort > 0) {
+    std::string error;
+    if (metricsServer.start(static_cast<uint16_t>(config.metricsPort),
+                            [&jobs] { return collectMetrics(jobs).str(); }, error)) {
+      std::cout << "Metrics on http://127.0.0.1:" << config.metricsPort << "/metrics" << std::endl;
+    }
+    else {
+      std::cerr << "filesaverd: " << error << std::endl;
+    }
+  }
+
+  auto nextMetricsWrite = std::chrono::steady_clock::now();
+  for (;;) {
+    for (auto& job : jobs) {
+      forwardLogs(job);
+    }
+    if (!config.metricsFile.empty() && std::chrono::steady_clock::now() >= nextMetricsWrite) {
+      writeMetricsFile(config.metricsFile, jobs);
+      nextMetricsWrite += std::chrono::seconds(10);
+    }
+#ifdef _WIN32
+    std::unique_lock<std::mutex> lock(stopMutex);
+    if (stopWake.wait_for(lock, std::chrono::seconds(1), [] { return stopRequested.load(); })) {
+      break;
+    }
+#else
+    timespec timeout = { 1, 0 };
+    if (sigtimedwait(&stopSignals, nullptr, &timeout) > 0) {
+      break;
+    }
+#endif
+  }
+
+  metricsServer.stop();
+  for (auto& job : jobs) {
+    job.saver->log("Stopping\n");
+    job.saver->setSaveFileThread(false);
+    job.saver->setSaveOnlyLocalFileThread(false);
+    forwardLogs(job);
+  }
+  if (!config.metricsFile.empty()) {
+    writeMetricsFile(config.metricsFile, jobs);
+  }
+  // Savers are destroyed here, which flushes their logs and closes the journals
+  jobs.clear();
+  return 0;
+}
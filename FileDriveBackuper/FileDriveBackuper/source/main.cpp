@@ -10,6 +10,9 @@
 #include "ImGuiFileDialog.h"
 
 #include "FileSaver.h"
+#include "LogView.h"
+#include "TaskQueue.h"
+#include "ProgressMeter.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -18,6 +21,25 @@
 #include <unistd.h>
 #endif
 
+// "1h 05m", "3m 12s", "42s", or "--" while the rate is unknown
+static std::string formatEta(double seconds) {
+  if (seconds < 0.0) {
+    return "--";
+  }
+  long long total = static_cast<long long>(seconds + 0.5);
+  char text[32];
+  if (total >= 3600) {
+    snprintf(text, sizeof(text), "%lldh %02lldm", total / 3600, (total / 60) % 60);
+  }
+  else if (total >= 60) {
+    snprintf(text, sizeof(text), "%lldm %02llds", total / 60, total % 60);
+  }
+  else {
+    snprintf(text, sizeof(text), "%llds", total);
+  }
+  return text;
+}
+
 int main(int argc, char* argv[]) {
   // Setup SDL
   FileSaver fileSaver;
@@ -98,24 +120,96 @@ int main(int argc, char* argv[]) {
   std::string filter = ".*,.psd,.pbd,.jpg,.png,.bmp,.tiff,.tga,.pdf,.doc,.docx,.xls,.xlsx,.zip,.rar";
   bool showCopiedMessage = false;
   std::chrono::steady_clock::time_point copyTime;
-  bool auto_scroll = true;
+  LogView logView;
+  std::string bandwidthSchedule;
+  std::string bandwidthError;
+  std::shared_ptr<std::vector<std::string>> bucketVersions;
+
+  // Network and disk work started from the UI runs here, never in a frame
+  TaskQueue tasks(&fileSaver.m_uiWake);
+  TaskHandle authTask;
+  TaskHandle saveTask;
+  TaskHandle localSaveTask;
+  TaskHandle listTask;
+  TaskHandle restoreTask;
+  // Single-file restore from a folder version
+  std::string restoreVersion;
+  std::string restoreMember;
+  std::string restoreDestination;
+
+  // Upload throughput overall and per upload in flight, sampled once a frame
+  // from the counters the transfers bump
+  RateMeter throughput;
+  std::map<uint64_t, RateMeter> uploadRates;
+
+  // Event driven rendering: sleep until input arrives or a worker reports a
+  // change, and render nothing while the window cannot be seen
+  bool redrawOnChangeOnly = true;
+  int framesToDraw = 2;
+  UiLoadMeter uiLoad;
+  Uint32 wakeEvent = SDL_RegisterEvents(1);
+  fileSaver.m_uiWake.setHandler([wakeEvent]() {
+    SDL_Event wake = {};
+    wake.type = wakeEvent;
+    SDL_PushEvent(&wake);
+  });
 
   // Main loop
   bool done = false;
   while (!done) {
     SDL_Event event;
+    auto handleEvent = [&](const SDL_Event& received) {
+      ImGui_ImplSDL3_ProcessEvent(&received);
+      if (received.type == SDL_EVENT_QUIT) done = true;
+      if (received.type == SDL_EVENT_WINDOW_CLOSE_REQUESTED &&
+        received.window.windowID == SDL_GetWindowID(window)) done = true;
+      // ImGui needs a frame or two after input to settle hover and popups
+      framesToDraw = std::max(framesToDraw, received.type == wakeEvent ? 1 : 3);
+    };
+
+    bool hidden = (SDL_GetWindowFlags(window) &
+      (SDL_WINDOW_MINIMIZED | SDL_WINDOW_HIDDEN | SDL_WINDOW_OCCLUDED)) != 0;
+    if ((redrawOnChangeOnly && framesToDraw == 0) || hidden) {
+      // Redraw at least once a second while visible so times and rates stay current
+      if (SDL_WaitEventTimeout(&event, hidden ? 5000 : 1000)) {
+        handleEvent(event);
+      }
+      else if (!hidden) {
+        framesToDraw = 1;
+      }
+    }
+    uiLoad.wakeup();
     while (SDL_PollEvent(&event)) {
-      ImGui_ImplSDL3_ProcessEvent(&event);
-      if (event.type == SDL_EVENT_QUIT) done = true;
-      if (event.type == SDL_EVENT_WINDOW_CLOSE_REQUESTED &&
-        event.window.windowID == SDL_GetWindowID(window)) done = true;
+      handleEvent(event);
+    }
+    fileSaver.m_uiWake.consume();
+    uiLoad.update(threadCpuNs());
+    if (hidden) {
+      continue;
     }
+    if (framesToDraw > 0) {
+      --framesToDraw;
+    }
+    uiLoad.frame();
 
     // Start ImGui frame
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplSDL3_NewFrame();
     ImGui::NewFrame();
 
+    // One coherent view of the saver for the whole frame
+    BackupStatus backup = fileSaver.status();
+    std::vector<SpoolUpload> uploads = fileSaver.m_spool.uploads();
+    throughput.sample(fileSaver.m_bytesSent.load(std::memory_order_relaxed));
+    for (auto it = uploadRates.begin(); it != uploadRates.end();) {
+      bool running = std::any_of(uploads.begin(), uploads.end(),
+                                 [&it](const SpoolUpload& upload) { return upload.id == it->first; });
+      it = running ? std::next(it) : uploadRates.erase(it);
+    }
+    for (const auto& upload : uploads) {
+      uploadRates[upload.id].sample(upload.sentBytes);
+    }
+
     // Get the main viewport
     ImGuiViewport* viewport = ImGui::GetMainViewport();
 
@@ -211,6 +305,19 @@ int main(int argc, char* argv[]) {
           ImGui::SetTooltip("Click to select a file to open");
         }
 
+        ImGui::SameLine();
+
+        if (ImGui::Button("Open Folder")) {
+          IGFD::FileDialogConfig config;
+          config.path = ".";
+          // A null filter puts the dialog in directory mode
+          ImGuiFileDialog::Instance()->OpenDialog("ChooseFolderDlgKey", "Choose Folder", nullptr, config);
+        }
+
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("Click to back up a whole folder. Small files are packed together before uploading");
+        }
+
         ImGui::SameLine();
         
         if (!file_path_name.empty()) {
@@ -225,10 +332,19 @@ int main(int argc, char* argv[]) {
         ImGui::Spacing();
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)",
           1000.0f / io.Framerate, io.Framerate);
+        ImGui::Checkbox("Redraw only on changes", &redrawOnChangeOnly);
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("Sleep until input arrives or the backup reports something instead of\ndrawing every frame. Nothing is drawn while the window is minimized");
+        }
+        ImGui::SameLine();
+        ImGui::Text("UI thread: %.1f%% CPU, %.1f wakeups/s, %.1f frames/s",
+          uiLoad.cpuPercent, uiLoad.wakeupsPerSecond, uiLoad.framesPerSecond);
+        ImGui::SameLine();
+        ImGui::Text("Background tasks: %zu", tasks.pending());
 
         ImGui::Spacing();
         ImGui::Separator();
-        ImGui::Text("Debug: File Path Set: %s", fileSaver.m_isFilePathSet ? "Yes" : "No");
+        ImGui::Text("Debug: File Path Set: %s", backup.filePathSet ? "Yes" : "No");
         ImGui::PushItemWidth(ImGui::GetWindowWidth() / 2);
         ImGui::SliderFloat("Seconds between saves: ", 
                            &fileSaver.m_saveInterval, 
@@ -241,13 +357,392 @@ int main(int argc, char* argv[]) {
           ImGui::SetTooltip("Click to select how many seconds between save");
         }
 
-        std::string buttonLabel = (!fileSaver.m_isSaving ? "Start" : "Stop");
-        std::string buttonLocalLabel = (!fileSaver.m_isSavingOnlyLocal ? "Start ONLY LOCAL" : "Stop ONLY LOCAL");
+        bool chunked = fileSaver.m_useChunkedUpload;
+        if (ImGui::Checkbox("Chunked upload (only send changed chunks)", &chunked)) {
+          fileSaver.m_useChunkedUpload = chunked;
+        }
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("Splits the file into content-defined chunks and uploads only the ones the bucket doesn't have yet,\nplus a small manifest per version");
+        }
+        bool skipIdentical = fileSaver.m_skipIdenticalUploads;
+        if (ImGui::Checkbox("Skip uploads already in bucket", &skipIdentical)) {
+          fileSaver.m_skipIdenticalUploads = skipIdentical;
+        }
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("When the bucket already holds a file with the same SHA1 and size,\nthe new version is created with a server-side copy instead of an upload");
+        }
+        if (fileSaver.m_skippedUploadBytes > 0) {
+          ImGui::SameLine();
+          ImGui::Text("(%.1f MB not sent)", fileSaver.m_skippedUploadBytes.load() / (1024.0 * 1024.0));
+        }
+        RemoteIndexStatus remoteIndex = fileSaver.m_remoteIndex.status();
+        if (remoteIndex.complete) {
+          long long age = static_cast<long long>(std::time(nullptr)) - remoteIndex.listedAt;
+          ImGui::Text("Bucket mirror: %zu files, listed %lldh %02lldm ago", remoteIndex.files, age / 3600, (age / 60) % 60);
+        }
+        else if (!remoteIndex.cursor.empty()) {
+          ImGui::Text("Bucket mirror: %zu files, listing resumes at %s", remoteIndex.files, remoteIndex.cursor.c_str());
+        }
+        else {
+          ImGui::Text("Bucket mirror: %zu files, not listed yet", remoteIndex.files);
+        }
+        ImGui::SameLine();
+        if (ImGui::SmallButton("Re-list")) {
+          fileSaver.m_remoteIndex.invalidate();
+        }
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("The mirror is kept up to date by every upload and re-listed weekly.\nRe-list picks up files added or deleted from elsewhere on the next upload");
+        }
+        // Edited on a copy and handed back whole, the capture thread reads it meanwhile
+        KeyLayout layout = fileSaver.keyLayout();
+        int keyLayout = layout.kind == KeyLayoutKind::Flat ? 0 : 1;
+        ImGui::PushItemWidth(160);
+        if (ImGui::Combo("Object names", &keyLayout, "Flat (timestamp_name)\0By path (set/hash/path/timestamp)\0")) {
+          layout.kind = keyLayout == 0 ? KeyLayoutKind::Flat : KeyLayoutKind::Hierarchical;
+          fileSaver.setKeyLayout(layout);
+        }
+        ImGui::PopItemWidth();
+        if (layout.kind == KeyLayoutKind::Hierarchical) {
+          ImGui::SameLine();
+          ImGui::PushItemWidth(120);
+          if (ImGui::InputText("Backup set", &layout.set)) {
+            fileSaver.setKeyLayout(layout);
+          }
+          ImGui::PopItemWidth();
+          if (backup.filePathSet) {
+            ImGui::Text("Versions go under %s", layout.historyPrefix(fileSaver.m_filePath).c_str());
+          }
+        }
+        if (!backup.authenticated || fileSaver.m_migrating) {
+          ImGui::BeginDisabled();
+          ImGui::Button("Migrate flat names");
+          ImGui::EndDisabled();
+        }
+        else if (ImGui::Button("Migrate flat names")) {
+          fileSaver.startMigration();
+        }
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("Copies versions named timestamp_name in the bucket root to set/hash/path/timestamp,\nserver-side. The old names are kept");
+        }
+        if (fileSaver.m_migrating || fileSaver.m_migratedObjects > 0) {
+          ImGui::SameLine();
+          ImGui::Text("%s%zu objects copied", fileSaver.m_migrating ? "Migrating... " : "", fileSaver.m_migratedObjects.load());
+        }
+        if (backup.filePathSet && backup.authenticated) {
+          ImGui::SameLine();
+          if (taskBusy(listTask)) {
+            ImGui::Text("Listing versions... %.0f s", listTask->seconds());
+          }
+          else if (ImGui::Button("List versions")) {
+            // The task works on copies, the fields stay editable meanwhile
+            auto versions = std::make_shared<std::vector<std::string>>();
+            std::filesystem::path source = fileSaver.m_filePath;
+            listTask = tasks.submit("List versions", [&fileSaver, versions, source, layout](std::string&) {
+              *versions = fileSaver.listVersions(source, layout);
+              return true;
+            });
+            bucketVersions = versions;
+          }
+        }
+        if (listTask && listTask->finished() &&
+            ImGui::TreeNode("Versions in bucket", "Versions in bucket (%zu)", bucketVersions->size())) {
+          for (const auto& version : *bucketVersions) {
+            if (ImGui::Selectable(version.c_str(), version == restoreVersion)) {
+              restoreVersion = version;
+            }
+          }
+
+          // Folder versions pack small files into bundles; one file comes back
+          // with a ranged download of its bundle
+          if (!restoreVersion.empty()) {
+            ImGui::PushItemWidth(240);
+            ImGui::InputText("File in folder", &restoreMember);
+            ImGui::InputText("Restore to", &restoreDestination);
+            ImGui::PopItemWidth();
+            if (ImGui::IsItemHovered()) {
+              ImGui::SetTooltip("Path of the restored file, next to the backed up folder when empty");
+            }
+            if (taskBusy(restoreTask)) {
+              ImGui::Text("Restoring %s... %.0f s", restoreMember.c_str(), restoreTask->seconds());
+            }
+            else if (!restoreMember.empty() && ImGui::Button("Restore file")) {
+              std::string version = restoreVersion;
+              std::string member = restoreMember;
+              std::filesystem::path destination = restoreDestination;
+              if (destination.empty()) {
+                destination = fileSaver.m_filePath.parent_path() / "restored" / std::filesystem::path(member).filename();
+              }
+              restoreTask = tasks.submit("Restore " + member, [&fileSaver, version, member, destination](std::string&) {
+                return fileSaver.restoreDirectoryMember(version, member, destination);
+              });
+            }
+            if (restoreTask && restoreTask->finished()) {
+              ImGui::SameLine();
+              ImGui::Text("%s", restoreTask->succeeded() ? "Restored" : "Restore failed, see the log");
+            }
+          }
+          ImGui::TreePop();
+        }
+
+        bool appendMode = fileSaver.m_useAppendMode;
+        if (ImGui::Checkbox("Append mode (only send new bytes of growing files)", &appendMode)) {
+          fileSaver.m_useAppendMode = appendMode;
+        }
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("For logs, recordings and other files that only grow. When the backed up part is\nunchanged only the new tail is copied and uploaded, otherwise a whole copy is taken");
+        }
+
+        TransferDecision transfer = fileSaver.m_transferController.snapshot();
+        ImGui::Text("Large uploads: %d streams, %.0f MB parts, %.2f MB/s (%.2f MB/s per stream), RTT %.0f ms",
+                    transfer.concurrency,
+                    transfer.partSize / (1024.0 * 1024.0),
+                    transfer.goodput / (1024.0 * 1024.0),
+                    transfer.streamGoodput / (1024.0 * 1024.0),
+                    transfer.rttMs);
+        ImGui::Text("Controller: %s", transfer.reason.c_str());
+
+        ImGui::Text("Network: %llu stalls, %llu connect timeouts, %llu retries, %llu cancelled",
+                    (unsigned long long)fileSaver.m_transferStats.stalls.load(),
+                    (unsigned long long)fileSaver.m_transferStats.connectTimeouts.load(),
+                    (unsigned long long)fileSaver.m_transferStats.retries.load(),
+                    (unsigned long long)fileSaver.m_transferStats.cancelled.load());
+
+        ImGui::PushItemWidth(ImGui::GetWindowWidth() / 2);
+        ImGui::InputTextWithHint("Bandwidth schedule", "09:00-18:00 up=2M; * up=0", &bandwidthSchedule);
+        ImGui::PopItemWidth();
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("';' separated windows, first match wins. Rates in bytes/s with K/M/G, 0 is unlimited.\nChanges apply to uploads already running");
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Apply")) {
+          bandwidthError.clear();
+          if (fileSaver.m_rateLimiter.setSchedule(bandwidthSchedule, bandwidthError)) {
+            fileSaver.log("Bandwidth schedule set: " + bandwidthSchedule + "\n");
+          }
+        }
+        if (!bandwidthError.empty()) {
+          ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "%s", bandwidthError.c_str());
+        }
+
+        uint64_t uploadRate = fileSaver.m_rateLimiter.uploadRate();
+        uint64_t downloadRate = fileSaver.m_rateLimiter.downloadRate();
+        ImGui::Text("Limits now: up %s, down %s",
+                    uploadRate ? (std::to_string(uploadRate / 1024) + " KB/s").c_str() : "unlimited",
+                    downloadRate ? (std::to_string(downloadRate / 1024) + " KB/s").c_str() : "unlimited");
+        for (const auto& window : fileSaver.m_rateLimiter.throughput()) {
+          if (window.uploadBytes == 0 && window.downloadBytes == 0) {
+            continue;
+          }
+          double seconds = window.activeSeconds > 0.0 ? window.activeSeconds : 1.0;
+          ImGui::BulletText("%s: %.1f MB up, %.1f MB down, avg %.1f KB/s while active",
+                            window.label.c_str(),
+                            window.uploadBytes / (1024.0 * 1024.0),
+                            window.downloadBytes / (1024.0 * 1024.0),
+                            (window.uploadBytes + window.downloadBytes) / 1024.0 / seconds);
+        }
+
+#ifdef KTLS_UPLOAD_SUPPORTED
+        bool kernelTls = fileSaver.m_useKernelTls;
+        if (ImGui::Checkbox("Kernel TLS uploads", &kernelTls)) {
+          fileSaver.m_useKernelTls = kernelTls;
+        }
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("Single-part uploads hand the TLS session to the kernel and send the file with sendfile.\nFalls back to cURL when the tls module or an AES-GCM suite is not available");
+        }
+        if (kernelTls && !KtlsUploader::kernelSupported()) {
+          ImGui::SameLine();
+          ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "(not available, using cURL)");
+        }
+#endif
+        ImGui::Text("Upload CPU: cURL %.2f s/GB over %.1f MB, kernel TLS %.2f s/GB over %.1f MB",
+                    fileSaver.m_curlCpu.cpuSecondsPerGB(), fileSaver.m_curlCpu.bytes.load() / (1024.0 * 1024.0),
+                    fileSaver.m_ktlsCpu.cpuSecondsPerGB(), fileSaver.m_ktlsCpu.bytes.load() / (1024.0 * 1024.0));
+
+        bool hedge = fileSaver.m_hedgePolicy.enabled;
+        if (ImGui::Checkbox("Hedge slow parts", &hedge)) {
+          fileSaver.m_hedgePolicy.enabled = hedge;
+        }
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("Re-sends a part on another upload URL when it takes longer than the p95 for its size.\nExtra traffic is capped at %.0f%% of the file", fileSaver.m_hedgePolicy.budgetFraction * 100.0);
+        }
+        ImGui::SameLine();
+        ImGui::Text("%llu hedges, %llu won, %.1f MB extra",
+                    (unsigned long long)fileSaver.m_hedgePolicy.hedgesLaunched.load(),
+                    (unsigned long long)fileSaver.m_hedgePolicy.hedgesWon.load(),
+                    fileSaver.m_hedgePolicy.hedgedBytes.load() / (1024.0 * 1024.0));
+
+        SpoolStatus spool = fileSaver.m_spool.status();
+        if (spool.pending > 0) {
+          long long age = static_cast<long long>(std::time(nullptr)) - spool.oldestEnqueuedAt;
+          ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f),
+                             "Upload backlog: %zu versions, %.1f MB, oldest %lldh %02lldm ago",
+                             spool.pending, spool.pendingBytes / (1024.0 * 1024.0), age / 3600, (age / 60) % 60);
+        }
+        else {
+          ImGui::Text("Upload backlog: empty");
+        }
+        ImGui::Text("Spool: %llu uploaded, %llu superseded, %llu missing local copy",
+                    (unsigned long long)spool.uploaded,
+                    (unsigned long long)spool.superseded,
+                    (unsigned long long)spool.missing);
+
+        bool latestOnly = fileSaver.m_spool.policy == SpoolDrainPolicy::LatestOnly;
+        if (ImGui::Checkbox("Coalesce to latest version", &latestOnly)) {
+          fileSaver.m_spool.policy = latestOnly ? SpoolDrainPolicy::LatestOnly : SpoolDrainPolicy::OldestFirst;
+        }
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("A new version of a file replaces its queued one, and cancels its upload unless\nit is more than %.0f%% done. Off uploads every version in capture order",
+                            fileSaver.m_spool.finishFraction * 100.0);
+        }
+        ImGui::SameLine();
+        ImGui::PushItemWidth(120);
+        int spoolConcurrency = fileSaver.m_spoolConcurrency;
+        if (ImGui::SliderInt("Parallel uploads", &spoolConcurrency, 1, 8)) {
+          fileSaver.m_spoolConcurrency = spoolConcurrency;
+        }
+        ImGui::PopItemWidth();
+        if (spool.cancelledInFlight > 0) {
+          ImGui::Text("Superseded uploads cancelled mid-flight: %llu", (unsigned long long)spool.cancelledInFlight);
+        }
+        uint64_t inFlightSent = 0;
+        for (const auto& upload : uploads) {
+          inFlightSent += std::min(upload.sentBytes, upload.totalBytes);
+          const RateMeter& rate = uploadRates[upload.id];
+          char overlay[128];
+          float fraction = static_cast<float>(upload.fraction);
+          if (upload.sentBytes == 0 && upload.hashedBytes > 0 && upload.hashedBytes < upload.totalBytes) {
+            fraction = static_cast<float>(upload.hashedBytes) / upload.totalBytes;
+            snprintf(overlay, sizeof(overlay), "hashing %.0f%%", fraction * 100.0f);
+          }
+          else {
+            uint64_t left = upload.totalBytes > upload.sentBytes ? upload.totalBytes - upload.sentBytes : 0;
+            snprintf(overlay, sizeof(overlay), "%.1f / %.1f MB, %.2f MB/s, ETA %s",
+                     upload.sentBytes / (1024.0 * 1024.0), upload.totalBytes / (1024.0 * 1024.0),
+                     rate.rate() / (1024.0 * 1024.0), formatEta(rate.etaSeconds(left)).c_str());
+          }
+          ImGui::ProgressBar(fraction, ImVec2(ImGui::GetWindowWidth() / 3, 0), overlay);
+          ImGui::SameLine();
+          ImGui::Text("%s", upload.remoteName.c_str());
+        }
+        if (!uploads.empty() || throughput.rate() > 1.0) {
+          uint64_t backlogLeft = spool.pendingBytes > inFlightSent ? spool.pendingBytes - inFlightSent : 0;
+          char overlay[96];
+          snprintf(overlay, sizeof(overlay), "%.2f MB/s, backlog ETA %s",
+                   throughput.rate() / (1024.0 * 1024.0), formatEta(throughput.etaSeconds(backlogLeft)).c_str());
+          ImGui::PlotLines("Upload throughput", throughput.history(), RateMeter::kHistory, throughput.historyOffset(),
+                           overlay, 0.0f, throughput.historyMax() * 1.1f, ImVec2(ImGui::GetWindowWidth() / 3, 40));
+        }
+
+        ImGui::Checkbox("Multiplex API calls", &fileSaver.m_b2Credentials.apiChannel.enabled);
+        if (ImGui::IsItemHovered()) {
+          ImGui::SetTooltip("B2 API calls from all uploads share one HTTP/2 connection as concurrent streams.\nFalls back to HTTP/1.1 when HTTP/2 is not available");
+        }
+        ApiChannelStatus api = fileSaver.m_b2Credentials.apiChannel.status();
+        ImGui::SameLine();
+        ImGui::Text("%s, %llu HTTP/2 streams, %llu HTTP/1.1 requests, %zu in flight (peak %zu)",
+                    api.http2Active ? "HTTP/2" : (api.http2Available ? "HTTP/1.1 after HTTP/2 error" : "HTTP/1.1 only"),
+                    (unsigned long long)api.http2Streams,
+                    (unsigned long long)api.http1Requests,
+                    api.inFlight, api.peakInFlight);
+        if (!api.endpoints.empty() && ImGui::TreeNode("API latency")) {
+          for (const auto& item : api.endpoints) {
+            ImGui::BulletText("%s: %llu calls, %llu failed, avg %.1f ms, max %.1f ms, last %.1f ms",
+                              item.first.c_str(),
+                              (unsigned long long)item.second.calls,
+                              (unsigned long long)item.second.failures,
+                              item.second.averageMs(),
+                              item.second.maxUs / 1000.0,
+                              item.second.lastUs / 1000.0);
+          }
+          ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNode("Pipeline timings")) {
+          if (ImGui::BeginTable("stages", 6, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+            ImGui::TableSetupColumn("Stage");
+            ImGui::TableSetupColumn("Count");
+            ImGui::TableSetupColumn("p50 ms");
+            ImGui::TableSetupColumn("p99 ms");
+            ImGui::TableSetupColumn("Max ms");
+            ImGui::TableSetupColumn("Total s");
+            ImGui::TableHeadersRow();
+            for (int i = 0; i < kStageCount; ++i) {
+              const LatencyHistogram& stage = fileSaver.m_metrics.stage(static_cast<Stage>(i));
+              ImGui::TableNextRow();
+              ImGui::TableNextColumn();
+              ImGui::TextUnformatted(stageName(static_cast<Stage>(i)));
+              ImGui::TableNextColumn();
+              ImGui::Text("%llu", (unsigned long long)stage.count());
+              ImGui::TableNextColumn();
+              ImGui::Text("%.1f", stage.percentileMicros(0.5) / 1000.0);
+              ImGui::TableNextColumn();
+              ImGui::Text("%.1f", stage.percentileMicros(0.99) / 1000.0);
+              ImGui::TableNextColumn();
+              ImGui::Text("%.1f", stage.maxMicros() / 1000.0);
+              ImGui::TableNextColumn();
+              ImGui::Text("%.1f", stage.sumMicros() / 1e6);
+            }
+            ImGui::EndTable();
+          }
+          ImGui::Text("Copied %.1f MB, hashed %.1f MB, %llu identical uploads skipped, chunk dedup %.0f%%",
+                      fileSaver.m_metrics.bytesCopied.load() / (1024.0 * 1024.0),
+                      fileSaver.m_metrics.bytesHashed.load() / (1024.0 * 1024.0),
+                      (unsigned long long)fileSaver.m_metrics.skippedIdentical.load(),
+                      fileSaver.m_metrics.dedupRatio() * 100.0);
+          if (ImGui::Button("Write metrics file")) {
+            std::filesystem::path metricsFile = fileSaver.m_stateDirectory / "metrics.prom";
+            tasks.submit("Write metrics", [&fileSaver, metricsFile](std::string& message) {
+              MetricsText text;
+              fileSaver.collectMetrics(text);
+              if (!text.writeFile(metricsFile, message)) {
+                return false;
+              }
+              fileSaver.log("Metrics written to " + metricsFile.string() + "\n");
+              return true;
+            });
+          }
+          if (ImGui::IsItemHovered()) {
+            ImGui::SetTooltip("Prometheus text format, for the node exporter textfile collector");
+          }
+
+          // Starting and stopping touch the disk, so they run as tasks
+          bool tracing = fileSaver.m_tracer.running();
+          if (ImGui::Checkbox("Record trace", &tracing)) {
+            tasks.submit("Tracing", [&fileSaver, tracing](std::string& message) {
+              return fileSaver.setTracing(tracing, message);
+            });
+          }
+          if (ImGui::IsItemHovered()) {
+            ImGui::SetTooltip("Writes a Chrome trace-event timeline of backup cycles and their stages to traces/\nin the state directory. Open it in ui.perfetto.dev or chrome://tracing");
+          }
+          ImGui::SameLine();
+          int sampleEvery = static_cast<int>(fileSaver.m_tracer.sampleEvery.load());
+          ImGui::PushItemWidth(100);
+          if (ImGui::InputInt("Trace 1 in N cycles", &sampleEvery)) {
+            fileSaver.m_tracer.sampleEvery = static_cast<uint32_t>(std::max(sampleEvery, 1));
+          }
+          ImGui::PopItemWidth();
+          if (tracing) {
+            ImGui::Text("%s: %llu spans written, %llu dropped",
+                        fileSaver.m_tracer.currentFile().string().c_str(),
+                        (unsigned long long)fileSaver.m_tracer.written(),
+                        (unsigned long long)fileSaver.m_tracer.dropped());
+          }
+          ImGui::TreePop();
+        }
+
+        std::string buttonLabel = (!backup.saving ? "Start" : "Stop");
+        std::string buttonLocalLabel = (!backup.savingOnlyLocal ? "Start ONLY LOCAL" : "Stop ONLY LOCAL");
         buttonLabel += " Saving";
         buttonLocalLabel += " Saving";
         ImGui::Separator();
 
         ImGui::Text("Backblaze B2 Cloud Storage Configuration");
+        // The authentication task reads these fields
+        bool authenticating = taskBusy(authTask);
+        if (authenticating) {
+          ImGui::BeginDisabled();
+        }
         ImGui::PushItemWidth(ImGui::GetWindowWidth() / 2);
         ImGui::InputText("Backblaze Key ID", &fileSaver.m_b2Credentials.accountId);
         if (ImGui::IsItemHovered()) {
@@ -258,62 +753,89 @@ int main(int argc, char* argv[]) {
         if (ImGui::IsItemHovered()) {
           ImGui::SetTooltip("This is obtained when creating an application key called applicationKey");
         }
-        ImGui::InputText("Bucket Name", &fileSaver.m_b2Credentials.bucketName);
+        std::string bucketName = fileSaver.m_b2Credentials.getBucketName();
+        if (ImGui::InputText("Bucket Name", &bucketName)) {
+          fileSaver.m_b2Credentials.setBucketName(bucketName);
+        }
         if (ImGui::IsItemHovered()) {
           ImGui::SetTooltip("This is the name of your bucket");
         }
         ImGui::PopItemWidth();
+        if (authenticating) {
+          ImGui::EndDisabled();
+        }
 
         ImGui::Separator();
-        bool wasAuthenticated = fileSaver.m_b2Credentials.isAuthenticated;
-        if (wasAuthenticated) {
+        bool wasAuthenticated = backup.authenticated;
+        bool authLocked = wasAuthenticated || authenticating;
+        if (authLocked) {
           ImGui::BeginDisabled();
         }
 
         if (ImGui::Button("Authenticate with Backblaze B2")) {
-          if (fileSaver.m_b2Credentials.authenticate()) {
-            fileSaver.m_logger += "Backblaze B2 authentication successful!\n";
-          }
-          else {
-            fileSaver.m_logger += "Backblaze B2 authentication failed!\n";
-          }
+          authTask = tasks.submit("Authenticate", [&fileSaver](std::string& message) {
+            if (fileSaver.ensureAuthenticated()) {
+              fileSaver.log("Backblaze B2 authentication successful!\n");
+              return true;
+            }
+            fileSaver.log("Backblaze B2 authentication failed!\n", LogLevel::Error);
+            message = "Authentication failed, see the log";
+            return false;
+          });
         }
 
         if (ImGui::IsItemHovered()) {
           ImGui::SetTooltip(!wasAuthenticated ? "Click to authenticate" : "User has been already authenticated");
         }
 
-        if (wasAuthenticated) {
+        if (authLocked) {
           ImGui::EndDisabled();
+        }
+        if (wasAuthenticated) {
           ImGui::SameLine();
           ImGui::TextColored(ImVec4(0.0f, 1.0f, 0.0f, 1.0f), " Authenticated");
         }
+        else if (authenticating) {
+          ImGui::SameLine();
+          ImGui::Text(" Authenticating... %.0f s", authTask->seconds());
+        }
+        else if (authTask && !authTask->succeeded()) {
+          ImGui::SameLine();
+          ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), " %s", authTask->message().c_str());
+        }
 
         ImGui::Spacing();
 
-        if (!fileSaver.m_isFilePathSet || !fileSaver.m_b2Credentials.isAuthenticated) {
+        if (!backup.filePathSet || !backup.authenticated) {
           ImGui::BeginDisabled();
         }
 
         ImGui::Text("You can use the button below to start/stop saving your file to the cloud.");
         ImGui::Text("File will be backed up every %.1f seconds", fileSaver.m_saveInterval);
 
+        // Stopping waits for the capture and upload threads, so it runs as a task as well
+        bool switchingSave = taskBusy(saveTask);
+        if (switchingSave) {
+          ImGui::BeginDisabled();
+        }
         if (ImGui::Button(buttonLabel.c_str(), ImVec2(120, 40))) {
-          fileSaver.setSaveFileThread(!fileSaver.m_isSaving);
-          if (fileSaver.m_isSaving) {
-            fileSaver.m_logger += "Backup process started\n";
-          }
-          else {
-            fileSaver.m_logger += "Backup process stopped\n";
-          }
+          bool start = !backup.saving;
+          saveTask = tasks.submit("Backup", [&fileSaver, start](std::string&) {
+            fileSaver.setSaveFileThread(start);
+            fileSaver.log(start ? "Backup process started\n" : "Backup process stopped\n");
+            return true;
+          });
+        }
+        if (switchingSave) {
+          ImGui::EndDisabled();
         }
 
 
 
-        if (!fileSaver.m_isFilePathSet || !fileSaver.m_b2Credentials.isAuthenticated) {
+        if (!backup.filePathSet || !backup.authenticated) {
           ImGui::EndDisabled();
           ImGui::SameLine();
-          if (!fileSaver.m_isFilePathSet) {
+          if (!backup.filePathSet) {
             ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "Select a file first!");
           }
           else {
@@ -323,55 +845,68 @@ int main(int argc, char* argv[]) {
 
         ImGui::SameLine();
 
-        if (!fileSaver.m_isFilePathSet) {
+        if (!backup.filePathSet) {
           ImGui::BeginDisabled();
         }
 
+        bool switchingLocal = taskBusy(localSaveTask);
+        if (switchingLocal) {
+          ImGui::BeginDisabled();
+        }
         if (ImGui::Button(buttonLocalLabel.c_str(), ImVec2(120, 40))) {
-          fileSaver.setSaveOnlyLocalFileThread(!fileSaver.m_isSavingOnlyLocal);
-          if (fileSaver.m_isSavingOnlyLocal) {
-            fileSaver.m_logger += "Backup ONLY LOCAL process started\n";
-          }
-          else {
-            fileSaver.m_logger += "Backup ONLY LOCAL process stopped\n";
-          }
+          bool start = !backup.savingOnlyLocal;
+          localSaveTask = tasks.submit("Local backup", [&fileSaver, start](std::string&) {
+            fileSaver.setSaveOnlyLocalFileThread(start);
+            fileSaver.log(start ? "Backup ONLY LOCAL process started\n" : "Backup ONLY LOCAL process stopped\n");
+            return true;
+          });
+        }
+        if (switchingLocal) {
+          ImGui::EndDisabled();
         }
 
-        if (!fileSaver.m_isFilePathSet) {
+        if (!backup.filePathSet) {
           ImGui::EndDisabled();
         }
 
         ImGui::Text("Either Use the Only Local or the BackBlaze. \n I have no idea what happens if you use both at the same time");
 
+        ImGui::Text("Status: %s, %u uploading, %llu spooled, %.2f MB/s, %.1f MB sent",
+                    backupPhaseName(backup.phase), backup.uploadsInFlight,
+                    (unsigned long long)backup.spoolPending,
+                    throughput.rate() / (1024.0 * 1024.0),
+                    fileSaver.m_bytesSent.load(std::memory_order_relaxed) / (1024.0 * 1024.0));
+        if (fileSaver.m_copyProgress.active()) {
+          char overlay[64];
+          snprintf(overlay, sizeof(overlay), "local copy %.1f / %.1f MB",
+                   fileSaver.m_copyProgress.done.load(std::memory_order_relaxed) / (1024.0 * 1024.0),
+                   fileSaver.m_copyProgress.total.load(std::memory_order_relaxed) / (1024.0 * 1024.0));
+          ImGui::ProgressBar(static_cast<float>(fileSaver.m_copyProgress.fraction()),
+                             ImVec2(ImGui::GetWindowWidth() / 3, 0), overlay);
+        }
+        ImGui::Text("%llu captures, %llu uploads, %llu failures",
+                    (unsigned long long)backup.captures, (unsigned long long)backup.uploads,
+                    (unsigned long long)backup.failures);
+        if (backup.lastResult != BackupResult::None) {
+          long long ago = static_cast<long long>(std::time(nullptr)) - backup.lastResultAt;
+          ImGui::SameLine();
+          ImGui::TextColored(backup.lastResult == BackupResult::Succeeded ? ImVec4(0.0f, 1.0f, 0.0f, 1.0f) : ImVec4(1.0f, 0.4f, 0.4f, 1.0f),
+                             "last %s %llds ago", backup.lastResult == BackupResult::Succeeded ? "succeeded" : "failed", ago);
+        }
+        if (backup.nextCaptureAt > 0) {
+          long long next = std::max(0LL, static_cast<long long>(backup.nextCaptureAt - std::time(nullptr)));
+          ImGui::SameLine();
+          ImGui::Text(", next capture in %llds", next);
+        }
+
         ImGui::Separator();
         ImGui::Text("Logger:");
-        ImGui::BeginChild("ScrollingText", ImVec2(0, 0), true,
-          ImGuiWindowFlags_HorizontalScrollbar |
-          ImGuiWindowFlags_AlwaysVerticalScrollbar);
-
-        // Store the text for potential copying
-        std::string fullLogText = fileSaver.m_logger;
-
-        // Check if the child window is clicked
-        if (ImGui::IsWindowHovered() && ImGui::IsMouseClicked(ImGuiMouseButton_Left)) {
-          // Copy the entire log text to clipboard
-          ImGui::SetClipboardText(fullLogText.c_str());
-
-          // Optional: Provide visual feedback
-          // You can set a flag to show a temporary message
+        logView.update(fileSaver.m_log);
+        if (logView.draw(fileSaver.m_log)) {
           showCopiedMessage = true;
           copyTime = std::chrono::steady_clock::now();
         }
 
-        ImGui::TextWrapped("%s", fullLogText.c_str());
-
-        // Auto-scroll to bottom if new text was added
-        if (auto_scroll && ImGui::GetScrollY() >= ImGui::GetScrollMaxY() - 1.0f) {
-          ImGui::SetScrollHereY(1.0f);
-        }
-
-        ImGui::EndChild();
-
 
         if (showCopiedMessage) {
           auto now = std::chrono::steady_clock::now();
@@ -412,21 +947,40 @@ int main(int argc, char* argv[]) {
         file_path = ImGuiFileDialog::Instance()->GetCurrentPath();
 
         // Set the file path in your FileSaver
-        fileSaver.m_filePath = file_path_name;
-        fileSaver.m_isFilePathSet = true;
-        fileSaver.m_logger += "File selected: " + file_path_name + "\n";
-        fileSaver.m_logger += "File size: " +
-          std::to_string(std::filesystem::file_size(file_path_name)) +
-          " bytes\n";
+        fileSaver.setFilePath(file_path_name);
+        fileSaver.log("File selected: " + file_path_name + "\n");
+        std::string selected = file_path_name;
+        tasks.submit("File size of " + selected, [&fileSaver, selected](std::string&) {
+          std::error_code error;
+          uintmax_t size = std::filesystem::file_size(selected, error);
+          if (!error) {
+            fileSaver.log("File size: " + std::to_string(size) + " bytes\n");
+          }
+          return !error;
+        });
       }
 
       else {
-        fileSaver.m_logger += "File selection canceled.\n";
+        fileSaver.log("File selection canceled.\n");
       }
       // Always close the dialog
       ImGuiFileDialog::Instance()->Close();
     }
 
+    if (ImGuiFileDialog::Instance()->Display("ChooseFolderDlgKey")) {
+      if (ImGuiFileDialog::Instance()->IsOk()) {
+        file_path_name = ImGuiFileDialog::Instance()->GetCurrentPath();
+        file_path = file_path_name;
+
+        fileSaver.setFilePath(file_path_name);
+        fileSaver.log("Folder selected: " + file_path_name + "\n");
+      }
+      else {
+        fileSaver.log("Folder selection canceled.\n");
+      }
+      ImGuiFileDialog::Instance()->Close();
+    }
+
     
 
     // Rendering
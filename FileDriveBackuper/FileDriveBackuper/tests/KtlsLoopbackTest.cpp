@@ -0,0 +1,263 @@
+// Uploads through KtlsUploader to a TLS stand-in server on 127.0.0.1 and
+// checks that the headers and the file body arrive intact and that both a
+// Content-Length and a chunked reply come back as plain JSON.
+//
+// Linux with OpenSSL 3 only; the uploader does not exist elsewhere. Build and
+// run from this directory:
+//   g++ -std=c++17 -O2 -Iinclude tests/KtlsLoopbackTest.cpp -o ktls_loopback_test -lssl -lcrypto -lcurl -pthread
+//   ./ktls_loopback_test
+// Exits 0 on success, 1 on a failure and 77 (skipped) when the kernel cannot
+// take the TLS session, e.g. without the tls module (modprobe tls).
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "KtlsUploader.h"
+
+#ifndef KTLS_UPLOAD_SUPPORTED
+
+int main() {
+  std::cout << "Kernel TLS uploads are not built on this platform, skipped" << std::endl;
+  return 77;
+}
+
+#else
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const std::string& what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+// Self-signed certificate for "localhost" that is also its own CA
+bool makeCertificate(EVP_PKEY*& key, X509*& certificate) {
+  key = EVP_EC_gen("P-256");
+  certificate = X509_new();
+  if (!key || !certificate) {
+    return false;
+  }
+  X509_set_version(certificate, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(certificate), -60);
+  X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+  X509_set_pubkey(certificate, key);
+  X509_NAME* name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+
+  X509V3_CTX extensions;
+  X509V3_set_ctx_nodb(&extensions);
+  X509V3_set_ctx(&extensions, certificate, certificate, nullptr, nullptr, 0);
+  const char* values[][2] = { { "subjectAltName", "DNS:localhost" }, { "basicConstraints", "critical,CA:TRUE" } };
+  for (const auto& value : values) {
+    X509_EXTENSION* made = X509V3_EXT_conf(nullptr, &extensions, value[0], value[1]);
+    if (!made) {
+      return false;
+    }
+    X509_add_ext(certificate, made, -1);
+    X509_EXTENSION_free(made);
+  }
+  return X509_sign(certificate, key, EVP_sha256()) > 0;
+}
+
+// Serves one request: reads the head and Content-Length bytes of body, then
+// answers with reply. head and body receive what arrived.
+class StandInServer
+{
+public:
+  bool start(EVP_PKEY* key, X509* certificate) {
+    m_ctx = SSL_CTX_new(TLS_server_method());
+    if (!m_ctx || SSL_CTX_use_certificate(m_ctx, certificate) != 1 || SSL_CTX_use_PrivateKey(m_ctx, key) != 1) {
+      return false;
+    }
+    m_listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (m_listener < 0 || bind(m_listener, reinterpret_cast<sockaddr*>(&address), length) != 0 ||
+        listen(m_listener, 1) != 0 || getsockname(m_listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+      return false;
+    }
+    port = std::to_string(ntohs(address.sin_port));
+    return true;
+  }
+
+  ~StandInServer() {
+    if (m_listener >= 0) {
+      ::close(m_listener);
+    }
+    SSL_CTX_free(m_ctx);
+  }
+
+  void serveOne(const std::string& reply) {
+    head.clear();
+    body.clear();
+    int fd = accept(m_listener, nullptr, nullptr);
+    if (fd < 0) {
+      return;
+    }
+    timeval stall = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+    SSL* ssl = SSL_new(m_ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) == 1) {
+      std::string raw;
+      char buffer[64 * 1024];
+      size_t headerEnd = std::string::npos;
+      uint64_t contentLength = 0;
+      size_t n = 0;
+      while ((headerEnd == std::string::npos || raw.size() - headerEnd < contentLength) &&
+             SSL_read_ex(ssl, buffer, sizeof(buffer), &n) == 1) {
+        raw.append(buffer, n);
+        if (headerEnd == std::string::npos && raw.find("\r\n\r\n") != std::string::npos) {
+          headerEnd = raw.find("\r\n\r\n") + 4;
+          head = raw.substr(0, headerEnd);
+          size_t at = head.find("Content-Length: ");
+          contentLength = at == std::string::npos ? 0 : std::strtoull(head.c_str() + at + 16, nullptr, 10);
+        }
+      }
+      if (headerEnd != std::string::npos) {
+        body = raw.substr(headerEnd);
+        SSL_write_ex(ssl, reply.data(), reply.size(), &n);
+      }
+      SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    ::close(fd);
+  }
+
+  std::string port;
+  std::string head;
+  std::string body;
+
+private:
+  SSL_CTX* m_ctx = nullptr;
+  int m_listener = -1;
+};
+
+} // namespace
+
+int main() {
+  EVP_PKEY* key = nullptr;
+  X509* certificate = nullptr;
+  if (!makeCertificate(key, certificate)) {
+    std::cerr << "Cannot create a test certificate" << std::endl;
+    return 1;
+  }
+
+  std::filesystem::path directory = std::filesystem::temp_directory_path() / "ktls_loopback_test";
+  std::filesystem::create_directories(directory);
+  std::filesystem::path caFile = directory / "ca.pem";
+  FILE* pem = std::fopen(caFile.c_str(), "w");
+  if (!pem || PEM_write_X509(pem, certificate) != 1) {
+    std::cerr << "Cannot write " << caFile << std::endl;
+    return 1;
+  }
+  std::fclose(pem);
+
+  // Several sendfile slices, and a last one that is not full
+  std::string content(3 * 1024 * 1024 + 12345, '\0');
+  std::mt19937 rng(7);
+  for (auto& c : content) {
+    c = static_cast<char>(rng());
+  }
+  std::filesystem::path bodyPath = directory / "body.bin";
+  std::ofstream(bodyPath, std::ios::binary).write(content.data(), static_cast<std::streamsize>(content.size()));
+
+  StandInServer server;
+  if (!server.start(key, certificate)) {
+    std::cerr << "Cannot start the stand-in server" << std::endl;
+    return 1;
+  }
+
+  const std::string json = "{\"fileId\":\"4_z_test\",\"fileName\":\"a/b.bin\"}";
+  struct Reply {
+    const char* name;
+    std::string text;
+  };
+  const Reply replies[] = {
+    { "Content-Length reply",
+      "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+      std::to_string(json.size()) + "\r\n\r\n" + json },
+    { "chunked reply",
+      "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n" +
+      std::string("10\r\n") + json.substr(0, 16) + "\r\n" +
+      [&] { char size[16]; std::snprintf(size, sizeof(size), "%zx", json.size() - 16); return std::string(size); }() +
+      ";ext=1\r\n" + json.substr(16) + "\r\n0\r\n\r\n" },
+  };
+
+  TransferTimeouts timeouts;
+  for (const auto& reply : replies) {
+    std::thread serving([&] { server.serveOne(reply.text); });
+
+    KtlsUploader uploader(timeouts);
+    uploader.caFile = caFile.string();
+    uploader.connectHost = "127.0.0.1";
+    uploader.connectPort = server.port;
+    long httpCode = 0;
+    std::string response;
+    TransferError error = TransferError::None;
+    KtlsResult result = uploader.post("https://localhost/b2api/v2/b2_upload_file/bucket",
+                                      { "Authorization: upload-token", "X-Bz-File-Name: a/b.bin" },
+                                      bodyPath, content.size(), httpCode, response, error);
+    serving.join();
+
+    if (result == KtlsResult::Unsupported) {
+      std::cout << "The kernel cannot take the TLS session here, skipped" << std::endl;
+      return 77;
+    }
+    check(result == KtlsResult::Sent, std::string(reply.name) + ": upload was not sent");
+    check(httpCode == 200 && error == TransferError::None, std::string(reply.name) + ": status " + std::to_string(httpCode));
+    check(response == json, std::string(reply.name) + ": response body was \"" + response + "\"");
+    check(server.head.compare(0, 47, "POST /b2api/v2/b2_upload_file/bucket HTTP/1.1\r\n") == 0,
+          std::string(reply.name) + ": request line");
+    check(server.head.find("\r\nHost: localhost\r\n") != std::string::npos, std::string(reply.name) + ": Host header");
+    check(server.head.find("\r\nAuthorization: upload-token\r\n") != std::string::npos,
+          std::string(reply.name) + ": Authorization header");
+    check(server.body == content, std::string(reply.name) + ": body differs from the file");
+  }
+
+  // A server whose certificate is not trusted must not get the body
+  {
+    std::thread serving([&] { server.serveOne(replies[0].text); });
+    KtlsUploader uploader(timeouts);
+    uploader.connectHost = "127.0.0.1";
+    uploader.connectPort = server.port;
+    long httpCode = 0;
+    std::string response;
+    TransferError error = TransferError::None;
+    KtlsResult result = uploader.post("https://localhost/b2api/v2/b2_upload_file/bucket", {},
+                                      bodyPath, content.size(), httpCode, response, error);
+    serving.join();
+    check(result == KtlsResult::Failed && server.body.empty(), "untrusted certificate was accepted");
+  }
+
+  std::filesystem::remove_all(directory);
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+  if (failures > 0) {
+    return 1;
+  }
+  std::cout << "Kernel TLS loopback upload passed" << std::endl;
+  return 0;
+}
+
+#endif